@@ -0,0 +1,457 @@
+/*
+ * Copyright 2015 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <error.h>
+#include <linux/can/error.h>
+
+#include "canqv.h"
+
+/*
+ * Vector ASC traces
+ *
+ * Both directions stream through a fixed buffer, with plain read/write.
+ * Lines are parsed by hand, lines that are no classic CAN frame or error
+ * frame (headers, comments, CAN FD, statistics) are skipped.
+ * An ErrorFrame carries no error class, it becomes CAN_ERR_FLAG alone.
+ * ASC channel N becomes interface "chN", with ifindex -N.
+ */
+#define ASC_BUFSIZE	(1 << 20)
+
+int asc_simclock;
+
+/* reader */
+static int rfd = -1;
+static char rbuf[ASC_BUFSIZE];
+static size_t rhead, rtail;
+static int reof;
+static int decbase, relative;
+static double tprev, tbase;
+static unsigned long nlines, nread, nfiltered;
+/* replay throughput, open until close */
+static struct timespec rstart;
+static double rtime;
+static uint8_t chanseen[256];
+
+/* writer */
+static int wfd = -1;
+static char wbuf[ASC_BUFSIZE];
+static size_t wlen;
+static double wt0;
+static unsigned long nwritten;
+/* flush before this, whole lines only */
+static size_t wlimit = sizeof (wbuf);
+
+int asc_open(const char *file) {
+    rfd = open(file, O_RDONLY);
+    if (rfd < 0)
+        error(1, errno, "open %s", file);
+    posix_fadvise(rfd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    /* trace time starts now, so latencies stay sane */
+    tbase = asc_simclock ? 0 : now();
+    clock_gettime(CLOCK_MONOTONIC, &rstart);
+    return 0;
+}
+
+/* returns the next line, without newline, or NULL at the end */
+static char *next_line(char **endp) {
+    char *line, *nl;
+    ssize_t ret;
+
+    for (;;) {
+        nl = memchr(rbuf + rtail, '\n', rhead - rtail);
+        if (nl) {
+            line = rbuf + rtail;
+            rtail = nl + 1 - rbuf;
+            *endp = nl;
+            return line;
+        }
+        if (reof) {
+            if (rtail >= rhead)
+                return NULL;
+            /* last line without newline */
+            line = rbuf + rtail;
+            *endp = rbuf + rhead;
+            rtail = rhead;
+            return line;
+        }
+        if (!rtail && rhead == sizeof (rbuf)) {
+            /* insane line, drop it */
+            rhead = rtail = 0;
+        }
+        if (rtail) {
+            memmove(rbuf, rbuf + rtail, rhead - rtail);
+            rhead -= rtail;
+            rtail = 0;
+        }
+        ret = read(rfd, rbuf + rhead, sizeof (rbuf) - rhead);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            error(1, errno, "read asc");
+        if (!ret)
+            reof = 1;
+        rhead += ret;
+    }
+}
+
+static inline const char *skipspace(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t'))
+        ++p;
+    return p;
+}
+
+/* parse a number in base, returns NULL when there is none */
+static const char *number(const char *p, const char *end, int base,
+        unsigned long *pval) {
+    const char *start = p;
+    unsigned long val = 0;
+    int d;
+
+    for (; p < end; ++p) {
+        d = hexval(*p);
+        if (d < 0 || d >= base)
+            break;
+        val = val * base + d;
+    }
+    *pval = val;
+    return (p > start) ? p : NULL;
+}
+
+static const char *timestamp(const char *p, const char *end, double *pt) {
+    unsigned long ip, frac = 0, div = 1;
+
+    p = number(p, end, 10, &ip);
+    if (!p)
+        return NULL;
+    if (p < end && *p == '.') {
+        for (++p; p < end && *p >= '0' && *p <= '9'; ++p) {
+            if (div < 1000000000UL) {
+                frac = frac * 10 + *p - '0';
+                div *= 10;
+            }
+        }
+    }
+    *pt = ip + (double)frac / div;
+    return p;
+}
+
+static void header(const char *p, const char *end) {
+    if (memmem(p, end - p, "base dec", 8))
+        decbase = 1;
+    else if (memmem(p, end - p, "base hex", 8))
+        decbase = 0;
+    if (memmem(p, end - p, "timestamps relative", 19))
+        relative = 1;
+    else if (memmem(p, end - p, "timestamps absolute", 19))
+        relative = 0;
+}
+
+/* returns 1 when a frame was parsed into f & ifindex */
+static int parse(const char *p, const char *end, struct canqv_frame *f,
+        int *ifindex) {
+    int base = decbase ? 10 : 16;
+    unsigned long chan, id, dlc, val;
+    double t;
+    int j;
+    char name[8];
+
+    p = skipspace(p, end);
+    if (p >= end)
+        return 0;
+    if (*p < '0' || *p > '9') {
+        header(p, end);
+        return 0;
+    }
+    p = timestamp(p, end, &t);
+    if (!p)
+        return 0;
+    if (relative) {
+        t += tprev;
+        tprev = t;
+    }
+    p = number(skipspace(p, end), end, 10, &chan);
+    if (!p || !chan || chan > 255)
+        /* Start of measurement, CANFD, ... */
+        return 0;
+    p = skipspace(p, end);
+    memset(&f->cf, 0, sizeof (f->cf));
+    if (end - p >= 10 && !memcmp(p, "ErrorFrame", 10)) {
+        /* the trace does not tell the error class */
+        f->cf.can_id = CAN_ERR_FLAG;
+        f->cf.can_dlc = CAN_ERR_DLC;
+        goto frame;
+    }
+    p = number(p, end, base, &id);
+    if (!p)
+        return 0;
+    if (p < end && *p == 'x') {
+        f->cf.can_id = (id & CAN_EFF_MASK) | CAN_EFF_FLAG;
+        ++p;
+    } else
+        f->cf.can_id = id & CAN_SFF_MASK;
+    if (p >= end || (*p != ' ' && *p != '\t'))
+        /* Statistic: ... */
+        return 0;
+    p = skipspace(p, end);
+    if (end - p < 3 || (memcmp(p, "Rx", 2) && memcmp(p, "Tx", 2)) ||
+            (p[2] != ' ' && p[2] != '\t'))
+        /* TxRq or so */
+        return 0;
+    p = skipspace(p + 2, end);
+    if (p >= end)
+        return 0;
+    if (*p == 'r') {
+        f->cf.can_id |= CAN_RTR_FLAG;
+        p = number(skipspace(p + 1, end), end, 16, &dlc);
+        f->cf.can_dlc = (p && dlc <= CAN_MAX_DLEN) ? dlc : 0;
+    } else if (*p == 'd') {
+        p = number(skipspace(p + 1, end), end, 16, &dlc);
+        if (!p || dlc > CAN_MAX_DLEN)
+            return 0;
+        f->cf.can_dlc = dlc;
+        for (j = 0; j < dlc; ++j) {
+            p = skipspace(p, end);
+            if (base == 16 && end - p >= 2 && hextab[(uint8_t)p[0]] &&
+                    hextab[(uint8_t)p[1]] && (end - p == 2 || p[2] == ' ')) {
+                /* the common case */
+                f->cf.data[j] = hexval(p[0]) << 4 | hexval(p[1]);
+                p += 2;
+                continue;
+            }
+            p = number(p, end, base, &val);
+            if (!p)
+                return 0;
+            f->cf.data[j] = val;
+        }
+    } else
+        return 0;
+
+frame:
+    if (can_filtered(f->cf.can_id)) {
+        ++nfiltered;
+        return 0;
+    }
+    if (!chanseen[chan]) {
+        sprintf(name, "ch%lu", chan);
+        iface_register(name, -chan);
+        chanseen[chan] = 1;
+    }
+    f->t = tbase + t;
+    *ifindex = -chan;
+    return 1;
+}
+
+int asc_read_batch(struct rxbatch *b) {
+    char *line, *end;
+
+    b->n = 0;
+    while (b->n < RXBATCH) {
+        line = next_line(&end);
+        if (!line)
+            break;
+        ++nlines;
+        if (parse(line, end, b->f + b->n, b->ifindex + b->n))
+            ++b->n;
+    }
+    nread += b->n;
+    return b->n;
+}
+
+void asc_close_read(void) {
+    struct timespec ts;
+
+    if (rfd < 0)
+        return;
+    close(rfd);
+    rfd = -1;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    rtime = (ts.tv_sec - rstart.tv_sec) + (ts.tv_nsec - rstart.tv_nsec) / 1e9;
+}
+
+/* writer */
+static void flush(void) {
+    size_t done;
+    ssize_t ret;
+
+    if (aw_bufsize) {
+        aw_write(wbuf, wlen);
+        wlen = 0;
+        return;
+    }
+    TRACE_BEGIN("asc write");
+    for (done = 0; done < wlen; done += ret) {
+        ret = write(wfd, wbuf + done, wlen - done);
+        if (ret < 0 && errno == EINTR)
+            ret = 0;
+        else if (ret < 0)
+            error(1, errno, "write asc");
+    }
+    TRACE_END("asc write");
+    wlen = 0;
+}
+
+static void puts_w(const char *str) {
+    size_t len = strlen(str);
+
+    if (wlen + len > sizeof (wbuf))
+        flush();
+    memcpy(wbuf + wlen, str, len);
+    wlen += len;
+}
+
+static const char hexdigits[] = "0123456789ABCDEF";
+static char hexpairs[256][2];
+
+int asc_create(const char *file) {
+    char line[128];
+    time_t t;
+    int j;
+
+    if (aw_bufsize)
+        wfd = aw_open(file);
+    else
+        wfd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (wfd < 0)
+        error(1, errno, "open %s", file);
+    for (j = 0; j < 256; ++j) {
+        hexpairs[j][0] = hexdigits[j >> 4];
+        hexpairs[j][1] = hexdigits[j & 0xf];
+    }
+    if (aw_bufsize && aw_bufsize < wlimit)
+        /* hand over at most 1 aligned buffer at once */
+        wlimit = aw_bufsize;
+    time(&t);
+    strftime(line, sizeof (line), "date %a %b %d %I:%M:%S.000 %p %Y\n",
+            localtime(&t));
+    puts_w(line);
+    puts_w("base hex  timestamps absolute\n");
+    puts_w("internal events logged\n");
+    puts_w("// version 7.0.0\n");
+    strftime(line, sizeof (line), "Begin Triggerblock %a %b %d "
+            "%I:%M:%S.000 %p %Y\n", localtime(&t));
+    puts_w(line);
+    puts_w("   0.000000 Start of measurement\n");
+    wt0 = NAN;
+    return 0;
+}
+
+/* right aligned decimal, in at least width digits */
+static char *putdec(char *p, unsigned long val, int width, char pad) {
+    char tmp[24];
+    int n = 0;
+
+    do {
+        tmp[n++] = '0' + val % 10;
+        val /= 10;
+    } while (val);
+    for (; width > n; --width)
+        *p++ = pad;
+    while (n)
+        *p++ = tmp[--n];
+    return p;
+}
+
+void asc_write(const struct canqv_frame *f, int iface) {
+    char *p, *id;
+    unsigned long long usec;
+    double dt;
+    canid_t can_id = f->cf.can_id, mask;
+    int j, ifindex;
+
+    if (wfd < 0)
+        return;
+    if (wlen + 128 > wlimit)
+        flush();
+    if (isnan(wt0))
+        /* converting keeps the trace time */
+        wt0 = (rfd >= 0) ? tbase : f->t;
+    dt = f->t - wt0;
+    usec = (dt > 0) ? (unsigned long long)(dt * 1e6 + 0.5) : 0;
+    p = wbuf + wlen;
+    p = putdec(p, usec / 1000000, 4, ' ');
+    *p++ = '.';
+    p = putdec(p, usec % 1000000, 6, '0');
+    *p++ = ' ';
+    /* ASC channels keep their number */
+    ifindex = iface_ifindex(iface);
+    p = putdec(p, (ifindex < 0) ? -ifindex : iface + 1, 0, ' ');
+    *p++ = ' ';
+    *p++ = ' ';
+    if (can_id & CAN_ERR_FLAG) {
+        memcpy(p, "ErrorFrame\n", 11);
+        wlen = p + 11 - wbuf;
+        ++nwritten;
+        return;
+    }
+    id = p;
+    mask = (can_id & CAN_EFF_FLAG) ? CAN_EFF_MASK : CAN_SFF_MASK;
+    /* no leading zeros */
+    for (j = 28; j > 0 && !((can_id & mask) >> j); j -= 4)
+        ;
+    for (; j >= 0; j -= 4)
+        *p++ = hexdigits[((can_id & mask) >> j) & 0xf];
+    if (can_id & CAN_EFF_FLAG)
+        *p++ = 'x';
+    while (p - id < 16)
+        *p++ = ' ';
+    memcpy(p, "Rx   ", 5);
+    p += 5;
+    if (can_id & CAN_RTR_FLAG) {
+        *p++ = 'r';
+    } else {
+        *p++ = 'd';
+        *p++ = ' ';
+        *p++ = '0' + f->cf.can_dlc;
+        for (j = 0; j < f->cf.can_dlc; ++j) {
+            *p++ = ' ';
+            memcpy(p, hexpairs[f->cf.data[j]], 2);
+            p += 2;
+        }
+    }
+    *p++ = '\n';
+    wlen = p - wbuf;
+    ++nwritten;
+}
+
+void asc_close_write(void) {
+    if (wfd < 0)
+        return;
+    puts_w("End TriggerBlock\n");
+    flush();
+    if (aw_bufsize)
+        aw_close();
+    else
+        close(wfd);
+    wfd = -1;
+}
+
+void asc_report(FILE *fp) {
+    if (nlines)
+        fprintf(fp, "asc: %lu lines, %lu frames, %lu filtered, "
+                "%.0lf frames/s\n", nlines, nread, nfiltered,
+                rtime > 0 ? nread / rtime : 0.0);
+    if (nwritten)
+        fprintf(fp, "asc: %lu frames written\n", nwritten);
+}
@@ -0,0 +1,235 @@
+/*
+ * Copyright 2015 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <error.h>
+#include <pthread.h>
+
+#include "canqv.h"
+
+/*
+ * aligned log writer, for flash media
+ *
+ * Records collect in 1 of 2 aligned buffers of aw_bufsize (best the
+ * erase block size of the card). A full buffer is handed to a writer
+ * thread, and the other buffer takes over.
+ * The card only sees whole buffers, at aligned offsets, with O_DIRECT.
+ * Where O_DIRECT is refused, buffered writes are pushed out with
+ * sync_file_range, and the previous buffer is waited for & dropped
+ * from the page cache, so dirty data stays bounded too.
+ * When the card falls behind by more than 1 buffer, records are dropped
+ * instead of stalling capture.
+ */
+#define AW_ALIGN	4096
+#define AW_MINSIZE	(64 << 10)
+
+size_t aw_bufsize;
+
+static int fd = -1;
+static int direct;
+static uint8_t *bufs[2];
+static int cur;
+static size_t fill;
+static off_t offset;
+
+static pthread_t thr;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+/* buffer in flight, or -1 */
+static int busy = -1;
+static size_t busylen;
+static int stopping;
+
+static unsigned long nwrites, ndropped;
+static unsigned long long nbytes, ndropbytes;
+static size_t minwrite, maxwrite;
+static double maxlat;
+
+static double mono(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void write_buf(const uint8_t *dat, size_t len) {
+    size_t todo, done;
+    ssize_t ret;
+    double t0, lat;
+
+    t0 = mono();
+    /* O_DIRECT needs whole blocks, the tail is truncated on close */
+    todo = direct ? (len + AW_ALIGN - 1) & ~(AW_ALIGN - 1) : len;
+    for (done = 0; done < todo; done += ret) {
+        ret = pwrite(fd, dat + done, todo - done, offset + done);
+        if (ret < 0 && errno == EINTR)
+            ret = 0;
+        else if (ret < 0)
+            error(1, errno, "write log");
+    }
+    if (!direct) {
+        sync_file_range(fd, offset, len, SYNC_FILE_RANGE_WRITE);
+        if (offset) {
+            /* the previous buffer must be on the card by now */
+            sync_file_range(fd, 0, offset, SYNC_FILE_RANGE_WAIT_BEFORE |
+                    SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(fd, 0, offset, POSIX_FADV_DONTNEED);
+        }
+    }
+    lat = mono() - t0;
+
+    offset += len;
+    ++nwrites;
+    nbytes += len;
+    if (!minwrite || len < minwrite)
+        minwrite = len;
+    if (len > maxwrite)
+        maxwrite = len;
+    if (lat > maxlat)
+        maxlat = lat;
+}
+
+static void *aw_main(void *vp) {
+    int idx;
+    size_t len;
+
+    trace_thread("asc writer");
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (busy < 0 && !stopping)
+            pthread_cond_wait(&cond, &lock);
+        if (busy < 0)
+            break;
+        idx = busy;
+        len = busylen;
+        pthread_mutex_unlock(&lock);
+        TRACE_BEGIN("write");
+        write_buf(bufs[idx], len);
+        TRACE_END("write");
+        pthread_mutex_lock(&lock);
+        busy = -1;
+        pthread_cond_broadcast(&cond);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+int aw_open(const char *file) {
+    int j, ret;
+
+    aw_bufsize = (aw_bufsize + AW_ALIGN - 1) & ~(AW_ALIGN - 1);
+    if (aw_bufsize < AW_MINSIZE)
+        aw_bufsize = AW_MINSIZE;
+    fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0666);
+    direct = fd >= 0;
+    if (fd < 0 && errno == EINVAL)
+        /* filesystem without O_DIRECT */
+        fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        error(1, errno, "open %s", file);
+    for (j = 0; j < 2; ++j) {
+        bufs[j] = mem_memalign(MEM_LOG, AW_ALIGN, aw_bufsize);
+        if (!bufs[j])
+            error(1, errno, "posix_memalign");
+        rt_prefault(bufs[j], aw_bufsize);
+    }
+    ret = pthread_create(&thr, NULL, aw_main, NULL);
+    if (ret)
+        error(1, ret, "pthread_create");
+    return fd;
+}
+
+/* hand the full buffer to the writer, and switch */
+static void submit(void) {
+    pthread_mutex_lock(&lock);
+    while (busy >= 0)
+        pthread_cond_wait(&cond, &lock);
+    busy = cur;
+    busylen = fill;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    cur ^= 1;
+    fill = 0;
+}
+
+void aw_write(const void *vdat, size_t len) {
+    const uint8_t *dat = vdat;
+    size_t n;
+    int behind;
+
+    if (fd < 0)
+        return;
+    if (fill + len > aw_bufsize) {
+        pthread_mutex_lock(&lock);
+        behind = busy >= 0;
+        pthread_mutex_unlock(&lock);
+        if (behind) {
+            /* the card is behind, drop whole records */
+            ++ndropped;
+            ndropbytes += len;
+            return;
+        }
+    }
+    while (len) {
+        n = aw_bufsize - fill;
+        if (n > len)
+            n = len;
+        memcpy(bufs[cur] + fill, dat, n);
+        fill += n;
+        dat += n;
+        len -= n;
+        /* only whole buffers go out, so offsets stay aligned */
+        if (fill >= aw_bufsize)
+            submit();
+    }
+}
+
+void aw_close(void) {
+    if (fd < 0)
+        return;
+    if (fill) {
+        memset(bufs[cur] + fill, 0, aw_bufsize - fill);
+        submit();
+    }
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thr, NULL);
+    if (direct && ftruncate(fd, offset) < 0)
+        error(0, errno, "truncate log");
+    close(fd);
+    fd = -1;
+    mem_free(bufs[0]);
+    mem_free(bufs[1]);
+}
+
+void aw_report(FILE *fp) {
+    if (!nwrites && !ndropped)
+        return;
+    fprintf(fp, "awrite: %s, %lu writes of %zu/%llu/%zu KiB min/avg/max, "
+            "worst latency %.1lfms, %lu dropped (%llu bytes)\n",
+            direct ? "O_DIRECT" : "sync_file_range", nwrites, minwrite >> 10,
+            nwrites ? nbytes / nwrites >> 10 : 0ULL, maxwrite >> 10,
+            maxlat * 1e3, ndropped, ndropbytes);
+}
@@ -0,0 +1,324 @@
+/*
+ * Copyright 2015 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include <error.h>
+#include <net/if.h>
+
+#include "canqv.h"
+#include "probes.h"
+
+double deadtime = 10.0;
+double maxperiod = 2.0;
+/* change events go here, when set */
+FILE *cache_trace;
+
+/* interface table */
+#define MAXIFACE 32
+static struct {
+    char name[IFNAMSIZ];
+    int ifindex;
+} ifaces[MAXIFACE];
+int niface;
+
+int iface_register(const char *name, int ifindex) {
+    if (niface >= MAXIFACE)
+        error(1, 0, "too many interfaces");
+    snprintf(ifaces[niface].name, sizeof (ifaces[niface].name), "%s", name);
+    ifaces[niface].ifindex = ifindex;
+    return niface++;
+}
+
+int iface_from_ifindex(int ifindex) {
+    int j;
+    char name[IFNAMSIZ];
+
+    for (j = 0; j < niface; ++j) {
+        if (ifaces[j].ifindex == ifindex)
+            return j;
+    }
+    if (!if_indextoname(ifindex, name))
+        sprintf(name, "#%i", ifindex);
+    return iface_register(name, ifindex);
+}
+
+const char *iface_name(int iface) {
+    return (iface >= 0 && iface < niface) ? ifaces[iface].name : "?";
+}
+
+int iface_ifindex(int iface) {
+    return (iface >= 0 && iface < niface) ? ifaces[iface].ifindex : 0;
+}
+
+/* cache */
+static inline canid_t cache_key(canid_t can_id) {
+    if (j1939 && (can_id & CAN_EFF_FLAG))
+        return j1939_key(can_id);
+    return can_id;
+}
+
+int cmpcache(const void *va, const void *vb) {
+    const struct cache *a = va, *b = vb;
+
+    if (a->key != b->key)
+        return (a->key > b->key) ? 1 : -1;
+    return a->iface - b->iface;
+}
+
+static void print_entry(FILE *fp, const struct cache *c) {
+    int j;
+
+    if (c->cf.can_id & CAN_ERR_FLAG)
+        /* as candump */
+        fprintf(fp, " %s %08x", iface_name(c->iface),
+                c->cf.can_id & (CAN_ERR_FLAG | CAN_ERR_MASK));
+    else
+        fprintf(fp, " %s %0*x", iface_name(c->iface),
+                (c->cf.can_id & CAN_EFF_FLAG) ? 8 : 3,
+                c->cf.can_id & ((c->cf.can_id & CAN_EFF_FLAG) ?
+                    CAN_EFF_MASK : CAN_SFF_MASK));
+    if (c->cf.can_id & CAN_RTR_FLAG) {
+        fprintf(fp, " R%i", c->cf.can_dlc);
+        return;
+    }
+    fprintf(fp, " [%i]", c->cf.can_dlc);
+    for (j = 0; j < c->cf.can_dlc && j < CAN_MAX_DLEN; ++j)
+        fprintf(fp, " %02x", c->cf.data[j]);
+}
+
+static void trace(const char *what, const struct cache *c, double t) {
+    fprintf(cache_trace, "%s %.6lf", what, t);
+    print_entry(cache_trace, c);
+    fputc('\n', cache_trace);
+}
+
+/* binary search, leaves *pos at the insert position when not found */
+static struct cache *cache_search(const struct cachetab *tab, canid_t key,
+        int iface, size_t *pos) {
+    struct cache *curr;
+    size_t lo, hi, mid;
+    int ret;
+
+    lo = 0;
+    hi = tab->n;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        curr = tab->cache + mid;
+        if (curr->key != key)
+            ret = (curr->key > key) ? 1 : -1;
+        else
+            ret = curr->iface - iface;
+        if (!ret)
+            return curr;
+        else if (ret > 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    *pos = lo;
+    return NULL;
+}
+
+struct cache *cache_find(const struct cachetab *tab, int iface,
+        canid_t can_id) {
+    size_t pos;
+
+    return cache_search(tab, cache_key(can_id), iface, &pos);
+}
+
+/* flag a changed payload, and keep the frame */
+static void store(struct cache *curr, const struct can_frame *cf) {
+    if ((curr->cf.can_dlc != cf->can_dlc) ||
+            memcmp(curr->cf.data, cf->data, cf->can_dlc))
+        curr->flags |= F_DIRTY | F_CHANGED;
+    else
+        curr->flags &= ~F_CHANGED;
+    curr->cf = *cf;
+}
+
+struct cache *cache_update(struct cachetab *tab, int iface,
+        const struct can_frame *cf, double t) {
+    struct cache *curr;
+    size_t lo;
+    canid_t key = cache_key(cf->can_id);
+
+    curr = cache_search(tab, key, iface, &lo);
+    if (curr) {
+        store(curr, cf);
+        curr->period = t - curr->lastrx;
+        if (curr->period > maxperiod)
+            curr->period = NAN;
+        curr->lastrx = t;
+        if (cache_trace && (curr->flags & F_CHANGED))
+            trace("chg", curr, t);
+        return curr;
+    }
+
+    if (tab->n >= tab->s) {
+        /* grow cache */
+        curr = mem_realloc(MEM_CACHE, tab->cache,
+                sizeof (*tab->cache) * (tab->s + 16));
+        if (!curr)
+            /* beyond the cap, new IDs are not cached */
+            return NULL;
+        tab->cache = curr;
+        tab->s += 16;
+    }
+    /* add in cache */
+    curr = tab->cache + lo;
+    memmove(curr + 1, curr, (tab->n - lo) * sizeof (*curr));
+    ++tab->n;
+    memset(curr, 0, sizeof (*curr));
+    curr->flags |= F_DIRTY | F_CHANGED;
+    curr->cf = *cf;
+    curr->key = key;
+    curr->iface = iface;
+    curr->period = NAN;
+    curr->lastrx = t;
+    curr->plugin = plugin_lookup(cf->can_id);
+    PROBE3(cache_insert, iface, cf->can_id, tab->n);
+    if (cache_trace)
+        trace("new", curr, t);
+    return curr;
+}
+
+struct cache *cache_touch(struct cachetab *tab, int iface,
+        const struct can_frame *cf, double t) {
+    struct cache *curr;
+    size_t lo;
+
+    curr = cache_search(tab, cache_key(cf->can_id), iface, &lo);
+    if (!curr)
+        return cache_update(tab, iface, cf, t);
+    store(curr, cf);
+    /* the next full update measures the period from here */
+    curr->lastrx = t;
+    if (cache_trace && (curr->flags & F_CHANGED))
+        trace("chg", curr, t);
+    return curr;
+}
+
+void cache_expire(struct cachetab *tab, double t) {
+    struct cache *curr;
+    size_t row;
+    double lastseen;
+
+    for (row = 0; row < tab->n; ++row) {
+        curr = tab->cache + row;
+        lastseen = t - curr->lastrx;
+
+        if (lastseen > deadtime) {
+            PROBE3(cache_expire, curr->iface, curr->cf.can_id,
+                    PROBE_USEC(lastseen));
+            if (cache_trace)
+                trace("exp", curr, t);
+            /* delete this entry */
+            memmove(curr, curr + 1, (tab->n - row - 1) * sizeof (*curr));
+            --tab->n;
+            --row;
+            continue;
+        }
+
+        if (!isnan(curr->period) && (lastseen > 2 * curr->period)) {
+            /* reset period */
+            PROBE3(period_reset, curr->iface, curr->cf.can_id,
+                    PROBE_USEC(curr->period));
+            curr->period = NAN;
+        }
+    }
+}
+
+int cache_copy(struct cachetab *dst, const struct cachetab *src) {
+    struct cache *cache;
+
+    if (dst->s < src->n) {
+        cache = mem_realloc(MEM_CACHE, dst->cache,
+                sizeof (*dst->cache) * src->s);
+        if (!cache)
+            return -1;
+        dst->cache = cache;
+        dst->s = src->s;
+    }
+    memcpy(dst->cache, src->cache, src->n * sizeof (*src->cache));
+    dst->n = src->n;
+    return 0;
+}
+
+int cache_merge(struct cachetab *dst, const struct cachetab *const *src,
+        int nsrc) {
+    struct cache *cache;
+    size_t n, pos[nsrc];
+    int j, best;
+
+    for (n = 0, j = 0; j < nsrc; ++j)
+        n += src[j]->n;
+    if (dst->s < n) {
+        cache = mem_realloc(MEM_CACHE, dst->cache, sizeof (*dst->cache) * n);
+        if (!cache)
+            return -1;
+        dst->cache = cache;
+        dst->s = n;
+    }
+    memset(pos, 0, sizeof (pos));
+    /* k-way merge of sorted shards, k is small */
+    for (dst->n = 0; dst->n < n; ++dst->n) {
+        best = -1;
+        for (j = 0; j < nsrc; ++j) {
+            if (pos[j] >= src[j]->n)
+                continue;
+            if (best < 0 || cmpcache(src[j]->cache + pos[j],
+                        src[best]->cache + pos[best]) < 0)
+                best = j;
+        }
+        dst->cache[dst->n] = src[best]->cache[pos[best]++];
+    }
+    return 0;
+}
+
+/* grow up front, so capture does not realloc */
+void cache_reserve(struct cachetab *tab, size_t n) {
+    if (tab->s >= n)
+        return;
+    tab->s = n;
+    tab->cache = mem_realloc(MEM_CACHE, tab->cache,
+            sizeof (*tab->cache) * tab->s);
+    if (!tab->cache)
+        error(1, errno, "reserve cache");
+    rt_prefault(tab->cache, sizeof (*tab->cache) * tab->s);
+}
+
+void cache_dump(FILE *fp, const struct cachetab *tab) {
+    const struct cache *c;
+
+    for (c = tab->cache; c < tab->cache + tab->n; ++c) {
+        fprintf(fp, "cache");
+        print_entry(fp, c);
+        fprintf(fp, " last=%.6lf", c->lastrx);
+        if (!isnan(c->period))
+            fprintf(fp, " period=%.6lf", c->period);
+        fputc('\n', fp);
+    }
+}
+
+void cache_free(struct cachetab *tab) {
+    mem_free(tab->cache);
+    tab->cache = NULL;
+    tab->n = tab->s = 0;
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright 2015 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _CANQV_PLUGIN_H
+#define _CANQV_PLUGIN_H
+
+/*
+ * canqv decoder plugin ABI
+ *
+ * A plugin is a shared object that exports one
+ *	const struct canqv_plugin canqv_plugin;
+ * canqv loads it with -p FILE[:ARG], calls init(ARG) once,
+ * and passes every received frame that falls within one of the
+ * plugin's ID ranges to frames(), in batches, in receive order.
+ * decode() is called when a row is rendered or logged.
+ *
+ * Bump CANQV_PLUGIN_ABI on any incompatible change.
+ */
+#include <stddef.h>
+#include <linux/can.h>
+
+#define CANQV_PLUGIN_ABI	1
+#define CANQV_PLUGIN_SYMBOL	"canqv_plugin"
+
+struct canqv_frame {
+    double t; /* receive time, in seconds */
+    struct can_frame cf;
+};
+
+/* inclusive ID range, add CAN_EFF_FLAG for 29bit ID's */
+struct canqv_range {
+    canid_t lo, hi;
+};
+
+struct canqv_plugin {
+    int abi; /* CANQV_PLUGIN_ABI */
+    const char *name;
+    const struct canqv_range *ranges;
+    int nranges;
+
+    /* returns private data, or NULL on failure. May be NULL */
+    void *(*init)(const char *arg);
+    void (*fini)(void *priv);
+    /* batch of frames, oldest first */
+    void (*frames)(void *priv, const struct canqv_frame *frames, int nframes);
+    /*
+     * write decoded text (or "field=value ..." pairs) of the last frame
+     * with can_id into buf. Return the length, or 0 when nothing decoded.
+     */
+    int (*decode)(void *priv, canid_t can_id, char *buf, size_t len);
+};
+
+extern const struct canqv_plugin canqv_plugin;
+
+#endif
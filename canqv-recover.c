@@ -0,0 +1,159 @@
+/*
+ * Copyright 2015 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <error.h>
+#include <getopt.h>
+
+#include "canqv.h"
+
+/* program options */
+static const char help_msg[] =
+        NAME "-recover: salvage intact blocks of a canqv log\n"
+        "usage:	" NAME "-recover [OPTIONS ...] FILE\n"
+        "\n"
+        "The payload of every intact block goes to stdout, in file order,\n"
+        "a summary goes to stderr.\n"
+        "\n"
+        "Options\n"
+        " -V, --version		Show version\n"
+        " -v, --verbose		Tell about every damaged region & sequence gap\n"
+        "\n"
+        ;
+#ifdef _GNU_SOURCE
+static struct option long_opts[] = {
+    { "help", no_argument, NULL, '?',},
+    { "version", no_argument, NULL, 'V',},
+    { "verbose", no_argument, NULL, 'v',},
+    {},
+};
+#else
+#define getopt_long(argc, argv, optstring, longopts, longindex) \
+        getopt((argc), (argv), (optstring))
+#endif
+static const char optstring[] = "V?v";
+static int verbose;
+
+/* read in large chunks, blocks never straddle more than 1 refill */
+static uint8_t buf[4 << 20];
+
+int main(int argc, char *argv[]) {
+    int opt, fd;
+    const char *file;
+    size_t have, pos, len;
+    ssize_t ret;
+    off_t base, badstart;
+    const struct logblk_hdr *hdr;
+    unsigned long nok, nbad, ngaps;
+    unsigned long long nbytes;
+    uint32_t nextseq;
+    int eof;
+
+    /* argument parsing */
+    while ((opt = getopt_long(argc, argv, optstring, long_opts, NULL)) != -1)
+        switch (opt) {
+            case 'V':
+                fprintf(stderr, "%s-recover %s, "
+                        "Compiled on %s %s\n",
+                        NAME, VERSION, __DATE__, __TIME__);
+                exit(0);
+                break;
+            default:
+                fprintf(stderr, "%s-recover: unknown option '%u'\n\n",
+                        NAME, opt);
+            case '?':
+                fputs(help_msg, stderr);
+                return opt != '?';
+            case 'v':
+                ++verbose;
+                break;
+        }
+    if (!argv[optind]) {
+        fputs(help_msg, stderr);
+        return 1;
+    }
+    file = argv[optind];
+    fd = open(file, O_RDONLY);
+    if (fd < 0)
+        error(1, errno, "open %s", file);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    nok = nbad = ngaps = 0;
+    nbytes = 0;
+    nextseq = 0;
+    badstart = -1;
+    base = 0;
+    have = pos = 0;
+    eof = 0;
+    for (;;) {
+        if (!eof && have - pos < LOGBLK_SIZE) {
+            memmove(buf, buf + pos, have - pos);
+            base += pos;
+            have -= pos;
+            pos = 0;
+            ret = read(fd, buf + have, sizeof (buf) - have);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret < 0)
+                error(1, errno, "read %s", file);
+            if (!ret)
+                eof = 1;
+            have += ret;
+            continue;
+        }
+        if (pos + sizeof (*hdr) > have)
+            break;
+        hdr = (const void *)(buf + pos);
+        len = logblk_check(hdr, have - pos);
+        if (!len) {
+            /* a zero tail is preallocated space, not damage */
+            if (hdr->magic && badstart < 0)
+                badstart = base + pos;
+            if (hdr->magic == LOGBLK_MAGIC)
+                ++nbad;
+            pos += LOGBLK_ALIGN;
+            continue;
+        }
+        if (badstart >= 0 && verbose)
+            error(0, 0, "damaged 0x%llx..0x%llx",
+                    (unsigned long long)badstart,
+                    (unsigned long long)(base + pos));
+        badstart = -1;
+        if (nok && hdr->seq != nextseq) {
+            ++ngaps;
+            if (verbose)
+                error(0, 0, "sequence %u..%u missing", nextseq, hdr->seq - 1);
+        }
+        nextseq = hdr->seq + 1;
+        if (fwrite(hdr + 1, hdr->len, 1, stdout) != 1)
+            error(1, errno, "write");
+        ++nok;
+        nbytes += hdr->len;
+        pos += len;
+    }
+    if (badstart >= 0 && verbose)
+        error(0, 0, "damaged 0x%llx..end", (unsigned long long)badstart);
+    close(fd);
+    fprintf(stderr, "%s: %lu intact blocks, %llu bytes, %lu damaged blocks, "
+            "%lu sequence gaps\n", file, nok, nbytes, nbad, ngaps);
+    return 0;
+}
@@ -19,14 +19,23 @@
 #include <string.h>
 #include <errno.h>
 #include <math.h>
+#include <signal.h>
 #include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <error.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <linux/can.h>
 #include <linux/can/raw.h>
 #include <net/if.h>
+#include <net/if_arp.h>
+
+#include "canqv.h"
+#include "probes.h"
 
 /* terminal codes, copied from can-utils */
 
@@ -34,12 +43,10 @@
 #define CSR_HOME  "\33[H"
 #define ATTRESET "\33[0m"
 
-#define NAME "canqv"
-
 /* program options */
 static const char help_msg[] =
         NAME ": CAN spy\n"
-        "usage:	" NAME " [OPTIONS ...] DEVICE ID[/MASK] ...\n"
+        "usage:	" NAME " [OPTIONS ...] DEVICE[,DEVICE ...] ID[/MASK] ...\n"
         "\n"
         "Options\n"
         " -V, --version		Show version\n"
@@ -48,6 +55,57 @@ static const char help_msg[] =
         " -m, --maxperiod=TIME	Consider TIME as maximum period (default 2s).\n"
         "			Slower rates are considered multiple one-time ID's\n"
         " -x, --remove=TIME	Remove ID's after TIME (default 10s).\n"
+        " -p, --plugin=FILE[:ARG]	Load decoder plugin FILE, with argument ARG\n"
+        " -t, --threads		Capture each DEVICE in its own thread\n"
+        "			(implied with several DEVICEs, 'any' expands to all)\n"
+        " -j, --jobs=N		Run decoders in a pool of N threads (default 0, inline)\n"
+        " -R, --realtime[=PRIO]	Lock & prefault memory, capture with SCHED_FIFO\n"
+        "			priority PRIO (default 50)\n"
+        " -c, --cpu=CPU		Pin capture to CPU (first CPU with several DEVICEs)\n"
+        " -l, --lowpower=MS	Wake up at most every MS msec, and drain the socket.\n"
+        "			Shortened when the socket buffer fills, or drops frames\n"
+        " -J, --j1939		Decode 29bit ID's as J1939 (priority, PGN, SA),\n"
+        "			and reassemble transport protocol messages\n"
+        " -U, --uds[=REQ:RESP,...]	Follow UDS diagnostics on ISO-TP request:response\n"
+        "			ID pairs (default 7e0:7e8 .. 7e7:7ef, and 18daxxyy)\n"
+        " -O, --obd[=PID,...]	Poll OBD-II mode 01 PIDs on 7df (default: all\n"
+        "			supported PIDs with a known scaling)\n"
+        " -L, --obdlog=FILE	Append OBD-II samples to FILE\n"
+        " -G, --gateway[=MS]	Learn which frames a gateway copies between the\n"
+        "			DEVICEs, within MS (default 50), and their latency\n"
+        " -s, --slcan=KBIT[,BAUD]	DEVICE is a serial LAWICEL (slcan) adapter,\n"
+        "			open it at KBIT kbit/s, with BAUD (default 115200)\n"
+        " -e, --export=HOST:PORT[,FRAMES[,MS]]	Send all received frames to HOST:PORT\n"
+        "			over UDP (cannelloni format), FRAMES per datagram\n"
+        "			(default 32), after at most MS msec (default 10)\n"
+        " -i, --import=[HOST:]PORT	Receive frames over UDP instead of a DEVICE\n"
+        " -S, --stream		Print every frame to stdout, in candump -L format,\n"
+        "			instead of the screen\n"
+        " -f, --find		Search values by the commands on stdin:\n"
+        "			X or X..Y, then changed, unchanged, increased, ...\n"
+        " -g, --grep=PATTERN	Only take frames whose payload holds PATTERN,\n"
+        "			hex bytes with XX for any byte, e.g. 'B9 XX F0'\n"
+        " -a, --activity=FILE[,SEC]	Count frames & changes per ID in bins of SEC\n"
+        "			(default 1), and append every bin to FILE as CSV\n"
+        " -A, --heatmap[=COLS]	Show the ID activity over time, COLS wide (default 64)\n"
+        " -o, --overload		Step down under overload: slower refresh, no decoders,\n"
+        "			log changes only, sample periods\n"
+        " -M, --memcap=SUB=MB,...	Cap the heap of subsystem SUB (cache, capture,\n"
+        "			decode, log, trace, search, misc) to MB MiB\n"
+        " -H, --hugepages	Map the cache tables, decode lanes, trace rings &\n"
+        "			log buffers in huge pages (or transparent ones)\n"
+        " -T, --trace=FILE	Trace capture, rendering & logging, and write the\n"
+        "			last events as Chrome trace JSON to FILE on SIGUSR1\n"
+        "			and at exit\n"
+        " -r, --read=FILE	Replay a Vector ASC trace instead of a DEVICE,\n"
+        "			as fast as possible, and show the result\n"
+        " -d, --dump		Print new, changed & expired IDs and the final cache\n"
+        "			instead of the screen, for regression tests.\n"
+        "			With --read, start the trace clock at 0.\n"
+        "			With --stream, only the stream is printed\n"
+        " -w, --write=FILE	Write all received frames as Vector ASC trace\n"
+        " -D, --direct[=KB]	Write -w in aligned buffers of KB (default 4096,\n"
+        "			the erase block size), double buffered, with O_DIRECT\n"
         "\n"
         ;
 #ifdef _GNU_SOURCE
@@ -58,92 +116,211 @@ static struct option long_opts[] = {
 
     { "remove", required_argument, NULL, 'x',},
     { "maxperiod", required_argument, NULL, 'm',},
+    { "plugin", required_argument, NULL, 'p',},
+    { "threads", no_argument, NULL, 't',},
+    { "jobs", required_argument, NULL, 'j',},
+    { "realtime", optional_argument, NULL, 'R',},
+    { "cpu", required_argument, NULL, 'c',},
+    { "lowpower", required_argument, NULL, 'l',},
+    { "j1939", no_argument, NULL, 'J',},
+    { "uds", optional_argument, NULL, 'U',},
+    { "obd", optional_argument, NULL, 'O',},
+    { "obdlog", required_argument, NULL, 'L',},
+    { "gateway", optional_argument, NULL, 'G',},
+    { "slcan", required_argument, NULL, 's',},
+    { "export", required_argument, NULL, 'e',},
+    { "import", required_argument, NULL, 'i',},
+    { "stream", no_argument, NULL, 'S',},
+    { "find", no_argument, NULL, 'f',},
+    { "grep", required_argument, NULL, 'g',},
+    { "activity", required_argument, NULL, 'a',},
+    { "heatmap", optional_argument, NULL, 'A',},
+    { "overload", no_argument, NULL, 'o',},
+    { "memcap", required_argument, NULL, 'M',},
+    { "hugepages", no_argument, NULL, 'H',},
+    { "trace", required_argument, NULL, 'T',},
+    { "read", required_argument, NULL, 'r',},
+    { "dump", no_argument, NULL, 'd',},
+    { "write", required_argument, NULL, 'w',},
+    { "direct", optional_argument, NULL, 'D',},
     {},
 };
 #else
 #define getopt_long(argc, argv, optstring, longopts, longindex) \
         getopt((argc), (argv), (optstring))
 #endif
-static const char optstring[] = "V?vx:m:";
+static const char optstring[] = "V?vx:m:p:tj:R::c:l:JU::O::L:G::s:e:i:Sf"
+        "g:a:A::oM:HT:r:dw:D::";
 static int verbose;
-static double deadtime = 10.0;
-static double maxperiod = 2.0;
+static int threaded;
+static int jobs;
+static const char *readfile, *writefile, *slcan;
+static const char *udpout, *udpin;
+static int dump;
+
+volatile sig_atomic_t sigterm;
+
+static void sighandler(int sig) {
+    sigterm = 1;
+}
 
 /* jiffies, in msec */
 static double jiffies;
 
-static void update_jiffies(void) {
+double now(void) {
     struct timeval tv;
 
     gettimeofday(&tv, NULL);
-    jiffies = tv.tv_sec + tv.tv_usec / 1e6;
+    return tv.tv_sec + tv.tv_usec / 1e6;
 }
 
-/* cache definition */
-struct cache {
-    struct can_frame cf;
-    int flags;
-#define F_DIRTY  0x01
-    double lastrx;
-    double period;
-};
+static void update_jiffies(void) {
+    jiffies = now();
+}
 
-static int cmpcache(const void *va, const void *vb) {
-    const struct cache *a = va, *b = vb;
+static int is_can_device(int sock, const char *device) {
+    struct ifreq ifr = {};
 
-    return a->cf.can_id - b->cf.can_id;
+    strncpy(ifr.ifr_name, device, IFNAMSIZ - 1);
+    if (ioctl(sock, SIOCGIFHWADDR, &ifr) < 0)
+        return 0;
+    return ifr.ifr_hwaddr.sa_family == ARPHRD_CAN;
 }
 
-static int isCommand(int id) {
-    if (id >= 0xC0 && id < 0xD0) {
-        return 1;
+/* start a capture worker on device */
+static void add_worker(const char *device) {
+    int ifindex;
+
+    ifindex = if_nametoindex(device);
+    if (!ifindex)
+        error(1, errno, "device '%s' not found", device);
+    worker_add(open_can(device, ifindex), iface_register(device, ifindex));
+}
+
+static void add_all_workers(void) {
+    struct if_nameindex *ifs, *p;
+    int sock;
+
+    sock = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+    if (sock < 0)
+        error(1, errno, "socket PF_CAN");
+    ifs = if_nameindex();
+    if (!ifs)
+        error(1, errno, "if_nameindex");
+    for (p = ifs; p->if_index; ++p) {
+        if (is_can_device(sock, p->if_name))
+            add_worker(p->if_name);
     }
-    return 1;
+    if_freenameindex(ifs);
+    close(sock);
+    if (!niface)
+        error(1, 0, "no CAN devices found");
 }
 
-static char *unitName(int id) {
-    if (0x1b == id) return "MUM"; //dummy test unitname
-    if (0x40 == id) return "CEM"; //low speed can
-    if (0x51 == id) return "DIM";
-    if (0x48 == id) return "SWM";
-    if (0x29 == id) return "CCM";
-    if (0x43 == id) return "DDM";
-    if (0x45 == id) return "PDM";
-    if (0x2e == id) return "PSM";
-    if (0x46 == id) return "REM";
-    if (0x58 == id) return "SRS";
-    if (0x47 == id) return "UEM";
-    if (0x60 == id) return "AUM";
-    if (0x64 == id) return "PHM";
-    if (0x50 == id) return "CEH"; //high-speed can units with H-ending:
-    if (0x01 == id) return "BCH";
-    if (0x52 == id) return "AEM";
-    if (0x11 == id) return "ECH";
-    if (0x28 == id) return "SAH"; //SAS
-    if (0x6e == id) return "TCH";
-    if (0x62 == id) return "RTI";
-    return "";
+static void render(struct cachetab *tab, int showiface) {
+    int row;
+    struct cache *cache = tab->cache;
+
+    if (stream)
+        /* stdout is taken */
+        return;
+    PROBE1(render_start, tab->n);
+    TRACE_BEGIN("render");
+    TRACE_COUNTER("cached IDs", tab->n);
+    /* update screen */
+    puts(CLR_SCREEN ATTRESET CSR_HOME);
+
+    puts("          .----------------------- Message length");
+    puts("          |  .-------------------- Module id (list below)");
+    puts("          |  |  .----------------- Read Data Block By Offset");
+    puts("          |  |  |  .---- Identify (?)");
+    puts("          |  |  |  |");
+    puts("          |  |  |  |");
+    puts("000FFFFE CB xx B9 F0 00 00 00 00");
+    puts("00 0F FF FE: The identifier VIDA (or any other diagnostic module) uses for messaging.");
+    puts("Message length: High nibble seems to be always 'C' in command message. Low nibble: Bit 3 is always on. Bits 0-2 is the actual message length (excluding the first byte).");
+    puts("");
+
+    for (row = 0; row < tab->n; ++row) {
+        row_print(stdout, cache + row, showiface, jiffies);
+        cache[row].flags &= F_DIRTY;
+    }
+    logblk_flush();
+    puts("");
+    j1939_render(stdout);
+    uds_render(stdout);
+    obd_render(stdout);
+    gw_render(stdout);
+    ovl_render(stdout);
+    grep_render(stdout);
+    heat_render(stdout);
+    search_step(tab);
+    search_render(stdout);
+
+    puts("");
+    puts("00 80 00 03 :: 40  CEM, Central Electronic Module");
+    puts("                   (also answers queries related to CPM(heater)");
+    puts("00 80 00 09 :: 51  DIM, Driver Information Module");
+    puts("00 80 08 01 :: 48  SWM, Steering Wheel Module");
+    puts("00 80 10 01 :: 29  CCM, Climate Control Module");
+    puts("00 80 00 11 :: 43  DDM, Driver Door Module");
+    puts("00 80 00 81 :: 45  PDM, Passenger Door Module");
+    puts("00 80 01 01 :: 2e  PSM, Power Seat Module");
+    puts("00 80 04 01 :: 46  REM, Rear Electronic Module");
+    puts("00 80 02 01 :: 58  SRS, Air bag");
+    puts("00 80 20 01 :: 47  UEM, Upper Electronic Module");
+    puts("00 80 00 05 :: 60  AUM, Audio Module");
+    puts("00 80 00 21 :: 64  PHM, Phone Module");
+    puts("");
+/*
+    puts("50  CEM, Central Electronic Module (Hi-speed interface)");
+    puts("01  BCM, Break Control Module (hi-speed network)");
+    puts("52  AEM, Accessory Electronic Module");
+    puts("11  ECM, Engine Control Module (hi-speed network)");
+    puts("28  SAS, Steering Angle Sensor (hi-speed network)");
+    puts("6e  TCM, Transmission Control Module (hi-speed network)");
+    puts("62  RTI, Road Traffic Information module");
+*/
+
+    if (verbose) {
+        workers_report(stdout);
+        rt_report(stdout);
+        lp_report(stdout);
+        j1939_report(stdout);
+        uds_report(stdout);
+        obd_report(stdout);
+        gw_report(stdout);
+        ovl_report(stdout);
+        slcan_report(stdout);
+        udp_report(stdout);
+        asc_report(stdout);
+        aw_report(stdout);
+        logblk_report(stdout);
+        pool_report(stdout);
+        plugin_report(stdout);
+        mem_report(stdout);
+        mem_report_hugepages(stdout);
+    }
+    TRACE_END("render");
+    PROBE1(render_end, tab->n);
 }
 
-void appendLog(FILE *fp, struct can_frame cf) {
-    fp = fopen("/tmp/canqv_captures.log", "a");
-    unsigned char *row = cf.data;
-    //fputs(row, fp);
-    fprintf(fp, "%08x:  %02x  %03s  %02x  %02x  %02x  %02x  %02x  %02x  %02x \n", cf.can_id & CAN_EFF_MASK, row[0],unitName(row[1]),row[2],row[3],row[4],row[5],row[6],row[7],row[8]);
-    fclose(fp);
+static void process_batch(struct cachetab *tab, struct rxbatch *rx) {
+    TRACE_BEGIN("batch");
+    worker_batch(tab, rx, niface == 1 ? 0 : -1, jiffies);
+    TRACE_END("batch");
 }
 
 int main(int argc, char *argv[]) {
-    int opt, ret, sock, row, byte;
+    int opt, ret, sock, ifindex, showiface, n;
+    unsigned int drops, lastdrops = 0;
     const char *device;
-    char *endp;
-    struct can_filter *filters;
-    size_t nfilters, sfilters;
-    struct sockaddr_can addr = {.can_family = AF_CAN,};
-    struct cache *cache, w, *curr;
-    size_t ncache, scache;
-    double last_update, lastseen;
-    FILE *fp;
+    char *endp, *tok, *saved;
+    size_t sfilters;
+    struct cachetab tab = {};
+    static struct rxbatch rx;
+    double last_update, t, latency;
+    struct sigaction sa = {.sa_handler = sighandler,};
 
     /* argument parsing */
     while ((opt = getopt_long(argc, argv, optstring, long_opts, NULL)) != -1)
@@ -168,17 +345,128 @@ int main(int argc, char *argv[]) {
             case 'm':
                 maxperiod = strtod(optarg, NULL);
                 break;
+            case 'p':
+                plugin_load(optarg);
+                break;
+            case 't':
+                threaded = 1;
+                break;
+            case 'j':
+                jobs = strtoul(optarg, NULL, 0);
+                break;
+            case 'R':
+                realtime = 1;
+                if (optarg)
+                    rt_prio = strtoul(optarg, NULL, 0);
+                break;
+            case 'c':
+                rt_cpu = strtoul(optarg, NULL, 0);
+                break;
+            case 'l':
+                lp_maxinterval = strtod(optarg, NULL) / 1e3;
+                break;
+            case 'J':
+                j1939 = 1;
+                break;
+            case 'U':
+                uds_parse(optarg);
+                break;
+            case 'O':
+                obd_parse(optarg);
+                break;
+            case 'L':
+                obd_logname = optarg;
+                break;
+            case 'G':
+                gw_window = 50;
+                if (optarg) {
+                    gw_window = strtod(optarg, &endp);
+                    if (endp == optarg || *endp || !(gw_window > 0))
+                        error(1, 0, "gateway window '%s': expected MS > 0",
+                                optarg);
+                }
+                gw_window /= 1e3;
+                break;
+            case 's':
+                slcan = optarg;
+                break;
+            case 'e':
+                udpout = optarg;
+                break;
+            case 'i':
+                udpin = optarg;
+                break;
+            case 'S':
+                stream = 1;
+                break;
+            case 'f':
+                search = 1;
+                break;
+            case 'g':
+                grep_pattern = optarg;
+                break;
+            case 'o':
+                ovl = 1;
+                break;
+            case 'a':
+                heat_parse(optarg);
+                break;
+            case 'A':
+                heat_cols = optarg ? strtoul(optarg, NULL, 0) : 64;
+                break;
+            case 'M':
+                mem_parse_caps(optarg);
+                break;
+            case 'H':
+                mem_hugepages = 1;
+                break;
+            case 'T':
+                trace_file = optarg;
+                break;
+            case 'r':
+                readfile = optarg;
+                break;
+            case 'd':
+                dump = 1;
+                break;
+            case 'w':
+                writefile = optarg;
+                break;
+            case 'D':
+                aw_bufsize = (optarg ? strtoul(optarg, NULL, 0) : 4096) << 10;
+                break;
         }
 
     /* parse CAN device */
-    if (argv[optind]) {
-        addr.can_ifindex = if_nametoindex(argv[optind]);
-        if (!addr.can_ifindex)
-            error(1, errno, "device '%s' not found", argv[optind]);
+    if (readfile)
+        /* all arguments are filters */
+        device = readfile;
+    else if (udpin)
+        device = udpin;
+    else if (argv[optind]) {
         device = argv[optind];
         ++optind;
     } else
         device = "any";
+    if (dump && !readfile && !slcan && !udpin)
+        error(1, 0, "--dump needs --read, --slcan or --import");
+    if (readfile && (threaded || lp_maxinterval))
+        error(1, 0, "--read excludes --threads and --lowpower");
+    if (udpin && (readfile || slcan || threaded || lp_maxinterval || obd))
+        error(1, 0, "--import excludes --read, --slcan, --threads, "
+                "--lowpower and --obd");
+    if (slcan && (readfile || threaded || lp_maxinterval || obd))
+        error(1, 0, "--slcan excludes --read, --threads, --lowpower and --obd");
+    if (slcan && !strcmp(device, "any"))
+        error(1, 0, "--slcan needs a DEVICE");
+    if (!readfile && !slcan && !udpin && strchr(device, ','))
+        threaded = 1;
+    if (threaded && writefile)
+        error(1, 0, "--write needs 1 DEVICE, without --threads");
+    if (threaded && lp_maxinterval)
+        error(1, 0, "--lowpower needs 1 DEVICE, without --threads");
+    if (obd && (threaded || !strcmp(device, "any")))
+        error(1, 0, "--obd needs 1 DEVICE, without --threads");
 
     /* parse filters */
     filters = NULL;
@@ -186,14 +474,15 @@ int main(int argc, char *argv[]) {
     for (; optind < argc; ++optind) {
         if (nfilters >= sfilters) {
             sfilters += 16;
-            filters = realloc(filters, sizeof (*filters) * sfilters);
+            filters = mem_realloc(MEM_CAPTURE, filters,
+                    sizeof (*filters) * sfilters);
             if (!filters)
                 error(1, errno, "realloc");
         }
         filters[nfilters].can_id = strtoul(argv[optind], &endp, 16);
         if ((endp - argv[optind]) > 3)
-            filters[nfilters].can_id |= CAN_EFF_MASK;
-        if (strchr(":/", *endp))
+            filters[nfilters].can_id |= CAN_EFF_FLAG;
+        if (*endp && strchr(":/", *endp))
             filters[nfilters].can_mask = strtoul(endp + 1, NULL, 16) |
             CAN_EFF_FLAG | CAN_RTR_FLAG;
         else
@@ -202,157 +491,208 @@ int main(int argc, char *argv[]) {
         ++nfilters;
     }
 
-    /* prepare socket */
-    sock = ret = socket(PF_CAN, SOCK_RAW, CAN_RAW);
-    if (ret < 0)
-        error(1, errno, "socket PF_CAN");
-
-    if (nfilters) {
-        ret = setsockopt(sock, SOL_CAN_RAW, CAN_RAW_FILTER, filters,
-                nfilters * sizeof (*filters));
-        if (ret < 0)
-            error(1, errno, "setsockopt %li filters", nfilters);
+    grep_setup();
+    heat_setup();
+    mem_setup();
+    trace_setup();
+    rt_setup();
+
+    /* prepare socket(s) */
+    sock = -1;
+    if (dump && !stream)
+        cache_trace = stdout;
+    if (readfile) {
+        asc_simclock = dump;
+        asc_open(readfile);
+        showiface = 0;
+    } else if (udpin) {
+        sock = udp_import_open(udpin);
+        showiface = 1;
+    } else if (slcan) {
+        sock = slcan_open(device, slcan);
+        showiface = 0;
+    } else if (threaded) {
+        saved = mem_strdup(MEM_MISC, device);
+        for (tok = strtok(saved, ","); tok; tok = strtok(NULL, ",")) {
+            if (!strcmp(tok, "any"))
+                add_all_workers();
+            else
+                add_worker(tok);
+        }
+        mem_free(saved);
+        showiface = niface > 1;
+    } else if (!strcmp(device, "any")) {
+        sock = open_can(device, 0);
+        showiface = 1;
+    } else {
+        ifindex = if_nametoindex(device);
+        if (!ifindex)
+            error(1, errno, "device '%s' not found", device);
+        sock = open_can(device, ifindex);
+        iface_register(device, ifindex);
+        showiface = 0;
     }
 
-    ret = bind(sock, (struct sockaddr *) &addr, sizeof (addr));
-    if (ret < 0)
-        error(1, errno, "bind %s", device);
-
-    /* pre-init cache */
-    scache = ncache = 0;
-    cache = NULL;
+    /* terminate gracefully, so plugins get unloaded */
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if (writefile)
+        asc_create(writefile);
+    if (udpout)
+        udp_export_open(udpout);
+    j1939_setup();
+    uds_setup();
+    /* replayed OBD-II responses are only decoded */
+    obd_setup(readfile ? NULL : device);
+    pool_start(jobs);
+    search_setup();
+    ovl_setup(threaded ? niface : 1);
+    if (realtime)
+        cache_reserve(&tab, rt_cache);
 
     last_update = 0;
-    while (1) {
-        ret = recv(sock, &w.cf, sizeof (w.cf), 0);
-        if (ret < 0)
-            error(1, errno, "recv %s", device);
-        if (!ret)
-            break;
-
-        update_jiffies();
-        curr = bsearch(&w, cache, ncache, sizeof (*cache), cmpcache);
-        if (!curr && (ncache >= scache)) {
-            /* grow cache */
-            scache += 16;
-            cache = realloc(cache, sizeof (*cache) * scache);
-            memset(cache + ncache, 0, (scache - ncache) * sizeof (*cache));
-        }
-        if (!curr) {
-            /* add in cache */
-            curr = cache + ncache++;
-            curr->flags |= F_DIRTY;
-            curr->cf = w.cf;
-            curr->period = NAN;
-            curr->lastrx = jiffies;
-            qsort(cache, ncache, sizeof (*cache), cmpcache);
-        } else {
-            if ((curr->cf.can_id != w.cf.can_id) ||
-                    (curr->cf.can_dlc != w.cf.can_dlc) ||
-                    memcmp(curr->cf.data, w.cf.data, w.cf.can_dlc))
-                curr->flags |= F_DIRTY;
-            /* update cache */
-            curr->cf = w.cf;
-            curr->period = jiffies - curr->lastrx;
-            if (curr->period > maxperiod)
-                curr->period = NAN;
-            curr->lastrx = jiffies;
+    if (threaded) {
+        workers_start();
+        while (!sigterm) {
+            usleep(ovl_refresh() * 1e6);
+            update_jiffies();
+            TRACE_BEGIN("collect");
+            workers_collect(&tab);
+            TRACE_END("collect");
+            j1939_expire(jiffies);
+            uds_expire(jiffies);
+            heat_expire(jiffies);
+            plugin_flush();
+            render(&tab, showiface);
+            if (trace_request)
+                trace_dump();
         }
+        workers_stop();
+        workers_report(stderr);
+    }
 
-        if ((jiffies - last_update) < 0.25)
-            continue;
-        /* remove dead cache */
-        for (row = 0; row < ncache; ++row) {
-            curr = cache + row;
-            lastseen = jiffies - curr->lastrx;
-
-            if (lastseen > deadtime) {
-                /* delete this entry */
-                memcpy(cache + row, cache + row + 1, (ncache - row - 1) * sizeof (*cache));
-                --ncache;
-                --row;
-                continue;
+    rxbatch_init(&rx);
+    if (readfile) {
+        /* run on trace time */
+        while (!sigterm && asc_read_batch(&rx)) {
+            jiffies = rx.f[rx.n - 1].t;
+            process_batch(&tab, &rx);
+            if ((jiffies - last_update) >= REFRESH) {
+                cache_expire(&tab, jiffies);
+                j1939_expire(jiffies);
+                uds_expire(jiffies);
+                heat_expire(jiffies);
+                last_update = jiffies;
+                if (trace_request)
+                    trace_dump();
             }
-
-            if (!isnan(curr->period) && (lastseen > 2 * curr->period))
-                /* reset period */
-                curr->period = NAN;
         }
-
-        last_update = jiffies;
-        /* update screen */
-        puts(CLR_SCREEN ATTRESET CSR_HOME);
-
-        puts("          .----------------------- Message length");
-        puts("          |  .-------------------- Module id (list below)");
-        puts("          |  |  .----------------- Read Data Block By Offset");
-        puts("          |  |  |  .---- Identify (?)");
-        puts("          |  |  |  |");
-        puts("          |  |  |  |");
-        puts("000FFFFE CB xx B9 F0 00 00 00 00");
-        puts("00 0F FF FE: The identifier VIDA (or any other diagnostic module) uses for messaging.");
-        puts("Message length: High nibble seems to be always 'C' in command message. Low nibble: Bit 3 is always on. Bits 0-2 is the actual message length (excluding the first byte).");
-        puts("");
-        
-        for (row = 0; row < ncache; ++row) {
-            int command_flag = 0;
-            if (cache[row].cf.can_id & CAN_EFF_FLAG)
-                printf("%08x:", cache[row].cf.can_id & CAN_EFF_MASK);
+        asc_close_read();
+        plugin_flush();
+        if (dump && !stream) {
+            cache_dump(stdout, &tab);
+            obd_dump(stdout);
+            grep_render(stdout);
+        } else
+            render(&tab, niface > 1);
+    }
+    if (sock >= 0)
+        rt_thread(pthread_self(), device, rt_cpu);
+    if (sock >= 0 && lp_maxinterval)
+        lp_setup(sock);
+    while (!sigterm && sock >= 0) {
+        if (lp_maxinterval) {
+            /* sleep, then drain everything */
+            t = lp_sleep();
+            nanosleep(&(struct timespec){ .tv_sec = t,
+                    .tv_nsec = (t - (int) t) * 1e9, }, NULL);
+            /* frame latency */
+            update_jiffies();
+            n = 0;
+            do {
+                ret = can_recv_batch(sock, &rx, MSG_DONTWAIT);
+                if (ret < 0 && errno != EAGAIN && errno != EINTR)
+                    error(1, errno, "recv %s", device);
+                n += rx.n;
+                process_batch(&tab, &rx);
+            } while (ret == RXBATCH);
+            update_jiffies();
+            lp_account(n, rx.drops, jiffies);
+        } else {
+            if (slcan)
+                ret = slcan_read_batch(&rx);
+            else if (udpin)
+                ret = udp_read_batch(&rx);
             else
-                printf("     %03x:", cache[row].cf.can_id & CAN_SFF_MASK);
-            for (byte = 0; byte < cache[row].cf.can_dlc; ++byte) {
-                if (byte == 0) {
-                    if (isCommand(cache[row].cf.data[byte]) == 1) command_flag = 1;
-                }
-                if (byte == 1) {
-                    char unit[3];
-                    strcpy(unit, unitName(cache[row].cf.data[byte]));
-                    if (strlen(unit) > 2 && command_flag == 1) {
-                        printf(" %3s ", unit);
-                        appendLog(fp, cache[row].cf);
-                    } else {
-                        printf(" %02x  ", cache[row].cf.data[byte]);
-                    }
-                } else {
-                    //printf(" %3s ", "TST");
-                    printf(" %02x  ", cache[row].cf.data[byte]);
-                }        
-            }
-            for (; byte < 8; ++byte)
-                printf(" --");
-            printf("\tlast=-%.3lfs", jiffies - cache[row].lastrx);
-            if (!isnan(cache[row].period))
-                printf("\tperiod=%.3lfs", cache[row].period);
-            printf("\n");
-            cache[row].flags &= F_DIRTY;
+                ret = can_recv_batch(sock, &rx, MSG_WAITFORONE);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret < 0)
+                error(1, errno, "recv %s", device);
+            if (!ret)
+                break;
+            update_jiffies();
+            t = jiffies;
+            latency = t - rx.f[0].t;
+            TRACE_COUNTER("latency us", latency * 1e6);
+            n = rx.n;
+            drops = rx.drops - lastdrops;
+            lastdrops = rx.drops;
+            process_batch(&tab, &rx);
+            rt_account(latency, now() - t);
+            ovl_account(n, drops, latency, now() - t);
         }
 
-        puts("");
-        puts("00 80 00 03 :: 40  CEM, Central Electronic Module");
-        puts("                   (also answers queries related to CPM(heater)");
-        puts("00 80 00 09 :: 51  DIM, Driver Information Module");
-        puts("00 80 08 01 :: 48  SWM, Steering Wheel Module");
-        puts("00 80 10 01 :: 29  CCM, Climate Control Module");
-        puts("00 80 00 11 :: 43  DDM, Driver Door Module");
-        puts("00 80 00 81 :: 45  PDM, Passenger Door Module");
-        puts("00 80 01 01 :: 2e  PSM, Power Seat Module");
-        puts("00 80 04 01 :: 46  REM, Rear Electronic Module");
-        puts("00 80 02 01 :: 58  SRS, Air bag");
-        puts("00 80 20 01 :: 47  UEM, Upper Electronic Module");
-        puts("00 80 00 05 :: 60  AUM, Audio Module");
-        puts("00 80 00 21 :: 64  PHM, Phone Module");
-        puts("");
-/*
-        puts("50  CEM, Central Electronic Module (Hi-speed interface)");
-        puts("01  BCM, Break Control Module (hi-speed network)");
-        puts("52  AEM, Accessory Electronic Module");
-        puts("11  ECM, Engine Control Module (hi-speed network)");
-        puts("28  SAS, Steering Angle Sensor (hi-speed network)");
-        puts("6e  TCM, Transmission Control Module (hi-speed network)");
-        puts("62  RTI, Road Traffic Information module");
-*/
-
+        if ((jiffies - last_update) >= ovl_refresh()) {
+            /* remove dead cache */
+            TRACE_BEGIN("expire");
+            cache_expire(&tab, jiffies);
+            TRACE_END("expire");
+            j1939_expire(jiffies);
+            uds_expire(jiffies);
+            heat_expire(jiffies);
+
+            last_update = jiffies;
+            plugin_flush();
+            if (!dump)
+                render(&tab, showiface);
+            if (trace_request)
+                trace_dump();
+        }
     }
+    if (dump && !stream && sock >= 0)
+        cache_dump(stdout, &tab);
+    obd_stop();
+    slcan_close();
+    stream_flush();
+    heat_close();
+    udp_export_close();
+    asc_close_write();
+    logblk_close();
+    cache_free(&tab);
+    pool_stop();
+    trace_dump();
+    pool_report(stderr);
+    rt_report(stderr);
+    lp_report(stderr);
+    j1939_report(stderr);
+    uds_report(stderr);
+    obd_report(stderr);
+    gw_report(stderr);
+    slcan_report(stderr);
+    udp_report(stderr);
+    stream_report(stderr);
+    grep_report(stderr);
+    heat_report(stderr);
+    ovl_report(stderr);
+    asc_report(stderr);
+    aw_report(stderr);
+    logblk_report(stderr);
+    trace_report(stderr);
+    mem_report(stderr);
+    mem_report_hugepages(stderr);
+    plugin_report(stderr);
+    plugin_unload();
     return 0;
 }
-
@@ -0,0 +1,391 @@
+/*
+ * Copyright 2015 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _CANQV_H
+#define _CANQV_H
+
+/* internal interfaces between the canqv modules */
+#include <stdio.h>
+#include <stdint.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <linux/can.h>
+
+#include "canqv-plugin.h"
+
+#define NAME "canqv"
+
+/* screen refresh & cache expiry interval, in seconds */
+#define REFRESH 0.25
+
+/* canqv.c */
+extern volatile sig_atomic_t sigterm;
+extern double now(void);
+
+/* hex.c */
+/* digit value + 1, 0 for no hex digit */
+extern const uint8_t hextab[256];
+static inline int hexval(int c) {
+    return hextab[(uint8_t)c] - 1;
+}
+
+/* rx.c */
+#define RXBATCH 64
+struct rxbatch {
+    struct canqv_frame f[RXBATCH];
+    int ifindex[RXBATCH];
+    int n;
+    /* kernel drop counter of the socket, cumulative */
+    unsigned int drops;
+    /* recvmmsg bookkeeping */
+    struct mmsghdr msgs[RXBATCH];
+    struct iovec iov[RXBATCH];
+    struct sockaddr_can addr[RXBATCH];
+    char ctrl[RXBATCH][CMSG_SPACE(sizeof (struct timeval)) +
+            CMSG_SPACE(sizeof (unsigned int))];
+};
+
+extern struct can_filter *filters;
+extern size_t nfilters;
+extern int open_can(const char *device, int ifindex);
+extern int can_filtered(canid_t can_id);
+extern void rxbatch_init(struct rxbatch *b);
+/*
+ * receive up to RXBATCH frames, with kernel timestamps.
+ * flags: MSG_WAITFORONE blocks for the first frame, MSG_DONTWAIT never blocks
+ */
+extern int can_recv_batch(int sock, struct rxbatch *b, int flags);
+
+/* slcan.c */
+/* spec is KBIT[,BAUD] */
+extern int slcan_open(const char *tty, const char *spec);
+/* like can_recv_batch with MSG_WAITFORONE, 0 on hangup */
+extern int slcan_read_batch(struct rxbatch *b);
+/* parse up to RXBATCH frames of dat, returns the number of frames */
+extern int slcan_parse(const char *dat, size_t len, struct rxbatch *b);
+extern void slcan_close(void);
+extern void slcan_report(FILE *fp);
+
+/* udp.c */
+/* spec is HOST:PORT[,FRAMES[,MS]] */
+extern int udp_export_open(const char *spec);
+extern void udp_export(const struct canqv_frame *f);
+extern void udp_export_close(void);
+/* spec is [HOST:]PORT */
+extern int udp_import_open(const char *spec);
+/* like can_recv_batch with MSG_WAITFORONE */
+extern int udp_read_batch(struct rxbatch *b);
+extern void udp_report(FILE *fp);
+
+/* stream.c */
+extern int stream;
+/* iface < 0: look up per frame */
+extern void stream_batch(const struct rxbatch *rx, int iface);
+extern void stream_flush(void);
+extern void stream_report(FILE *fp);
+
+/* grep.c */
+extern const char *grep_pattern;
+extern void grep_setup(void);
+/* drop the frames without the pattern, iface < 0: look up per frame */
+extern int grep_batch(struct rxbatch *b, int iface);
+extern void grep_render(FILE *fp);
+extern void grep_report(FILE *fp);
+
+/* overload.c */
+enum { OVL_NORMAL, OVL_SLOW, OVL_NODECODE, OVL_CHANGES, OVL_SAMPLE,
+    OVL_LEVELS, };
+/* 1 in OVL_SAMPLING frames updates the period on OVL_SAMPLE */
+#define OVL_SAMPLING	8
+extern int ovl;
+extern atomic_int ovl_level;
+/* ncapture: the number of capture threads */
+extern void ovl_setup(int ncapture);
+/* per capture batch, drops are new socket drops */
+extern void ovl_account(int nframes, unsigned int drops, double latency,
+        double busy);
+/* the screen refresh interval */
+extern double ovl_refresh(void);
+extern void ovl_render(FILE *fp);
+extern void ovl_report(FILE *fp);
+
+/* mem.c */
+enum { MEM_CACHE, MEM_CAPTURE, MEM_DECODE, MEM_LOG, MEM_TRACE, MEM_SEARCH,
+    MEM_MISC, MEM_TAGS, };
+/* map large blocks in huge pages */
+extern int mem_hugepages;
+/* spec is TAG=MB[,TAG=MB ...] */
+extern int mem_parse_caps(const char *spec);
+extern void mem_setup(void);
+/*
+ * zeroed, and accounted to tag. NULL with errno ENOMEM beyond the cap
+ * of tag, or when out of memory. Free with mem_free only.
+ */
+extern void *mem_alloc(int tag, size_t len);
+extern void *mem_memalign(int tag, size_t align, size_t len);
+/* NULL leaves ptr as it was */
+extern void *mem_realloc(int tag, void *ptr, size_t len);
+extern char *mem_strdup(int tag, const char *str);
+extern void mem_free(void *ptr);
+extern void mem_report(FILE *fp);
+extern void mem_report_hugepages(FILE *fp);
+
+/* heatmap.c */
+extern const char *heat_file;
+extern double heat_bin;
+/* text heatmap width, 0 for none */
+extern int heat_cols;
+/* spec is FILE[,SEC] */
+extern int heat_parse(const char *spec);
+extern void heat_setup(void);
+/* iface < 0: look up per frame */
+extern void heat_batch(const struct rxbatch *rx, int iface);
+extern void heat_expire(double t);
+extern void heat_render(FILE *fp);
+extern void heat_close(void);
+extern void heat_report(FILE *fp);
+
+/* trace.c */
+extern const char *trace_file;
+extern int tracing;
+/* set by SIGUSR1 */
+extern volatile sig_atomic_t trace_request;
+extern void trace_setup(void);
+/* name the calling thread in the trace */
+extern void trace_thread(const char *name);
+/* ph: 'B'egin, 'E'nd or 'C'ounter */
+extern void trace_event(int ph, const char *name, long long value);
+extern void trace_dump(void);
+extern void trace_report(FILE *fp);
+#define TRACE_BEGIN(name) \
+    do { if (tracing) trace_event('B', (name), 0); } while (0)
+#define TRACE_END(name) \
+    do { if (tracing) trace_event('E', (name), 0); } while (0)
+#define TRACE_COUNTER(name, value) \
+    do { if (tracing) trace_event('C', (name), (value)); } while (0)
+
+/* asc.c */
+/* replay on trace time from 0, instead of from now */
+extern int asc_simclock;
+extern int asc_open(const char *file);
+/* read up to RXBATCH frames, returns 0 at the end */
+extern int asc_read_batch(struct rxbatch *b);
+extern void asc_close_read(void);
+extern int asc_create(const char *file);
+extern void asc_write(const struct canqv_frame *f, int iface);
+extern void asc_close_write(void);
+extern void asc_report(FILE *fp);
+
+/* awrite.c */
+/* 0 when unused */
+extern size_t aw_bufsize;
+extern int aw_open(const char *file);
+extern void aw_write(const void *dat, size_t len);
+extern void aw_close(void);
+extern void aw_report(FILE *fp);
+
+/* logblk.c */
+#define LOGBLK_MAGIC	0x424c5143 /* "CQLB" */
+#define LOGBLK_ALIGN	512
+#define LOGBLK_SIZE	4096 /* header included */
+#define LOGBLK_ROUND(x)	(((x) + LOGBLK_ALIGN - 1) & ~(LOGBLK_ALIGN - 1))
+
+struct logblk_hdr {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t len; /* payload, without header & padding */
+    uint32_t crc; /* over header (with crc 0) & payload */
+    uint64_t usec; /* time of the first record */
+};
+
+extern uint32_t logblk_crc(uint32_t crc, const void *buf, size_t len);
+/* returns the padded block size when blk is intact, 0 otherwise */
+extern size_t logblk_check(const void *blk, size_t avail);
+extern int logblk_open(const char *file);
+extern void logblk_append(const char *rec, size_t len, double t);
+extern void logblk_flush(void);
+extern void logblk_close(void);
+extern void logblk_report(FILE *fp);
+
+/* lowpower.c */
+extern double lp_maxinterval;
+extern double lp_fill;
+extern void lp_setup(int sock);
+/* time to sleep until the next wakeup */
+extern double lp_sleep(void);
+extern void lp_account(int nframes, unsigned int drops, double t);
+extern void lp_report(FILE *fp);
+
+/* rt.c */
+extern int realtime;
+extern int rt_prio;
+extern int rt_cpu;
+extern size_t rt_cache;
+extern void rt_setup(void);
+extern void rt_prefault(void *ptr, size_t len);
+extern void rt_thread(pthread_t thr, const char *who, int cpu);
+extern void rt_account(double latency, double loop);
+extern void rt_report(FILE *fp);
+
+/* cache.c */
+struct cache {
+    struct can_frame cf;
+    canid_t key;
+    int flags;
+#define F_DIRTY  0x01
+/* payload differs from the previous frame */
+#define F_CHANGED 0x02
+    int iface;
+    int plugin;
+    double lastrx;
+    double period;
+};
+
+/* sorted on key (the can_id, unless decoded otherwise), then iface */
+struct cachetab {
+    struct cache *cache;
+    size_t n, s;
+};
+
+extern double deadtime;
+extern double maxperiod;
+/* new, changed & expired entries are traced here, when set */
+extern FILE *cache_trace;
+
+extern int cmpcache(const void *va, const void *vb);
+/* NULL when a new ID does not fit under the cache memory cap */
+extern struct cache *cache_update(struct cachetab *tab, int iface,
+        const struct can_frame *cf, double t);
+/* like cache_update, but leaves the period as it was */
+extern struct cache *cache_touch(struct cachetab *tab, int iface,
+        const struct can_frame *cf, double t);
+/* NULL when not cached */
+extern struct cache *cache_find(const struct cachetab *tab, int iface,
+        canid_t can_id);
+extern void cache_expire(struct cachetab *tab, double t);
+/* -1 leaves dst as it was, when out of (capped) memory */
+extern int cache_copy(struct cachetab *dst, const struct cachetab *src);
+extern int cache_merge(struct cachetab *dst,
+        const struct cachetab *const *src, int nsrc);
+extern void cache_reserve(struct cachetab *tab, size_t n);
+/* as text, for regression tests */
+extern void cache_dump(FILE *fp, const struct cachetab *tab);
+extern void cache_free(struct cachetab *tab);
+
+extern int niface;
+extern int iface_register(const char *name, int ifindex);
+extern int iface_from_ifindex(int ifindex);
+extern const char *iface_name(int iface);
+extern int iface_ifindex(int iface);
+
+/* row.c */
+/* 1 screen row, t is the current time */
+extern void row_print(FILE *fp, const struct cache *c, int showiface,
+        double t);
+
+/* search.c */
+extern int search;
+extern void search_setup(void);
+/* apply the pending commands to the current values */
+extern void search_step(const struct cachetab *tab);
+extern void search_render(FILE *fp);
+
+/* worker.c */
+extern int worker_add(int sock, int iface);
+extern void workers_start(void);
+extern void workers_collect(struct cachetab *dst);
+extern void workers_stop(void);
+extern void workers_report(FILE *fp);
+/*
+ * cache, decode, write, export & stream a received batch,
+ * as the overload level allows. iface < 0: look up per frame
+ */
+extern void worker_batch(struct cachetab *tab, struct rxbatch *rx, int iface,
+        double t);
+
+/* pool.c */
+extern int nstages;
+extern canid_t (*pool_lanekey)(canid_t can_id);
+extern int stage_register(const char *name,
+        void (*run)(const struct canqv_frame *frames, int nframes));
+extern void pool_start(int nthreads);
+/* the fullest decode lane, 0..1 */
+extern double pool_fill(void);
+extern void pool_submit(double t, const struct can_frame *cf);
+extern void pool_stop(void);
+extern void pool_report(FILE *fp);
+
+/* j1939.c */
+extern int j1939;
+extern uint32_t j1939_pgn(canid_t can_id, int *da);
+extern const char *j1939_pgnname(uint32_t pgn);
+extern canid_t j1939_key(canid_t can_id);
+extern int j1939_describe(canid_t can_id, char *buf, size_t len);
+extern void j1939_setup(void);
+extern void j1939_expire(double t);
+extern void j1939_render(FILE *fp);
+extern void j1939_report(FILE *fp);
+
+/* gw.c */
+/* 0 when off */
+extern double gw_window;
+extern void gw_frame(int iface, const struct canqv_frame *f);
+extern void gw_render(FILE *fp);
+extern void gw_report(FILE *fp);
+
+/* isotp.c */
+typedef void (*isotp_cb_t)(canid_t can_id, double t, const uint8_t *dat,
+        int len);
+/* -1 when out of channels, or of users for can_id */
+extern int isotp_claim(canid_t can_id, isotp_cb_t cb);
+/* both or neither */
+extern int isotp_claim_pair(canid_t a, canid_t b, isotp_cb_t cb);
+/* returns 1 + channel index, or 0 when can_id is not claimed */
+extern int isotp_channel(canid_t can_id);
+extern void isotp_report(FILE *fp);
+
+/* uds.c */
+extern int uds;
+extern int uds_parse(const char *spec);
+extern void uds_setup(void);
+extern void uds_expire(double t);
+extern void uds_render(FILE *fp);
+extern void uds_report(FILE *fp);
+
+/* obd.c */
+extern int obd;
+extern const char *obd_logname;
+extern int obd_parse(const char *spec);
+extern void obd_setup(const char *device);
+extern void obd_stop(void);
+extern void obd_render(FILE *fp);
+extern void obd_dump(FILE *fp);
+extern void obd_report(FILE *fp);
+
+/* plugin.c */
+extern int plugin_load(const char *spec);
+/* returns 1 + plugin index, or 0 when no plugin claims can_id */
+extern int plugin_lookup(canid_t can_id);
+extern void plugin_queue(int plugin, double t, const struct can_frame *cf);
+extern void plugin_flush(void);
+extern int plugin_decode(int plugin, canid_t can_id, char *buf, size_t len);
+extern void plugin_report(FILE *fp);
+extern void plugin_unload(void);
+
+#endif
@@ -0,0 +1,190 @@
+/*
+ * Copyright 2015 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include <error.h>
+#include <pthread.h>
+
+#include "canqv.h"
+
+/*
+ * payload pattern search
+ *
+ * A pattern of up to 8 hex bytes, XX for any byte, matches at any offset
+ * of a payload. A payload is 1 64bit word: for every pattern byte k,
+ * the payload bytes equal to it become 0x80 (SWAR zero byte test), shifted
+ * down by k bytes. What survives the AND of those, and of the offsets
+ * that fit in the dlc, marks a hit.
+ * A batch is tested 4 payloads at a time, with vector extensions (the
+ * compiler picks SSE2, AVX2, NEON or plain words), which only need
+ * 64bit and, or, add & shift.
+ * Frames that do not match are removed from the batch, before
+ * anything else sees them.
+ */
+#define GREP_SHOW	16 /* last hits listed */
+
+typedef uint64_t v4u64 __attribute__((vector_size(32)));
+
+const char *grep_pattern;
+
+#define LO7	0x7f7f7f7f7f7f7f7fULL
+#define HI1	0x8080808080808080ULL
+
+/* the non-wildcard bytes, and their position */
+static uint64_t gbytes[8];
+static int gpos[8], ngbytes;
+static int glen;
+
+static struct hit {
+    double t;
+    int iface;
+    struct can_frame cf;
+} hits[GREP_SHOW];
+static unsigned long nscanned, nhits;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+void grep_setup(void) {
+    const char *p;
+    int hi, lo;
+
+    if (!grep_pattern)
+        return;
+    glen = ngbytes = 0;
+    for (p = grep_pattern; *p; ) {
+        if (strchr(" \t:.", *p)) {
+            ++p;
+            continue;
+        }
+        if (glen >= 8)
+            error(1, 0, "pattern '%s': longer than 8 bytes", grep_pattern);
+        if ((p[0] == 'X' || p[0] == 'x') && (p[1] == 'X' || p[1] == 'x')) {
+            /* wildcard */
+            ++glen;
+            p += 2;
+            continue;
+        }
+        hi = hexval(p[0]);
+        lo = (hi >= 0) ? hexval(p[1]) : -1;
+        if (lo < 0)
+            error(1, 0, "pattern '%s': expected hex byte or XX at '%s'",
+                    grep_pattern, p);
+        /* in every byte */
+        gbytes[ngbytes] = (hi << 4 | lo) * (HI1 >> 7);
+        gpos[ngbytes++] = glen;
+        ++glen;
+        p += 2;
+    }
+    if (!ngbytes)
+        error(1, 0, "pattern '%s': no bytes to match", grep_pattern);
+    /* trailing wildcards do not need room */
+    glen = gpos[ngbytes - 1] + 1;
+}
+
+/* 0x80 in every byte of x that is 0, a macro keeps vectors in registers */
+#define zerobytes(x)	(~((((x) & LO7) + LO7) | (x) | LO7))
+
+/*
+ * match[j] != 0 when payload j holds the pattern.
+ * room[j] holds 0x80 for every offset where the pattern fits.
+ */
+static void scan(const uint64_t *pay, const uint64_t *room, int n,
+        uint64_t *match) {
+    v4u64 p, m, x;
+    int j, k;
+
+    for (j = 0; j < n; j += 4) {
+        memcpy(&p, pay + j, sizeof (p));
+        memcpy(&m, room + j, sizeof (m));
+        for (k = 0; k < ngbytes; ++k) {
+            x = p ^ gbytes[k];
+            m &= zerobytes(x) >> (8 * gpos[k]);
+        }
+        memcpy(match + j, &m, sizeof (m));
+    }
+}
+
+int grep_batch(struct rxbatch *b, int iface) {
+    /* padded to whole vectors */
+    uint64_t pay[RXBATCH + 4], room[RXBATCH + 4], match[RXBATCH + 4];
+    struct hit *h;
+    int j, n, fit;
+
+    if (!grep_pattern || !b->n)
+        return b->n;
+    for (j = 0; j < b->n; ++j) {
+        memcpy(pay + j, b->f[j].cf.data, 8);
+        /* number of offsets that fit */
+        fit = (b->f[j].cf.can_id & (CAN_RTR_FLAG | CAN_ERR_FLAG)) ? 0 :
+            b->f[j].cf.can_dlc - glen + 1;
+        room[j] = (fit > 0) ? HI1 >> (8 * (8 - fit)) : 0;
+    }
+    for (; j & 3; ++j) {
+        pay[j] = 0;
+        room[j] = 0;
+    }
+    scan(pay, room, j, match);
+
+    pthread_mutex_lock(&lock);
+    nscanned += b->n;
+    for (j = n = 0; j < b->n; ++j) {
+        if (!match[j])
+            continue;
+        h = hits + nhits++ % GREP_SHOW;
+        h->t = b->f[j].t;
+        h->iface = (iface >= 0) ? iface : iface_from_ifindex(b->ifindex[j]);
+        h->cf = b->f[j].cf;
+        if (n != j) {
+            b->f[n] = b->f[j];
+            b->ifindex[n] = b->ifindex[j];
+        }
+        ++n;
+    }
+    pthread_mutex_unlock(&lock);
+    b->n = n;
+    return n;
+}
+
+void grep_render(FILE *fp) {
+    const struct hit *h;
+    unsigned long j;
+    int byte;
+
+    if (!grep_pattern)
+        return;
+    pthread_mutex_lock(&lock);
+    fprintf(fp, "grep '%s': %lu hits in %lu frames\n", grep_pattern,
+            nhits, nscanned);
+    j = (nhits > GREP_SHOW) ? nhits - GREP_SHOW : 0;
+    for (; j < nhits; ++j) {
+        h = hits + j % GREP_SHOW;
+        fprintf(fp, "  %.6lf %-8s %*x:", h->t, iface_name(h->iface),
+                (h->cf.can_id & CAN_EFF_FLAG) ? 8 : 3,
+                h->cf.can_id & ((h->cf.can_id & CAN_EFF_FLAG) ?
+                    CAN_EFF_MASK : CAN_SFF_MASK));
+        for (byte = 0; byte < h->cf.can_dlc && byte < CAN_MAX_DLEN; ++byte)
+            fprintf(fp, " %02x", h->cf.data[byte]);
+        fputc('\n', fp);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void grep_report(FILE *fp) {
+    if (!grep_pattern)
+        return;
+    fprintf(fp, "grep: %lu hits in %lu frames\n", nhits, nscanned);
+}
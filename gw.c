@@ -0,0 +1,300 @@
+/*
+ * Copyright 2015 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include "canqv.h"
+
+/*
+ * gateway latency
+ *
+ * Only payload changes count: a frame whose payload differs from the
+ * previous one with the same ID on the same interface is fingerprinted,
+ * and looked up among recent changes on the other interfaces.
+ * The earliest such change is taken as the origin, so a message that a
+ * gateway copies to several buses does not pair up the copies.
+ * Recent changes live in 2 fixed hash tables, for the current and the
+ * previous time window, so memory stays bounded at any bus load.
+ */
+double gw_window;
+
+#define GW_SLOTS	4096 /* per window, power of 2 */
+#define GW_PROBES	32
+#define GW_IDS		4096 /* power of 2 */
+#define GW_MAPS		256
+#define GW_LEARN	8 /* hits before a mapping shows */
+#define GW_BINS		16
+#define GW_BIN0		10e-6 /* upper edge of the first bin */
+
+struct slot {
+    uint64_t hash; /* 0 when free */
+    double t;
+    canid_t can_id;
+    int iface;
+};
+
+static struct slot tabs[2][GW_SLOTS];
+static int curtab;
+static double tabstart;
+
+/* previous payload per ID & interface */
+static struct last {
+    uint64_t hash;
+    canid_t can_id;
+    int iface; /* 1 + iface, 0 when free */
+    unsigned long nchanges;
+} lasts[GW_IDS];
+
+static struct map {
+    int srciface, dstiface;
+    canid_t srcid, dstid;
+    struct last *src;
+    unsigned long hits;
+    double sum, min, max;
+    unsigned long bins[GW_BINS];
+} maps[GW_MAPS];
+static int nmaps;
+
+static unsigned long nchanges, nfull, nmapfull;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline uint64_t mix(uint64_t x) {
+    /* splitmix64 finalizer */
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static inline uint64_t fingerprint(const struct can_frame *cf) {
+    uint64_t dat;
+
+    memcpy(&dat, cf->data, sizeof (dat));
+    if (cf->can_dlc < 8)
+        dat &= (1ULL << (8 * cf->can_dlc)) - 1;
+    /* never 0, that marks a free slot */
+    return mix(dat ^ ((uint64_t)cf->can_dlc << 59)) | 1;
+}
+
+static struct last *find_last(canid_t can_id, int iface) {
+    struct last *l;
+    unsigned int idx, j;
+
+    idx = mix(can_id ^ (uint64_t)iface << 32);
+    for (j = 0; j < GW_PROBES; ++j) {
+        l = lasts + ((idx + j) & (GW_IDS - 1));
+        if (!l->iface) {
+            l->can_id = can_id;
+            l->iface = iface + 1;
+            return l;
+        }
+        if (l->can_id == can_id && l->iface == iface + 1)
+            return l;
+    }
+    return NULL;
+}
+
+static struct map *find_map(const struct slot *src, canid_t dstid,
+        int dstiface) {
+    struct map *m;
+
+    for (m = maps; m < maps + nmaps; ++m) {
+        if (m->srcid == src->can_id && m->srciface == src->iface &&
+                m->dstid == dstid && m->dstiface == dstiface)
+            return m;
+    }
+    if (nmaps >= GW_MAPS) {
+        ++nmapfull;
+        return NULL;
+    }
+    m = maps + nmaps++;
+    memset(m, 0, sizeof (*m));
+    m->srcid = src->can_id;
+    m->srciface = src->iface;
+    m->dstid = dstid;
+    m->dstiface = dstiface;
+    m->src = find_last(src->can_id, src->iface);
+    return m;
+}
+
+static void account(struct map *m, double lat) {
+    double edge;
+    int bin;
+
+    ++m->hits;
+    m->sum += lat;
+    if (m->hits == 1 || lat < m->min)
+        m->min = lat;
+    if (lat > m->max)
+        m->max = lat;
+    for (bin = 0, edge = GW_BIN0; bin < GW_BINS - 1 && lat >= edge;
+            ++bin, edge *= 2)
+        ;
+    ++m->bins[bin];
+}
+
+void gw_frame(int iface, const struct canqv_frame *f) {
+    struct slot *s, *origin, *ins;
+    struct last *l;
+    struct map *m;
+    uint64_t hash;
+    canid_t can_id = f->cf.can_id & (CAN_EFF_FLAG | CAN_EFF_MASK);
+    unsigned int j, k;
+
+    if (!gw_window || (f->cf.can_id & (CAN_RTR_FLAG | CAN_ERR_FLAG)))
+        return;
+    hash = fingerprint(&f->cf);
+
+    pthread_mutex_lock(&lock);
+    l = find_last(can_id, iface);
+    if (!l || l->hash == hash)
+        goto done;
+    l->hash = hash;
+    ++l->nchanges;
+    ++nchanges;
+
+    if (f->t - tabstart >= gw_window) {
+        /* next window, forget the oldest */
+        curtab ^= 1;
+        memset(tabs[curtab], 0, sizeof (tabs[curtab]));
+        tabstart = f->t;
+    }
+
+    /* the earliest change of this payload, on another bus */
+    origin = NULL;
+    ins = NULL;
+    for (k = 0; k < 2; ++k) {
+        for (j = 0; j < GW_PROBES; ++j) {
+            s = &tabs[k][(hash + j) & (GW_SLOTS - 1)];
+            if (!s->hash) {
+                if (k == curtab && !ins)
+                    ins = s;
+                break;
+            }
+            if (s->hash != hash)
+                continue;
+            if (s->iface == iface) {
+                if (s->can_id == can_id && k == curtab)
+                    /* repeated change, keep the newest */
+                    ins = s;
+                continue;
+            }
+            if (f->t - s->t <= gw_window && f->t >= s->t &&
+                    (!origin || s->t < origin->t))
+                origin = s;
+        }
+    }
+    if (origin) {
+        m = find_map(origin, can_id, iface);
+        if (m)
+            account(m, f->t - origin->t);
+    }
+    if (ins) {
+        ins->hash = hash;
+        ins->t = f->t;
+        ins->can_id = can_id;
+        ins->iface = iface;
+    } else
+        ++nfull;
+done:
+    pthread_mutex_unlock(&lock);
+}
+
+static int learned(const struct map *m) {
+    return m->hits >= GW_LEARN && m->src && 2 * m->hits >= m->src->nchanges;
+}
+
+/* upper edge of the bin holding fraction q of the hits */
+static double quantile(const struct map *m, double q) {
+    unsigned long want = m->hits * q, n = 0;
+    double edge = GW_BIN0;
+    int bin;
+
+    for (bin = 0; bin < GW_BINS - 1; ++bin, edge *= 2) {
+        n += m->bins[bin];
+        if (n > want)
+            return edge;
+    }
+    return m->max;
+}
+
+static void fmtid(char *buf, canid_t can_id) {
+    if (can_id & CAN_EFF_FLAG)
+        sprintf(buf, "%08x", can_id & CAN_EFF_MASK);
+    else
+        sprintf(buf, "%03x", can_id & CAN_SFF_MASK);
+}
+
+void gw_render(FILE *fp) {
+    const struct map *m;
+    char src[12], dst[12];
+
+    if (!gw_window)
+        return;
+    pthread_mutex_lock(&lock);
+    for (m = maps; m < maps + nmaps; ++m) {
+        if (!learned(m))
+            continue;
+        fmtid(src, m->srcid);
+        fmtid(dst, m->dstid);
+        fprintf(fp, "gw %s:%s > %s:%s: %lu/%lu, latency %.2lf/%.2lf/%.2lfms "
+                "p50<%.2lfms p99<%.2lfms\n",
+                iface_name(m->srciface), src, iface_name(m->dstiface), dst,
+                m->hits, m->src->nchanges, m->min * 1e3,
+                m->sum / m->hits * 1e3, m->max * 1e3,
+                quantile(m, 0.5) * 1e3, quantile(m, 0.99) * 1e3);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void gw_report(FILE *fp) {
+    const struct map *m;
+    char src[12], dst[12];
+    double edge;
+    int bin, nlearned = 0;
+
+    if (!gw_window)
+        return;
+    for (m = maps; m < maps + nmaps; ++m)
+        nlearned += learned(m);
+    fprintf(fp, "gw: %lu changes, %i mappings, %i learned, %lu table full, "
+            "%lu mappings full\n",
+            nchanges, nmaps, nlearned, nfull, nmapfull);
+    for (m = maps; m < maps + nmaps; ++m) {
+        if (!learned(m))
+            continue;
+        fmtid(src, m->srcid);
+        fmtid(dst, m->dstid);
+        fprintf(fp, "gw %s:%s > %s:%s:", iface_name(m->srciface), src,
+                iface_name(m->dstiface), dst);
+        for (bin = 0, edge = GW_BIN0; bin < GW_BINS; ++bin, edge *= 2) {
+            if (!m->bins[bin])
+                continue;
+            if (bin < GW_BINS - 1)
+                fprintf(fp, " <%.2lfms:%lu", edge * 1e3, m->bins[bin]);
+            else
+                fprintf(fp, " >%.2lfms:%lu", edge / 2 * 1e3, m->bins[bin]);
+        }
+        fputc('\n', fp);
+    }
+}
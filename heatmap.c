@@ -0,0 +1,304 @@
+/*
+ * Copyright 2015 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include <error.h>
+#include <pthread.h>
+
+#include "canqv.h"
+
+/*
+ * ID activity over time
+ *
+ * Frames & payload changes are counted per ID in time bins of
+ * heat_bin seconds, on frame time. When a frame starts a later bin,
+ * the finished bin is appended to heat_file, 1 CSV line per active ID:
+ *	time,iface,id,frames,changes
+ * The text heatmap keeps heat_cols columns per ID. When they are
+ * full, neighbouring columns are added up, so a column covers twice
+ * as many bins. Memory does not grow with the drive: at most
+ * HEAT_MAXIDS IDs are followed, frames of other IDs are only counted.
+ */
+#define HEAT_MAXIDS	1024
+#define HEAT_HASH	2048 /* power of 2, > HEAT_MAXIDS */
+#define HEAT_MAXCOLS	256
+
+const char *heat_file;
+double heat_bin = 1.0;
+int heat_cols;
+
+static struct row {
+    int iface;
+    canid_t can_id;
+    uint8_t dat[8];
+    int dlc;
+    /* current bin */
+    unsigned int frames, changes;
+    unsigned long totframes, totchanges;
+    uint32_t hist[HEAT_MAXCOLS];
+} rows[HEAT_MAXIDS];
+static int nrows;
+/* 1 + row index */
+static uint16_t hash[HEAT_HASH];
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *fp;
+/* current bin, first bin, bins per column */
+static long curbin = -1, firstbin = -1, colbins = 1;
+static unsigned long nbins, nlines, nother;
+
+int heat_parse(const char *spec) {
+    char *str, *comma, *endp;
+
+    str = mem_strdup(MEM_MISC, spec);
+    if (!str)
+        error(1, errno, "strdup");
+    comma = strrchr(str, ',');
+    if (comma) {
+        *comma++ = 0;
+        heat_bin = strtod(comma, &endp);
+        if (endp == comma || *endp || heat_bin <= 0)
+            error(1, 0, "activity '%s': bad bin time", spec);
+    }
+    heat_file = str;
+    return 0;
+}
+
+void heat_setup(void) {
+    if (heat_cols > HEAT_MAXCOLS)
+        heat_cols = HEAT_MAXCOLS;
+    else if (heat_cols)
+        /* columns are merged in pairs */
+        heat_cols = (heat_cols < 2) ? 2 : heat_cols & ~1;
+    if (!heat_file)
+        return;
+    fp = fopen(heat_file, "w");
+    if (!fp)
+        error(1, errno, "open %s", heat_file);
+    fprintf(fp, "# canqv activity, bins of %.3lf s\n", heat_bin);
+    fprintf(fp, "time,iface,id,frames,changes\n");
+}
+
+static struct row *lookup(int iface, canid_t can_id) {
+    struct row *r;
+    unsigned int h;
+
+    h = (can_id * 0x9e3779b1U + iface) >> 21;
+    for (;; ++h) {
+        h &= HEAT_HASH - 1;
+        if (!hash[h])
+            break;
+        r = rows + hash[h] - 1;
+        if (r->can_id == can_id && r->iface == iface)
+            return r;
+    }
+    if (nrows >= HEAT_MAXIDS)
+        return NULL;
+    r = rows + nrows++;
+    hash[h] = nrows;
+    r->iface = iface;
+    r->can_id = can_id;
+    r->dlc = -1;
+    return r;
+}
+
+static void print_id(FILE *out, canid_t can_id) {
+    if (can_id & CAN_EFF_FLAG)
+        fprintf(out, "%08x", can_id & CAN_EFF_MASK);
+    else
+        fprintf(out, "%03x", can_id & CAN_SFF_MASK);
+}
+
+/* halve the resolution until the current bin has a column */
+static void fit(void) {
+    struct row *r;
+    int col;
+
+    while (heat_cols && (curbin - firstbin) / colbins >= heat_cols) {
+        for (r = rows; r < rows + nrows; ++r) {
+            for (col = 0; col < heat_cols / 2; ++col)
+                r->hist[col] = r->hist[2 * col] + r->hist[2 * col + 1];
+            memset(r->hist + col, 0, sizeof (r->hist[0]) * (heat_cols - col));
+        }
+        colbins *= 2;
+    }
+}
+
+/* the bin is done */
+static void finish(void) {
+    struct row *r;
+    long col;
+
+    if (curbin < 0)
+        return;
+    col = (curbin - firstbin) / colbins;
+    for (r = rows; r < rows + nrows; ++r) {
+        if (!r->frames)
+            continue;
+        if (fp) {
+            fprintf(fp, "%.3lf,%s,", curbin * heat_bin, iface_name(r->iface));
+            print_id(fp, r->can_id);
+            fprintf(fp, ",%u,%u\n", r->frames, r->changes);
+            ++nlines;
+        }
+        if (heat_cols)
+            r->hist[col] += r->frames;
+        r->totframes += r->frames;
+        r->totchanges += r->changes;
+        r->frames = r->changes = 0;
+    }
+    if (fp)
+        fflush(fp);
+    ++nbins;
+}
+
+/* move to the bin of time t */
+static void advance(double t) {
+    long bin = floor(t / heat_bin);
+
+    if (bin <= curbin)
+        /* late frames of other threads count in the current bin */
+        return;
+    finish();
+    curbin = bin;
+    if (firstbin < 0)
+        firstbin = bin;
+    fit();
+}
+
+void heat_batch(const struct rxbatch *rx, int iface) {
+    const struct can_frame *cf;
+    struct row *r;
+    int j;
+
+    if ((!heat_file && !heat_cols) || !rx->n)
+        return;
+    pthread_mutex_lock(&lock);
+    for (j = 0; j < rx->n; ++j) {
+        advance(rx->f[j].t);
+        cf = &rx->f[j].cf;
+        r = lookup((iface >= 0) ? iface : iface_from_ifindex(rx->ifindex[j]),
+                cf->can_id);
+        if (!r) {
+            ++nother;
+            continue;
+        }
+        ++r->frames;
+        if (r->dlc != cf->can_dlc || memcmp(r->dat, cf->data, cf->can_dlc)) {
+            if (r->dlc >= 0)
+                ++r->changes;
+            r->dlc = cf->can_dlc;
+            memcpy(r->dat, cf->data, 8);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void heat_expire(double t) {
+    if (!heat_file && !heat_cols)
+        return;
+    pthread_mutex_lock(&lock);
+    /* close the bin when the bus went quiet */
+    if (curbin >= 0 && floor(t / heat_bin) > curbin)
+        advance(t);
+    pthread_mutex_unlock(&lock);
+}
+
+/* column col of r, with the current bin */
+static uint32_t value(const struct row *r, int col, int ncols) {
+    if (col >= ncols)
+        return 0;
+    return r->hist[col] + ((col == ncols - 1) ? r->frames : 0);
+}
+
+static int cmprow(const void *va, const void *vb) {
+    const struct row *a = *(const struct row **)va;
+    const struct row *b = *(const struct row **)vb;
+
+    if (a->can_id != b->can_id)
+        return (a->can_id > b->can_id) ? 1 : -1;
+    return a->iface - b->iface;
+}
+
+void heat_render(FILE *out) {
+    static const char shades[] = " .:-=+*#%@";
+    struct row *sorted[HEAT_MAXIDS], *r;
+    uint32_t max = 0, val;
+    int j, col, ncols, shade;
+
+    if (!heat_cols)
+        return;
+    pthread_mutex_lock(&lock);
+    ncols = (curbin >= 0) ? (curbin - firstbin) / colbins + 1 : 0;
+    for (j = 0; j < nrows; ++j) {
+        sorted[j] = rows + j;
+        for (col = 0; col < ncols; ++col) {
+            val = value(rows + j, col, ncols);
+            if (val > max)
+                max = val;
+        }
+    }
+    qsort(sorted, nrows, sizeof (*sorted), cmprow);
+    fprintf(out, "activity: 1 column = %.3lf s, from %.3lf, '%c' = %u frames\n",
+            colbins * heat_bin, (firstbin >= 0) ? firstbin * heat_bin : 0.0,
+            shades[sizeof (shades) - 2], max);
+    for (j = 0; j < nrows; ++j) {
+        r = sorted[j];
+        fprintf(out, "%-8s ", iface_name(r->iface));
+        if (!(r->can_id & CAN_EFF_FLAG))
+            fprintf(out, "     ");
+        print_id(out, r->can_id);
+        fputs(" |", out);
+        for (col = 0; col < heat_cols; ++col) {
+            /* log scale, so slow IDs show too */
+            val = value(r, col, ncols);
+            shade = !val ? 0 : 1 + (int)((sizeof (shades) - 3) * log(val) /
+                    log(max > 1 ? max : 2));
+            fputc(shades[shade], out);
+        }
+        fprintf(out, "| %lu frames, %lu changes\n",
+                r->totframes + r->frames, r->totchanges + r->changes);
+    }
+    if (nother)
+        fprintf(out, "activity: %lu frames of more than %i IDs\n", nother,
+                HEAT_MAXIDS);
+    pthread_mutex_unlock(&lock);
+}
+
+void heat_close(void) {
+    pthread_mutex_lock(&lock);
+    finish();
+    curbin = -1;
+    if (fp)
+        fclose(fp);
+    fp = NULL;
+    pthread_mutex_unlock(&lock);
+}
+
+void heat_report(FILE *out) {
+    if (!heat_file && !heat_cols)
+        return;
+    fprintf(out, "activity: %i IDs, %lu frames of other IDs, %lu bins",
+            nrows, nother, nbins);
+    if (heat_file)
+        fprintf(out, ", %lu lines to %s", nlines, heat_file);
+    fputc('\n', out);
+}
@@ -0,0 +1,246 @@
+/*
+ * Copyright 2015 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include <error.h>
+#include <pthread.h>
+
+#include "canqv.h"
+
+/*
+ * passive ISO 15765-2 (ISO-TP) reassembly
+ *
+ * Only the CAN ID's that a user claims with isotp_claim() are followed.
+ * Lookup is a direct table for 11bit ID's and for 29bit normal fixed
+ * addressing (18DAxxyy), other 29bit ID's are searched in a short list.
+ * Up to 2 users may claim the same ID, each gets every PDU.
+ */
+#define ISOTP_MAXSIZE	4095
+#define ISOTP_CHANNELS	128
+#define ISOTP_TIMEOUT	1.0 /* N_Cr */
+#define ISOTP_USERS	2
+
+#define PCI_SF	0
+#define PCI_FF	1
+#define PCI_CF	2
+#define PCI_FC	3
+
+struct channel {
+    canid_t can_id;
+    isotp_cb_t cb[ISOTP_USERS];
+    int ncb;
+    /* reassembly */
+    uint16_t size, have;
+    uint8_t seq;
+    double t;
+    uint8_t dat[ISOTP_MAXSIZE];
+};
+
+static struct channel channels[ISOTP_CHANNELS];
+static int nchannels;
+/* ID -> 1 + channel index */
+static uint8_t sffchan[CAN_SFF_MASK + 1];
+static uint8_t fixchan[0x10000];
+
+static unsigned long npdus, nerrors;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void isotp_stage(const struct canqv_frame *frames, int nframes);
+
+/* the channels that claiming can_id takes, -1 when it does not fit */
+static int need(canid_t can_id, isotp_cb_t cb) {
+    struct channel *c;
+    int chan, j;
+
+    chan = isotp_channel(can_id);
+    if (!chan)
+        return (nchannels < ISOTP_CHANNELS) ? 1 : -1;
+    c = channels + chan - 1;
+    for (j = 0; j < c->ncb; ++j) {
+        if (c->cb[j] == cb)
+            return 0;
+    }
+    return (c->ncb < ISOTP_USERS) ? 0 : -1;
+}
+
+/* with the lock held, after need() */
+static void claim(canid_t can_id, isotp_cb_t cb) {
+    struct channel *c;
+    int chan, j;
+
+    chan = isotp_channel(can_id);
+    if (chan) {
+        c = channels + chan - 1;
+        for (j = 0; j < c->ncb; ++j) {
+            if (c->cb[j] == cb)
+                return;
+        }
+        c->cb[c->ncb++] = cb;
+        return;
+    }
+    if (!nchannels)
+        stage_register("isotp", isotp_stage);
+    c = channels + nchannels++;
+    c->can_id = can_id;
+    c->cb[c->ncb++] = cb;
+    if (!(can_id & CAN_EFF_FLAG))
+        sffchan[can_id & CAN_SFF_MASK] = nchannels;
+    else if ((can_id & 0x1fff0000) == 0x18da0000)
+        fixchan[can_id & 0xffff] = nchannels;
+    rt_prefault(c, sizeof (*c));
+}
+
+int isotp_claim(canid_t can_id, isotp_cb_t cb) {
+    int ret = -1;
+
+    can_id &= CAN_EFF_FLAG | CAN_EFF_MASK;
+    pthread_mutex_lock(&lock);
+    if (need(can_id, cb) >= 0) {
+        claim(can_id, cb);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+int isotp_claim_pair(canid_t a, canid_t b, isotp_cb_t cb) {
+    int na, nb, ret = -1;
+
+    a &= CAN_EFF_FLAG | CAN_EFF_MASK;
+    b &= CAN_EFF_FLAG | CAN_EFF_MASK;
+    pthread_mutex_lock(&lock);
+    na = need(a, cb);
+    nb = (b == a) ? 0 : need(b, cb);
+    if (na >= 0 && nb >= 0 && nchannels + na + nb <= ISOTP_CHANNELS) {
+        claim(a, cb);
+        claim(b, cb);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+int isotp_channel(canid_t can_id) {
+    int j;
+
+    if (!(can_id & CAN_EFF_FLAG))
+        return sffchan[can_id & CAN_SFF_MASK];
+    can_id &= CAN_EFF_FLAG | CAN_EFF_MASK;
+    if ((can_id & 0x1fff0000) == 0x18da0000)
+        return fixchan[can_id & 0xffff];
+    for (j = 0; j < nchannels; ++j) {
+        if (channels[j].can_id == can_id)
+            return j + 1;
+    }
+    return 0;
+}
+
+static void deliver(struct channel *c, const uint8_t *dat, int len, double t) {
+    int j;
+
+    ++npdus;
+    for (j = 0; j < c->ncb; ++j)
+        c->cb[j](c->can_id, t, dat, len);
+}
+
+static void isotp_frame(int chan, const struct canqv_frame *f) {
+    struct channel *c = channels + chan - 1;
+    const uint8_t *dat = f->cf.data;
+    int len, dlc = f->cf.can_dlc;
+
+    if (!dlc)
+        return;
+    switch (dat[0] >> 4) {
+    case PCI_SF:
+        len = dat[0] & 0xf;
+        if (!len || len > dlc - 1) {
+            ++nerrors;
+            return;
+        }
+        c->size = 0;
+        deliver(c, dat + 1, len, f->t);
+        break;
+    case PCI_FF:
+        if (dlc < 8) {
+            ++nerrors;
+            return;
+        }
+        c->size = (dat[0] & 0xf) << 8 | dat[1];
+        if (c->size < 8) {
+            /* invalid, or a 32bit length which we do not follow */
+            ++nerrors;
+            c->size = 0;
+            return;
+        }
+        memcpy(c->dat, dat + 2, 6);
+        c->have = 6;
+        c->seq = 1;
+        c->t = f->t;
+        break;
+    case PCI_CF:
+        if (!c->size)
+            /* not in a transfer */
+            return;
+        if ((dat[0] & 0xf) != c->seq || f->t - c->t > ISOTP_TIMEOUT) {
+            ++nerrors;
+            c->size = 0;
+            return;
+        }
+        c->seq = (c->seq + 1) & 0xf;
+        len = c->size - c->have;
+        if (len > dlc - 1)
+            len = dlc - 1;
+        memcpy(c->dat + c->have, dat + 1, len);
+        c->have += len;
+        c->t = f->t;
+        if (c->have >= c->size) {
+            len = c->size;
+            c->size = 0;
+            deliver(c, c->dat, len, f->t);
+        }
+        break;
+    case PCI_FC:
+        /* the sender's business */
+        break;
+    default:
+        ++nerrors;
+        break;
+    }
+}
+
+/* decode stage, see pool.c */
+static void isotp_stage(const struct canqv_frame *frames, int nframes) {
+    int j, chan;
+
+    pthread_mutex_lock(&lock);
+    for (j = 0; j < nframes; ++j) {
+        chan = isotp_channel(frames[j].cf.can_id &
+                (CAN_EFF_FLAG | CAN_EFF_MASK));
+        if (chan)
+            isotp_frame(chan, frames + j);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void isotp_report(FILE *fp) {
+    if (!nchannels)
+        return;
+    fprintf(fp, "isotp: %i channels, %lu PDUs, %lu errors\n",
+            nchannels, npdus, nerrors);
+}
@@ -0,0 +1,427 @@
+/*
+ * Copyright 2015 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include "canqv.h"
+
+/*
+ * J1939: split 29bit ID's into priority, PGN, source (and destination),
+ * and reassemble transport protocol (BAM & RTS/CTS) messages.
+ */
+int j1939;
+
+#define PF_TPDT		0xeb
+#define PF_TPCM		0xec
+
+#define TP_RTS		0x10
+#define TP_CTS		0x11
+#define TP_EOMA		0x13
+#define TP_BAM		0x20
+#define TP_ABORT	0xff
+
+#define TP_MAXSIZE	1785
+/* T2/T3 from J1939-21 */
+#define TP_TIMEOUT	1.25
+
+/* session buffers come from a fixed pool */
+#define TP_SESSIONS	256
+/* completed messages that are shown */
+#define TP_MSGS		64
+#define TP_SHOW		24
+
+struct tpsess {
+    uint32_t pgn;
+    uint8_t sa, da;
+    uint16_t size;
+    uint8_t npkts, next;
+    double t;
+    struct tpsess *free;
+    uint8_t dat[TP_MAXSIZE];
+};
+
+struct tpmsg {
+    uint32_t pgn;
+    uint8_t sa, da;
+    uint16_t size;
+    unsigned long count;
+    double t;
+    uint8_t dat[TP_SHOW];
+};
+
+static struct tpsess pool[TP_SESSIONS];
+static struct tpsess *freelist;
+static int nsessions, maxsessions;
+/* (sa << 8 | da) -> 1 + pool index */
+static uint16_t sessions[0x10000];
+
+static struct tpmsg msgs[TP_MSGS];
+static int nmsgs;
+
+static unsigned long ncompleted, naborted, ntimeouts, nnobuf, nerrors;
+
+/* the pool may run the stage in parallel for different sources */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* PGN names, sorted on PGN */
+static const struct pgnname {
+    uint32_t pgn;
+    const char *acronym;
+    const char *name;
+} pgnnames[] = {
+    { 0, "TSC1", "Torque/Speed Control 1", },
+    { 256, "TC1", "Transmission Control 1", },
+    { 57344, "CM1", "Cab Message 1", },
+    { 59392, "ACKM", "Acknowledgment", },
+    { 59904, "RQST", "Request", },
+    { 60160, "TP.DT", "Transport Protocol - Data Transfer", },
+    { 60416, "TP.CM", "Transport Protocol - Connection Mgmt", },
+    { 60928, "AC", "Address Claimed", },
+    { 61184, "PropA", "Proprietary A", },
+    { 61440, "ERC1", "Electronic Retarder Controller 1", },
+    { 61441, "EBC1", "Electronic Brake Controller 1", },
+    { 61442, "ETC1", "Electronic Transmission Controller 1", },
+    { 61443, "EEC2", "Electronic Engine Controller 2", },
+    { 61444, "EEC1", "Electronic Engine Controller 1", },
+    { 61445, "ETC2", "Electronic Transmission Controller 2", },
+    { 61449, "VDC2", "Vehicle Dynamic Stability Control 2", },
+    { 61450, "EGF1", "Engine Gas Flow Rate", },
+    { 64892, "DPFC1", "Diesel Particulate Filter Control 1", },
+    { 64965, "ECUID", "ECU Identification", },
+    { 65088, "LD", "Lighting Data", },
+    { 65089, "LCMD", "Lighting Command", },
+    { 65098, "ETC7", "Electronic Transmission Controller 7", },
+    { 65102, "DC1", "Door Control 1", },
+    { 65110, "AT1T1I", "Aftertreatment 1 Diesel Exhaust Fluid Tank 1", },
+    { 65131, "DI", "Driver's Identification", },
+    { 65132, "TCO1", "Tachograph", },
+    { 65134, "HRW", "High Resolution Wheel Speed", },
+    { 65198, "AIR1", "Air Supply Pressure", },
+    { 65215, "EBC2", "Wheel Speed Information", },
+    { 65217, "VDHR", "High Resolution Vehicle Distance", },
+    { 65226, "DM1", "Active Diagnostic Trouble Codes", },
+    { 65227, "DM2", "Previously Active Diagnostic Trouble Codes", },
+    { 65228, "DM3", "Diagnostic Data Clear", },
+    { 65240, "CA", "Commanded Address", },
+    { 65242, "SOFT", "Software Identification", },
+    { 65247, "EEC3", "Electronic Engine Controller 3", },
+    { 65248, "VD", "Vehicle Distance", },
+    { 65249, "RC", "Retarder Configuration", },
+    { 65250, "TC", "Transmission Configuration", },
+    { 65251, "EC1", "Engine Configuration 1", },
+    { 65253, "HOURS", "Engine Hours, Revolutions", },
+    { 65254, "TD", "Time/Date", },
+    { 65257, "LFC", "Fuel Consumption (Liquid)", },
+    { 65258, "VW", "Vehicle Weight", },
+    { 65259, "CI", "Component Identification", },
+    { 65260, "VI", "Vehicle Identification", },
+    { 65262, "ET1", "Engine Temperature 1", },
+    { 65263, "EFL/P1", "Engine Fluid Level/Pressure 1", },
+    { 65264, "PTO", "Power Takeoff Information", },
+    { 65265, "CCVS", "Cruise Control/Vehicle Speed", },
+    { 65266, "LFE", "Fuel Economy (Liquid)", },
+    { 65267, "VP", "Vehicle Position", },
+    { 65268, "TIRE", "Tire Condition", },
+    { 65269, "AMB", "Ambient Conditions", },
+    { 65270, "IC1", "Inlet/Exhaust Conditions 1", },
+    { 65271, "VEP1", "Vehicle Electrical Power 1", },
+    { 65272, "TRF1", "Transmission Fluids 1", },
+    { 65274, "B", "Brakes", },
+    { 65276, "DD", "Dash Display", },
+    { 65279, "WFI", "Water in Fuel Indicator", },
+    { 126720, "PropA2", "Proprietary A2", },
+};
+
+static int cmppgnname(const void *vkey, const void *velm) {
+    uint32_t key = *(const uint32_t *)vkey;
+    const struct pgnname *elm = velm;
+
+    return (key > elm->pgn) - (key < elm->pgn);
+}
+
+const char *j1939_pgnname(uint32_t pgn) {
+    const struct pgnname *p;
+
+    if ((pgn & 0x1ff00) == 0xff00)
+        return "PropB";
+    p = bsearch(&pgn, pgnnames, sizeof (pgnnames) / sizeof (pgnnames[0]),
+            sizeof (pgnnames[0]), cmppgnname);
+    return p ? p->acronym : "";
+}
+
+static const char *pgnlongname(uint32_t pgn) {
+    const struct pgnname *p;
+
+    p = bsearch(&pgn, pgnnames, sizeof (pgnnames) / sizeof (pgnnames[0]),
+            sizeof (pgnnames[0]), cmppgnname);
+    return p ? p->name : "";
+}
+
+/* PGN of a 29bit ID, destination is 0xff for PDU2 (broadcast) */
+uint32_t j1939_pgn(canid_t id, int *da) {
+    uint32_t pgn = (id >> 8) & 0x3ffff;
+
+    if (((pgn >> 8) & 0xff) < 0xf0) {
+        /* PDU1, PS is the destination */
+        if (da)
+            *da = pgn & 0xff;
+        return pgn & ~0xff;
+    }
+    if (da)
+        *da = 0xff;
+    return pgn;
+}
+
+/* cache key: priority does not matter */
+canid_t j1939_key(canid_t can_id) {
+    return can_id & ~(7 << 26);
+}
+
+int j1939_describe(canid_t can_id, char *buf, size_t len) {
+    uint32_t pgn;
+    int da;
+
+    pgn = j1939_pgn(can_id, &da);
+    if (da == 0xff)
+        return snprintf(buf, len, "%u %05x %02x    %-6s", (can_id >> 26) & 7,
+                pgn, can_id & 0xff, j1939_pgnname(pgn));
+    return snprintf(buf, len, "%u %05x %02x>%02x %-6s", (can_id >> 26) & 7,
+            pgn, can_id & 0xff, da, j1939_pgnname(pgn));
+}
+
+static struct tpsess *tp_find(int sa, int da) {
+    int idx = sessions[sa << 8 | da];
+
+    return idx ? pool + idx - 1 : NULL;
+}
+
+static void tp_close(struct tpsess *s) {
+    sessions[s->sa << 8 | s->da] = 0;
+    s->free = freelist;
+    freelist = s;
+    --nsessions;
+}
+
+static struct tpsess *tp_open(int sa, int da) {
+    struct tpsess *s;
+
+    s = tp_find(sa, da);
+    if (s) {
+        /* a new announce aborts the running session */
+        ++naborted;
+        tp_close(s);
+    }
+    if (!freelist) {
+        ++nnobuf;
+        return NULL;
+    }
+    s = freelist;
+    freelist = s->free;
+    s->sa = sa;
+    s->da = da;
+    sessions[sa << 8 | da] = s - pool + 1;
+    if (++nsessions > maxsessions)
+        maxsessions = nsessions;
+    return s;
+}
+
+static void tp_complete(struct tpsess *s, double t) {
+    struct tpmsg *m;
+    int j, oldest;
+
+    ++ncompleted;
+    for (j = 0; j < nmsgs; ++j) {
+        m = msgs + j;
+        if (m->pgn == s->pgn && m->sa == s->sa && m->da == s->da)
+            goto found;
+    }
+    if (nmsgs < TP_MSGS) {
+        m = msgs + nmsgs++;
+    } else {
+        /* replace the oldest */
+        for (oldest = 0, j = 1; j < nmsgs; ++j) {
+            if (msgs[j].t < msgs[oldest].t)
+                oldest = j;
+        }
+        m = msgs + oldest;
+    }
+    memset(m, 0, sizeof (*m));
+    m->pgn = s->pgn;
+    m->sa = s->sa;
+    m->da = s->da;
+found:
+    ++m->count;
+    m->t = t;
+    m->size = s->size;
+    memcpy(m->dat, s->dat, (s->size < TP_SHOW) ? s->size : TP_SHOW);
+}
+
+static void tp_frame(const struct canqv_frame *f) {
+    const uint8_t *dat = f->cf.data;
+    int pf, sa, da, off, len;
+    struct tpsess *s;
+
+    pf = (f->cf.can_id >> 16) & 0xff;
+    sa = f->cf.can_id & 0xff;
+    da = (f->cf.can_id >> 8) & 0xff;
+
+    if (pf == PF_TPCM && f->cf.can_dlc >= 8) {
+        switch (dat[0]) {
+        case TP_RTS:
+        case TP_BAM:
+            if (dat[0] == TP_BAM)
+                da = 0xff;
+            s = tp_open(sa, da);
+            if (!s)
+                return;
+            s->size = dat[1] | dat[2] << 8;
+            s->npkts = dat[3];
+            s->pgn = dat[5] | dat[6] << 8 | dat[7] << 16;
+            s->next = 1;
+            s->t = f->t;
+            if (s->size < 9 || s->size > TP_MAXSIZE ||
+                    s->npkts != (s->size + 6) / 7) {
+                ++nerrors;
+                tp_close(s);
+            }
+            break;
+        case TP_ABORT:
+            /* either side may abort */
+            s = tp_find(sa, da) ?: tp_find(da, sa);
+            if (s) {
+                ++naborted;
+                tp_close(s);
+            }
+            break;
+        case TP_CTS:
+        case TP_EOMA:
+            /* the data tells enough */
+            break;
+        }
+        return;
+    }
+    if (pf == PF_TPDT && f->cf.can_dlc >= 2) {
+        s = tp_find(sa, da);
+        if (!s)
+            return;
+        if (dat[0] != s->next) {
+            /* lost a packet, or a retransmission after CTS */
+            if (dat[0] < s->next)
+                return;
+            ++nerrors;
+            tp_close(s);
+            return;
+        }
+        off = (dat[0] - 1) * 7;
+        len = s->size - off;
+        if (len > 7)
+            len = 7;
+        if (len > f->cf.can_dlc - 1)
+            len = f->cf.can_dlc - 1;
+        memcpy(s->dat + off, dat + 1, len);
+        s->t = f->t;
+        if (s->next++ == s->npkts) {
+            tp_complete(s, f->t);
+            tp_close(s);
+        }
+    }
+}
+
+/* decode stage, see pool.c */
+static void j1939_stage(const struct canqv_frame *frames, int nframes) {
+    int j, pf;
+
+    pthread_mutex_lock(&lock);
+    for (j = 0; j < nframes; ++j) {
+        if (!(frames[j].cf.can_id & CAN_EFF_FLAG))
+            continue;
+        pf = (frames[j].cf.can_id >> 16) & 0xff;
+        if (pf == PF_TPCM || pf == PF_TPDT)
+            tp_frame(frames + j);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/* keep all frames of 1 source on 1 pool lane, so TP.DT follows TP.CM */
+static canid_t j1939_lanekey(canid_t can_id) {
+    return (can_id & CAN_EFF_FLAG) ? can_id & 0xff : can_id;
+}
+
+void j1939_setup(void) {
+    int j;
+
+    if (!j1939)
+        return;
+    for (j = TP_SESSIONS - 1; j >= 0; --j) {
+        pool[j].free = freelist;
+        freelist = pool + j;
+    }
+    rt_prefault(pool, sizeof (pool));
+    rt_prefault(sessions, sizeof (sessions));
+    pool_lanekey = j1939_lanekey;
+    stage_register("j1939-tp", j1939_stage);
+}
+
+void j1939_expire(double t) {
+    int j;
+
+    if (!j1939)
+        return;
+    pthread_mutex_lock(&lock);
+    for (j = 0; j < TP_SESSIONS; ++j) {
+        /* freed slots keep their old sa & da */
+        if (sessions[pool[j].sa << 8 | pool[j].da] != j + 1)
+            continue;
+        if (t - pool[j].t > TP_TIMEOUT) {
+            ++ntimeouts;
+            tp_close(pool + j);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void j1939_render(FILE *fp) {
+    int j, k;
+    const struct tpmsg *m;
+
+    if (!j1939 || !nmsgs)
+        return;
+    pthread_mutex_lock(&lock);
+    fputs("multi-packet messages\n", fp);
+    for (j = 0; j < nmsgs; ++j) {
+        m = msgs + j;
+        fprintf(fp, "  %05x %02x>%02x %-6s %4u:", m->pgn, m->sa, m->da,
+                j1939_pgnname(m->pgn), m->size);
+        for (k = 0; k < m->size && k < TP_SHOW; ++k)
+            fprintf(fp, " %02x", m->dat[k]);
+        fprintf(fp, "%s\tn=%lu\t%s\n", (m->size > TP_SHOW) ? " ..." : "",
+                m->count, pgnlongname(m->pgn));
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void j1939_report(FILE *fp) {
+    if (!j1939)
+        return;
+    fprintf(fp, "j1939: %lu messages, %lu aborted, %lu timeouts, %lu errors, "
+            "%lu without buffer, %i/%i sessions (max %i)\n",
+            ncompleted, naborted, ntimeouts, nerrors, nnobuf,
+            nsessions, TP_SESSIONS, maxsessions);
+}
@@ -0,0 +1,223 @@
+/*
+ * Copyright 2015 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <error.h>
+#include <sys/stat.h>
+
+#include "canqv.h"
+#include "probes.h"
+
+/*
+ * crash-safe log blocks
+ *
+ * The log is a sequence of blocks, each starting on a LOGBLK_ALIGN
+ * boundary with a header that holds a magic, a sequence number, the
+ * payload length and a CRC32 over header & payload.
+ * A block is written at once, and synced, into a preallocated file,
+ * so a power cut damages at most the block in flight.
+ * Opening an existing log appends after its last intact block.
+ */
+#define LOGBLK_PREALLOC	(16 << 20)
+
+/* crc32 (IEEE 802.3), slicing by 8 so recovery keeps up with the disk */
+static uint32_t crctab[8][256];
+
+static void crc_init(void) {
+    uint32_t crc;
+    int j, k;
+
+    for (j = 0; j < 256; ++j) {
+        crc = j;
+        for (k = 0; k < 8; ++k)
+            crc = (crc >> 1) ^ ((crc & 1) ? 0xedb88320 : 0);
+        crctab[0][j] = crc;
+    }
+    for (j = 0; j < 256; ++j) {
+        for (k = 1; k < 8; ++k)
+            crctab[k][j] = (crctab[k - 1][j] >> 8) ^
+                crctab[0][crctab[k - 1][j] & 0xff];
+    }
+}
+
+uint32_t logblk_crc(uint32_t crc, const void *vbuf, size_t len) {
+    const uint8_t *buf = vbuf;
+    uint32_t lo, hi;
+
+    if (!crctab[0][1])
+        crc_init();
+    crc = ~crc;
+    for (; len >= 8; len -= 8, buf += 8) {
+        /* little endian */
+        memcpy(&lo, buf, 4);
+        memcpy(&hi, buf + 4, 4);
+        lo ^= crc;
+        crc = crctab[7][lo & 0xff] ^ crctab[6][(lo >> 8) & 0xff] ^
+            crctab[5][(lo >> 16) & 0xff] ^ crctab[4][lo >> 24] ^
+            crctab[3][hi & 0xff] ^ crctab[2][(hi >> 8) & 0xff] ^
+            crctab[1][(hi >> 16) & 0xff] ^ crctab[0][hi >> 24];
+    }
+    while (len--)
+        crc = crctab[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static uint32_t blkcrc(const struct logblk_hdr *hdr) {
+    struct logblk_hdr tmp = *hdr;
+
+    tmp.crc = 0;
+    return logblk_crc(logblk_crc(0, &tmp, sizeof (tmp)), hdr + 1, hdr->len);
+}
+
+size_t logblk_check(const void *vblk, size_t avail) {
+    const struct logblk_hdr *hdr = vblk;
+
+    if (avail < sizeof (*hdr) || hdr->magic != LOGBLK_MAGIC)
+        return 0;
+    if (hdr->len > LOGBLK_SIZE - sizeof (*hdr) ||
+            sizeof (*hdr) + hdr->len > avail)
+        return 0;
+    if (blkcrc(hdr) != hdr->crc)
+        return 0;
+    return LOGBLK_ROUND(sizeof (*hdr) + hdr->len);
+}
+
+/* writer */
+static int fd = -1;
+static off_t offset, allocated;
+static uint32_t seq;
+static union {
+    struct logblk_hdr hdr;
+    uint8_t dat[LOGBLK_SIZE];
+} blk;
+static size_t fill;
+static unsigned long nblocks, nrecords, nsyncerr;
+static int noprealloc;
+
+/* find the end of the intact blocks */
+static void scan(void) {
+    static uint8_t buf[1 << 20];
+    size_t have = 0, pos, len;
+    off_t base = 0;
+    ssize_t ret;
+
+    for (;;) {
+        ret = read(fd, buf + have, sizeof (buf) - have);
+        if (ret < 0)
+            error(1, errno, "read log");
+        have += ret;
+        for (pos = 0; pos + LOGBLK_SIZE <= have ||
+                (!ret && pos + sizeof (struct logblk_hdr) <= have);
+                pos += LOGBLK_ALIGN) {
+            len = logblk_check(buf + pos, have - pos);
+            if (!len)
+                continue;
+            seq = ((struct logblk_hdr *)(buf + pos))->seq + 1;
+            offset = base + pos + len;
+            pos += len - LOGBLK_ALIGN;
+        }
+        if (!ret)
+            break;
+        memmove(buf, buf + pos, have - pos);
+        base += pos;
+        have -= pos;
+    }
+}
+
+int logblk_open(const char *file) {
+    struct stat st;
+
+    fd = open(file, O_RDWR | O_CREAT, 0666);
+    if (fd < 0)
+        error(1, errno, "open %s", file);
+    scan();
+    if (fstat(fd, &st) < 0)
+        error(1, errno, "stat %s", file);
+    allocated = st.st_size;
+    fill = sizeof (blk.hdr);
+    return 0;
+}
+
+void logblk_flush(void) {
+    size_t len;
+
+    if (fd < 0 || fill <= sizeof (blk.hdr))
+        return;
+    len = LOGBLK_ROUND(fill);
+    memset(blk.dat + fill, 0, len - fill);
+    blk.hdr.magic = LOGBLK_MAGIC;
+    blk.hdr.seq = seq++;
+    blk.hdr.len = fill - sizeof (blk.hdr);
+    blk.hdr.crc = blkcrc(&blk.hdr);
+    PROBE2(log_flush_start, blk.hdr.seq, len);
+    TRACE_BEGIN("log flush");
+
+    if (offset + len > allocated && !noprealloc) {
+        /* the file size is settled beforehand, so fdatasync stays cheap */
+        if (fallocate(fd, 0, offset, LOGBLK_PREALLOC) < 0) {
+            error(0, errno, "fallocate log, continuing without");
+            noprealloc = 1;
+        } else
+            allocated = offset + LOGBLK_PREALLOC;
+    }
+    if (pwrite(fd, blk.dat, len, offset) != len)
+        error(1, errno, "write log");
+    if (fdatasync(fd) < 0)
+        ++nsyncerr;
+    TRACE_END("log flush");
+    PROBE2(log_flush_end, blk.hdr.seq, len);
+    offset += len;
+    ++nblocks;
+    fill = sizeof (blk.hdr);
+}
+
+void logblk_append(const char *rec, size_t len, double t) {
+    if (fd < 0)
+        return;
+    if (len > sizeof (blk) - sizeof (blk.hdr))
+        len = sizeof (blk) - sizeof (blk.hdr);
+    if (fill + len > sizeof (blk))
+        logblk_flush();
+    if (fill == sizeof (blk.hdr))
+        blk.hdr.usec = t * 1e6;
+    memcpy(blk.dat + fill, rec, len);
+    fill += len;
+    ++nrecords;
+}
+
+void logblk_close(void) {
+    if (fd < 0)
+        return;
+    logblk_flush();
+    /* drop the preallocated tail */
+    if (allocated > offset && ftruncate(fd, offset) < 0)
+        error(0, errno, "truncate log");
+    close(fd);
+    fd = -1;
+}
+
+void logblk_report(FILE *fp) {
+    if (!nrecords)
+        return;
+    fprintf(fp, "log: %lu records, %lu blocks, seq %u, %lu sync errors\n",
+            nrecords, nblocks, seq, nsyncerr);
+}
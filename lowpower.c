@@ -0,0 +1,137 @@
+/*
+ * Copyright 2015 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <time.h>
+
+#include <error.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+
+#include "canqv.h"
+
+/*
+ * low-power mode: wake up every interval, and drain the socket.
+ *
+ * The kernel cannot wake us on a socket fill level, so the fill
+ * threshold is applied ahead: the sleep is cut short when, at the
+ * current frame rate, the socket buffer would fill beyond lp_fill.
+ * The interval halves on each kernel drop, and grows back slowly
+ * up to lp_maxinterval while no drops occur.
+ */
+double lp_maxinterval; /* seconds, 0 when off */
+double lp_fill = 0.5;
+
+/* requested socket buffer, and an estimate of the kernel's cost per frame */
+#define LP_RCVBUF	(1 << 20)
+#define LP_TRUESIZE	1024
+#define LP_MININTERVAL	0.001
+#define LP_CALM		10.0
+
+static double interval;
+static double rate; /* frames/sec, smoothed */
+static int capacity; /* frames that fit in the socket buffer */
+static unsigned int lastdrops;
+static int dropsvalid;
+static double lastwake, lastchange;
+
+/* statistics */
+static unsigned long nwakeups, nframes, ndrops;
+static double t0, cpu0;
+
+static double cputime(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void lp_setup(int sock) {
+    int size = LP_RCVBUF;
+    socklen_t len = sizeof (size);
+
+    /* a large buffer allows longer sleeps */
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &size,
+                sizeof (size)) < 0 &&
+            setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof (size)) < 0)
+        error(0, errno, "lowpower: SO_RCVBUF");
+    if (getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, &len) < 0)
+        size = 0;
+    capacity = size / LP_TRUESIZE;
+    if (capacity < RXBATCH)
+        capacity = RXBATCH;
+
+    /* let the kernel merge our wakeups with others */
+    if (prctl(PR_SET_TIMERSLACK, (unsigned long) (lp_maxinterval * 1e8)) < 0)
+        error(0, errno, "lowpower: PR_SET_TIMERSLACK");
+
+    interval = lp_maxinterval;
+    t0 = lastwake = lastchange = now();
+    cpu0 = cputime();
+}
+
+double lp_sleep(void) {
+    double sleep = interval, full;
+
+    if (rate > 0) {
+        full = lp_fill * capacity / rate;
+        if (full < sleep)
+            sleep = full;
+    }
+    return (sleep < LP_MININTERVAL) ? LP_MININTERVAL : sleep;
+}
+
+void lp_account(int n, unsigned int drops, double t) {
+    double dt = t - lastwake;
+
+    ++nwakeups;
+    nframes += n;
+    if (dt > 0)
+        rate = (rate * 3 + n / dt) / 4;
+    lastwake = t;
+
+    if (dropsvalid && drops != lastdrops) {
+        ndrops += drops - lastdrops;
+        /* the buffer overflowed, so it holds no more than we just got */
+        if (n >= RXBATCH && n < capacity)
+            capacity = n;
+        interval /= 2;
+        if (interval < LP_MININTERVAL)
+            interval = LP_MININTERVAL;
+        lastchange = t;
+    } else if (t - lastchange > LP_CALM && interval < lp_maxinterval) {
+        interval *= 1.25;
+        if (interval > lp_maxinterval)
+            interval = lp_maxinterval;
+        lastchange = t;
+    }
+    lastdrops = drops;
+    dropsvalid = 1;
+}
+
+void lp_report(FILE *fp) {
+    double dt;
+
+    if (!lp_maxinterval)
+        return;
+    dt = now() - t0;
+    fprintf(fp, "lowpower: interval %.0lfms (max %.0lfms), %.1lf wakeups/s, "
+            "%.2lfus cpu/frame, %lu drops, buffer ~%i frames\n",
+            interval * 1e3, lp_maxinterval * 1e3,
+            dt > 0 ? nwakeups / dt : 0.0,
+            nframes ? (cputime() - cpu0) * 1e6 / nframes : 0.0,
+            ndrops, capacity);
+}
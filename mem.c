@@ -0,0 +1,351 @@
+/*
+ * Copyright 2015 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include <error.h>
+#include <sys/mman.h>
+
+#include "canqv.h"
+
+/*
+ * tagged memory accounting
+ *
+ * Every heap block carries a small header with its size and tag, so
+ * the current & peak bytes of each subsystem are known without a
+ * table. A tag may have a cap: an allocation beyond it fails with
+ * ENOMEM, and the subsystem does without (drops new IDs, keeps a stale
+ * view, stops tracing) instead of growing until the logger is killed.
+ *
+ * With mem_hugepages, blocks of MEM_HUGEMIN and more (the cache tables,
+ * decode lanes, trace rings, log buffers) are mapped on their own,
+ * in huge pages (MAP_HUGETLB, from the reserved pool), or else aligned
+ * & advised for transparent huge pages. Such a region is accounted in
+ * whole huge pages, and grows in place up to its mapping.
+ */
+#define MEM_HUGEMIN	(128 << 10)
+
+struct memhdr {
+    size_t len;
+    /* 0 on the heap */
+    size_t maplen;
+    int tag;
+    /* from the start of the block to the user data */
+    int offset;
+    int kind;
+};
+#define HDRSIZE	32
+
+enum { HEAP, HUGETLB, THP, KINDS, };
+static const char *const kindnames[KINDS] = { "heap", "hugetlb", "thp", };
+
+int mem_hugepages;
+static size_t hugesize = 2 << 20;
+static atomic_int nregions[MEM_TAGS][KINDS];
+
+static const char *const tagnames[MEM_TAGS] = {
+    "cache", "capture", "decode", "log", "trace", "search", "misc",
+};
+
+static atomic_long cur[MEM_TAGS], peak[MEM_TAGS];
+static atomic_ulong ndenied[MEM_TAGS];
+static size_t caps[MEM_TAGS];
+
+/* parse TAG=MB[,TAG=MB ...] */
+int mem_parse_caps(const char *spec) {
+    char *str, *tok, *saved, *eq, *endp;
+    double mb;
+    int j;
+
+    str = strdup(spec);
+    if (!str)
+        error(1, errno, "strdup");
+    for (tok = strtok_r(str, ",", &saved); tok;
+            tok = strtok_r(NULL, ",", &saved)) {
+        eq = strchr(tok, '=');
+        if (!eq)
+            error(1, 0, "memory cap '%s': expected TAG=MB", tok);
+        *eq = 0;
+        for (j = 0; j < MEM_TAGS; ++j) {
+            if (!strcmp(tok, tagnames[j]))
+                break;
+        }
+        if (j >= MEM_TAGS)
+            error(1, 0, "memory cap: unknown subsystem '%s'", tok);
+        mb = strtod(eq + 1, &endp);
+        if (endp == eq + 1 || *endp || mb <= 0)
+            error(1, 0, "memory cap %s: bad size '%s'", tok, eq + 1);
+        caps[j] = mb * (1 << 20);
+    }
+    free(str);
+    return 0;
+}
+
+/* account len more bytes, 0 when the cap forbids */
+static int reserve(int tag, long len) {
+    long total, max;
+
+    total = atomic_fetch_add(&cur[tag], len) + len;
+    if (len > 0 && caps[tag] && total > (long)caps[tag]) {
+        atomic_fetch_sub(&cur[tag], len);
+        atomic_fetch_add_explicit(&ndenied[tag], 1, memory_order_relaxed);
+        errno = ENOMEM;
+        return 0;
+    }
+    max = atomic_load_explicit(&peak[tag], memory_order_relaxed);
+    while (total > max &&
+            !atomic_compare_exchange_weak(&peak[tag], &max, total))
+        ;
+    return 1;
+}
+
+static inline struct memhdr *hdr(void *ptr) {
+    return (struct memhdr *)((char *)ptr - HDRSIZE);
+}
+
+static void *init(void *base, int offset, int tag, size_t len) {
+    struct memhdr *h;
+
+    h = (struct memhdr *)((char *)base + offset - HDRSIZE);
+    h->len = len;
+    h->maplen = 0;
+    h->tag = tag;
+    h->offset = offset;
+    h->kind = HEAP;
+    return (char *)base + offset;
+}
+
+void mem_setup(void) {
+    FILE *fp;
+    char line[128];
+    unsigned long kb;
+
+    if (!mem_hugepages)
+        return;
+    fp = fopen("/proc/meminfo", "r");
+    if (!fp)
+        return;
+    while (fgets(line, sizeof (line), fp)) {
+        if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1)
+            hugesize = kb << 10;
+    }
+    fclose(fp);
+}
+
+/* a mapping of its own, in huge pages when possible */
+static void *region(int tag, size_t align, size_t len) {
+    struct memhdr *h;
+    size_t maplen;
+    char *base, *aligned;
+    int offset, kind;
+
+    offset = (align > HDRSIZE) ? align : HDRSIZE;
+    maplen = (offset + len + hugesize - 1) & ~(hugesize - 1);
+    if (!reserve(tag, maplen))
+        return NULL;
+    kind = HUGETLB;
+    base = mmap(NULL, maplen, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (base == MAP_FAILED) {
+        /* no reserved huge pages: align on a huge page, for THP */
+        kind = THP;
+        base = mmap(NULL, maplen + hugesize, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            reserve(tag, -(long)maplen);
+            return NULL;
+        }
+        aligned = (char *)(((uintptr_t)base + hugesize - 1) &
+                ~(uintptr_t)(hugesize - 1));
+        if (aligned > base)
+            munmap(base, aligned - base);
+        if (aligned + maplen < base + maplen + hugesize)
+            munmap(aligned + maplen, base + hugesize - aligned);
+        base = aligned;
+        madvise(base, maplen, MADV_HUGEPAGE);
+    }
+    atomic_fetch_add(&nregions[tag][kind], 1);
+    h = (struct memhdr *)(base + offset - HDRSIZE);
+    h->len = len;
+    h->maplen = maplen;
+    h->tag = tag;
+    h->offset = offset;
+    h->kind = kind;
+    return base + offset;
+}
+
+static void region_free(struct memhdr *h) {
+    atomic_fetch_sub(&nregions[h->tag][h->kind], 1);
+    reserve(h->tag, -(long)h->maplen);
+    munmap((char *)h + HDRSIZE - h->offset, h->maplen);
+}
+
+void *mem_alloc(int tag, size_t len) {
+    void *base;
+
+    if (mem_hugepages && len >= MEM_HUGEMIN)
+        return region(tag, 0, len);
+    if (!reserve(tag, len))
+        return NULL;
+    base = calloc(1, HDRSIZE + len);
+    if (!base) {
+        reserve(tag, -(long)len);
+        return NULL;
+    }
+    return init(base, HDRSIZE, tag, len);
+}
+
+void *mem_memalign(int tag, size_t align, size_t len) {
+    void *base;
+    int ret;
+
+    if (align < HDRSIZE)
+        align = HDRSIZE;
+    if (mem_hugepages && len >= MEM_HUGEMIN)
+        return region(tag, align, len);
+    if (!reserve(tag, len))
+        return NULL;
+    ret = posix_memalign(&base, align, align + len);
+    if (ret) {
+        reserve(tag, -(long)len);
+        errno = ret;
+        return NULL;
+    }
+    return init(base, align, tag, len);
+}
+
+void *mem_realloc(int tag, void *ptr, size_t len) {
+    struct memhdr *h;
+    void *base;
+    size_t old;
+
+    if (!ptr)
+        return mem_alloc(tag, len);
+    h = hdr(ptr);
+    if (h->offset != HDRSIZE)
+        error(1, 0, "mem_realloc of an aligned block");
+    /* a block keeps its tag */
+    tag = h->tag;
+    old = h->len;
+    if (h->kind != HEAP && HDRSIZE + len <= h->maplen) {
+        /* in place */
+        h->len = len;
+        return ptr;
+    }
+    if (h->kind != HEAP || (mem_hugepages && len >= MEM_HUGEMIN)) {
+        /* into a (new) region */
+        base = mem_alloc(tag, len);
+        if (!base)
+            return NULL;
+        memcpy(base, ptr, (old < len) ? old : len);
+        mem_free(ptr);
+        return base;
+    }
+    if (!reserve(tag, (long)len - (long)old))
+        return NULL;
+    base = realloc(h, HDRSIZE + len);
+    if (!base) {
+        reserve(tag, (long)old - (long)len);
+        return NULL;
+    }
+    return init(base, HDRSIZE, tag, len);
+}
+
+char *mem_strdup(int tag, const char *str) {
+    char *dup;
+
+    dup = mem_alloc(tag, strlen(str) + 1);
+    if (dup)
+        strcpy(dup, str);
+    return dup;
+}
+
+void mem_free(void *ptr) {
+    struct memhdr *h;
+
+    if (!ptr)
+        return;
+    h = hdr(ptr);
+    if (h->kind != HEAP) {
+        region_free(h);
+        return;
+    }
+    reserve(h->tag, -(long)h->len);
+    free((char *)ptr - h->offset);
+}
+
+static void print_size(FILE *fp, long len) {
+    if (len >= 10 << 20)
+        fprintf(fp, "%liM", len >> 20);
+    else if (len >= 10 << 10)
+        fprintf(fp, "%lik", len >> 10);
+    else
+        fprintf(fp, "%li", len);
+}
+
+void mem_report(FILE *fp) {
+    unsigned long denied;
+    int j;
+
+    fprintf(fp, "memory:");
+    for (j = 0; j < MEM_TAGS; ++j) {
+        if (!atomic_load(&peak[j]))
+            continue;
+        fprintf(fp, " %s ", tagnames[j]);
+        print_size(fp, atomic_load(&cur[j]));
+        fprintf(fp, " (peak ");
+        print_size(fp, atomic_load(&peak[j]));
+        if (caps[j]) {
+            fprintf(fp, ", cap ");
+            print_size(fp, caps[j]);
+        }
+        denied = atomic_load(&ndenied[j]);
+        if (denied)
+            fprintf(fp, ", %lu denied", denied);
+        fputc(')', fp);
+    }
+    fputc('\n', fp);
+}
+
+void mem_report_hugepages(FILE *fp) {
+    FILE *smaps;
+    char line[128];
+    unsigned long kb = 0;
+    int j, k, n;
+
+    if (!mem_hugepages)
+        return;
+    fprintf(fp, "huge pages of %zuk:", hugesize >> 10);
+    for (j = 0; j < MEM_TAGS; ++j) {
+        for (k = HUGETLB; k < KINDS; ++k) {
+            n = atomic_load(&nregions[j][k]);
+            if (n)
+                fprintf(fp, " %s %i %s", tagnames[j], n, kindnames[k]);
+        }
+    }
+    /* what THP actually delivered */
+    smaps = fopen("/proc/self/smaps_rollup", "r");
+    if (smaps) {
+        while (fgets(line, sizeof (line), smaps))
+            sscanf(line, "AnonHugePages: %lu kB", &kb);
+        fclose(smaps);
+        fprintf(fp, ", %lukB transparent", kb);
+    }
+    fputc('\n', fp);
+}
@@ -0,0 +1,501 @@
+/*
+ * Copyright 2015 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <error.h>
+#include <pthread.h>
+#include <net/if.h>
+#include <linux/can/raw.h>
+
+#include "canqv.h"
+
+/*
+ * OBD-II mode 01 polling (ISO 15765-4, 11bit)
+ *
+ * Supported PIDs are discovered with the bitmask PIDs 00, 20, 40, ...
+ * The selected PIDs are then packed several to a request, so that every
+ * response still fits a single frame (we only listen, and never send
+ * flow control), and requests go out on the functional address with
+ * OBD_WINDOW of them in flight. Responses of all ECU's are matched on
+ * their PIDs, and arrive with their kernel timestamps via the isotp stage.
+ */
+int obd;
+
+#define OBD_REQ		0x7df
+#define OBD_RESP	0x7e8
+#define OBD_NECU	8
+#define OBD_WINDOW	2
+#define OBD_TIMEOUT	0.1 /* P2 is 50 msec */
+#define OBD_DISCOVER	0.2
+#define MAXREQ		64
+
+static const struct pidinfo {
+    const char *name;
+    const char *unit;
+    int size;
+    double scale, offset;
+} pidinfos[256] = {
+    [0x04] = { "EngineLoad", "%", 1, 100 / 255.0, 0, },
+    [0x05] = { "CoolantTemp", "C", 1, 1, -40, },
+    [0x06] = { "ShortFuelTrim1", "%", 1, 100 / 128.0, -100, },
+    [0x07] = { "LongFuelTrim1", "%", 1, 100 / 128.0, -100, },
+    [0x08] = { "ShortFuelTrim2", "%", 1, 100 / 128.0, -100, },
+    [0x09] = { "LongFuelTrim2", "%", 1, 100 / 128.0, -100, },
+    [0x0a] = { "FuelPressure", "kPa", 1, 3, 0, },
+    [0x0b] = { "IntakeMAP", "kPa", 1, 1, 0, },
+    [0x0c] = { "EngineRPM", "rpm", 2, 0.25, 0, },
+    [0x0d] = { "VehicleSpeed", "km/h", 1, 1, 0, },
+    [0x0e] = { "TimingAdvance", "deg", 1, 0.5, -64, },
+    [0x0f] = { "IntakeAirTemp", "C", 1, 1, -40, },
+    [0x10] = { "MAFRate", "g/s", 2, 0.01, 0, },
+    [0x11] = { "Throttle", "%", 1, 100 / 255.0, 0, },
+    [0x1f] = { "RunTime", "s", 2, 1, 0, },
+    [0x21] = { "DistanceMIL", "km", 2, 1, 0, },
+    [0x22] = { "FuelRailPressure", "kPa", 2, 0.079, 0, },
+    [0x23] = { "FuelRailGauge", "kPa", 2, 10, 0, },
+    [0x2c] = { "CommandedEGR", "%", 1, 100 / 255.0, 0, },
+    [0x2f] = { "FuelLevel", "%", 1, 100 / 255.0, 0, },
+    [0x31] = { "DistanceCleared", "km", 2, 1, 0, },
+    [0x33] = { "BaroPressure", "kPa", 1, 1, 0, },
+    [0x3c] = { "CatalystTemp11", "C", 2, 0.1, -40, },
+    [0x42] = { "ModuleVoltage", "V", 2, 0.001, 0, },
+    [0x43] = { "AbsoluteLoad", "%", 2, 100 / 255.0, 0, },
+    [0x44] = { "CommandedLambda", "", 2, 2 / 65536.0, 0, },
+    [0x45] = { "RelativeThrottle", "%", 1, 100 / 255.0, 0, },
+    [0x46] = { "AmbientAirTemp", "C", 1, 1, -40, },
+    [0x49] = { "AccelPedalD", "%", 1, 100 / 255.0, 0, },
+    [0x4c] = { "CommandedThrottle", "%", 1, 100 / 255.0, 0, },
+    [0x5a] = { "RelativePedal", "%", 1, 100 / 255.0, 0, },
+    [0x5b] = { "HybridBattery", "%", 1, 100 / 255.0, 0, },
+    [0x5c] = { "OilTemp", "C", 1, 1, -40, },
+    [0x5e] = { "FuelRate", "L/h", 2, 0.05, 0, },
+    [0x61] = { "DemandTorque", "%", 1, 1, -125, },
+    [0x62] = { "ActualTorque", "%", 1, 1, -125, },
+    [0x63] = { "ReferenceTorque", "Nm", 2, 1, 0, },
+};
+
+/* bitmask PIDs 00, 20, 40, ... answer 4 bytes */
+#define ISMASK(pid)	(!((pid) & 0x1f))
+
+static int sock = -1;
+static FILE *logfp;
+const char *obd_logname;
+
+static uint8_t wanted[256 / 8];
+static int nwanted;
+static uint8_t supported[OBD_NECU][256 / 8];
+static unsigned int ecumask;
+
+#define TESTBIT(map, pid)	((map)[(pid) / 8] & (1 << ((pid) % 8)))
+#define SETBIT(map, pid)	((map)[(pid) / 8] |= 1 << ((pid) % 8))
+
+/* the polling plan */
+static struct request {
+    uint8_t pid[6];
+    int npid;
+} reqs[MAXREQ];
+static int nreqs, nextreq;
+
+/* requests in flight */
+static struct inflight {
+    int used;
+    uint8_t pid[6];
+    int npid;
+    double t, timeout;
+    unsigned int expect, answered;
+} window[OBD_WINDOW];
+
+static struct pidstat {
+    unsigned long n;
+    double first, last;
+    double value;
+} stats[OBD_NECU][256];
+
+static unsigned long nsent, ntxerr, ncomplete, ntimeout, nneg;
+static double latsum, latmax;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static pthread_t thr;
+static int running, stopping;
+
+int obd_parse(const char *spec) {
+    char *endp;
+    int pid;
+
+    obd = 1;
+    while (spec && *spec) {
+        pid = strtoul(spec, &endp, 16);
+        if (endp == spec || pid > 0xff || ISMASK(pid) || !pidinfos[pid].name)
+            error(1, 0, "obd: unknown PID '%s'", spec);
+        if (!TESTBIT(wanted, pid))
+            ++nwanted;
+        SETBIT(wanted, pid);
+        spec = (*endp == ',') ? endp + 1 : endp;
+    }
+    return 0;
+}
+
+static void sample(int ecu, int pid, const uint8_t *dat, double t) {
+    const struct pidinfo *info = pidinfos + pid;
+    struct pidstat *st = &stats[ecu][pid];
+    unsigned long raw;
+    int j;
+
+    for (raw = 0, j = 0; j < info->size; ++j)
+        raw = raw << 8 | dat[j];
+    st->value = raw * info->scale + info->offset;
+    if (!st->n++)
+        st->first = t;
+    st->last = t;
+    if (logfp)
+        fprintf(logfp, "%.6lf %03x %02x %s %g %s\n", t, OBD_RESP + ecu, pid,
+                info->name, st->value, info->unit);
+}
+
+static void retire(struct inflight *w, double t) {
+    double lat = t - w->t;
+
+    w->used = 0;
+    ++ncomplete;
+    latsum += lat;
+    if (lat > latmax)
+        latmax = lat;
+    pthread_cond_signal(&cond);
+}
+
+/* an ECU answered pid, credit the oldest request that asked for it */
+static void match(int ecu, int pid, double t) {
+    struct inflight *w, *best = NULL;
+    int j;
+
+    for (w = window; w < window + OBD_WINDOW; ++w) {
+        if (!w->used || (best && best->t <= w->t))
+            continue;
+        for (j = 0; j < w->npid; ++j) {
+            if (w->pid[j] == pid)
+                best = w;
+        }
+    }
+    if (!best)
+        return;
+    best->answered |= 1 << ecu;
+    if (best->expect && (best->answered & best->expect) == best->expect)
+        retire(best, t);
+}
+
+static void obd_pdu(canid_t can_id, double t, const uint8_t *dat, int len) {
+    int ecu, j, k, pid, size;
+
+    if (can_id < OBD_RESP || can_id >= OBD_RESP + OBD_NECU || !len)
+        return;
+    ecu = can_id - OBD_RESP;
+    pthread_mutex_lock(&lock);
+    if (dat[0] == 0x7f && len >= 2 && dat[1] == 0x01)
+        ++nneg;
+    if (dat[0] != 0x41)
+        goto done;
+    for (j = 1; j < len; j += size) {
+        pid = dat[j++];
+        size = ISMASK(pid) ? 4 : pidinfos[pid].size;
+        if (!size || j + size > len)
+            /* unknown size, stop parsing */
+            break;
+        if (ISMASK(pid)) {
+            ecumask |= 1 << ecu;
+            for (k = 0; k < 32 && pid + 1 + k <= 0xff; ++k) {
+                /* the last bit of mask e0 points beyond PID ff */
+                if (dat[j + k / 8] & (0x80 >> (k % 8)))
+                    SETBIT(supported[ecu], pid + 1 + k);
+            }
+        } else
+            sample(ecu, pid, dat + j, t);
+        match(ecu, pid, t);
+    }
+done:
+    pthread_mutex_unlock(&lock);
+}
+
+static int anysupported(int pid) {
+    int ecu;
+
+    for (ecu = 0; ecu < OBD_NECU; ++ecu) {
+        if (TESTBIT(supported[ecu], pid))
+            return 1;
+    }
+    return 0;
+}
+
+/* called with lock held, returns 0 when the window is full */
+static int issue(const uint8_t *pid, int npid, double timeout) {
+    struct inflight *w;
+    struct can_frame cf = { .can_id = OBD_REQ, .can_dlc = 8, };
+    int ecu, j;
+
+    for (w = window; w < window + OBD_WINDOW; ++w) {
+        if (!w->used)
+            break;
+    }
+    if (w >= window + OBD_WINDOW)
+        return 0;
+    memset(w, 0, sizeof (*w));
+    memcpy(w->pid, pid, npid);
+    w->npid = npid;
+    w->timeout = timeout;
+    for (ecu = 0; ecu < OBD_NECU; ++ecu) {
+        for (j = 0; j < npid; ++j) {
+            if (!ISMASK(pid[j]) && TESTBIT(supported[ecu], pid[j]))
+                w->expect |= 1 << ecu;
+        }
+    }
+    cf.data[0] = 1 + npid;
+    cf.data[1] = 0x01;
+    memcpy(cf.data + 2, pid, npid);
+    w->used = 1;
+    w->t = now();
+    if (write(sock, &cf, sizeof (cf)) < 0) {
+        ++ntxerr;
+        /* let it time out, and try again */
+    }
+    ++nsent;
+    return 1;
+}
+
+/* called with lock held, returns the earliest deadline */
+static double expire(double t) {
+    struct inflight *w;
+    double deadline = t + OBD_TIMEOUT;
+
+    for (w = window; w < window + OBD_WINDOW; ++w) {
+        if (!w->used)
+            continue;
+        if (t - w->t >= w->timeout) {
+            /* without expectations, this is a normal end */
+            if (w->expect)
+                ++ntimeout;
+            w->used = 0;
+        } else if (w->t + w->timeout < deadline)
+            deadline = w->t + w->timeout;
+    }
+    return deadline;
+}
+
+static void wait_until(double deadline) {
+    struct timespec ts = {
+        .tv_sec = deadline,
+        .tv_nsec = (deadline - (long) deadline) * 1e9,
+    };
+
+    pthread_cond_timedwait(&cond, &lock, &ts);
+}
+
+static int idle(void) {
+    int j;
+
+    for (j = 0; j < OBD_WINDOW; ++j) {
+        if (window[j].used)
+            return 0;
+    }
+    return 1;
+}
+
+/* pack the PIDs to poll, so each response fits in a single frame */
+static void plan(void) {
+    struct request *r = NULL;
+    int pid, size, used = 0;
+
+    for (pid = 1; pid < 256; ++pid) {
+        if (ISMASK(pid) || !pidinfos[pid].name || !anysupported(pid))
+            continue;
+        if (nwanted && !TESTBIT(wanted, pid))
+            continue;
+        size = 1 + pidinfos[pid].size;
+        if (!r || r->npid >= 6 || used + size > 6) {
+            if (nreqs >= MAXREQ)
+                break;
+            r = reqs + nreqs++;
+            used = 0;
+        }
+        r->pid[r->npid++] = pid;
+        used += size;
+    }
+}
+
+static void *obd_main(void *vp) {
+    uint8_t pid;
+    double t;
+
+    pthread_mutex_lock(&lock);
+    /* discover */
+    for (pid = 0; pid <= 0xc0 && !stopping; pid += 0x20) {
+        if (pid && !anysupported(pid))
+            break;
+        issue(&pid, 1, OBD_DISCOVER);
+        while (!stopping && !idle())
+            wait_until(expire(now()));
+    }
+    plan();
+    if (!nreqs && !stopping)
+        error(0, 0, "obd: no ECU answered the requested PIDs");
+
+    /* poll */
+    while (!stopping && nreqs) {
+        t = now();
+        expire(t);
+        while (issue(reqs[nextreq].pid, reqs[nextreq].npid, OBD_TIMEOUT))
+            nextreq = (nextreq + 1) % nreqs;
+        wait_until(expire(t));
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+/* without device, only listen (replay) */
+void obd_setup(const char *device) {
+    struct sockaddr_can addr = { .can_family = AF_CAN, };
+    int ecu, ret;
+
+    if (!obd)
+        return;
+    if (obd_logname) {
+        logfp = fopen(obd_logname, "a");
+        if (!logfp)
+            error(1, errno, "fopen %s", obd_logname);
+    }
+    for (ecu = 0; ecu < OBD_NECU; ++ecu) {
+        if (isotp_claim(OBD_RESP + ecu, obd_pdu) < 0)
+            error(1, 0, "too many ISO-TP channels");
+    }
+    if (!device)
+        return;
+    addr.can_ifindex = if_nametoindex(device);
+    if (!addr.can_ifindex)
+        error(1, errno, "device '%s' not found", device);
+    /* transmit only, responses come via the capture socket */
+    sock = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+    if (sock < 0)
+        error(1, errno, "socket(can, raw)");
+    if (setsockopt(sock, SOL_CAN_RAW, CAN_RAW_FILTER, NULL, 0) < 0)
+        error(1, errno, "setsockopt filter");
+    if (bind(sock, (struct sockaddr *)&addr, sizeof (addr)) < 0)
+        error(1, errno, "bind %s", device);
+    ret = pthread_create(&thr, NULL, obd_main, NULL);
+    if (ret)
+        error(1, ret, "pthread_create");
+    running = 1;
+}
+
+void obd_stop(void) {
+    if (running) {
+        pthread_mutex_lock(&lock);
+        stopping = 1;
+        pthread_cond_signal(&cond);
+        pthread_mutex_unlock(&lock);
+        pthread_join(thr, NULL);
+        running = 0;
+        close(sock);
+    }
+    if (logfp)
+        fclose(logfp);
+    logfp = NULL;
+}
+
+static double rate(const struct pidstat *st) {
+    if (st->n < 2 || st->last <= st->first)
+        return NAN;
+    return (st->n - 1) / (st->last - st->first);
+}
+
+void obd_render(FILE *fp) {
+    const struct pidstat *st;
+    int ecu, pid;
+
+    if (!obd)
+        return;
+    pthread_mutex_lock(&lock);
+    for (ecu = 0; ecu < OBD_NECU; ++ecu) {
+        for (pid = 0; pid < 256; ++pid) {
+            st = &stats[ecu][pid];
+            if (!st->n)
+                continue;
+            fprintf(fp, "obd %03x %02x %-18s %10.2lf %-5s %5.1lf/s\n",
+                    OBD_RESP + ecu, pid, pidinfos[pid].name, st->value,
+                    pidinfos[pid].unit, rate(st));
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/* supported PIDs & last values per ECU, for regression tests */
+void obd_dump(FILE *fp) {
+    int ecu, pid;
+
+    if (!obd)
+        return;
+    pthread_mutex_lock(&lock);
+    for (ecu = 0; ecu < OBD_NECU; ++ecu) {
+        if (!(ecumask & (1 << ecu)))
+            continue;
+        fprintf(fp, "obd %03x supports", OBD_RESP + ecu);
+        for (pid = 0; pid < 256; ++pid) {
+            if (TESTBIT(supported[ecu], pid))
+                fprintf(fp, " %02x", pid);
+        }
+        fputc('\n', fp);
+    }
+    pthread_mutex_unlock(&lock);
+    obd_render(fp);
+}
+
+void obd_report(FILE *fp) {
+    struct pidstat sum;
+    const struct pidstat *st;
+    int ecu, pid;
+
+    if (!obd)
+        return;
+    pthread_mutex_lock(&lock);
+    fprintf(fp, "obd: ecus %02x, %i requests in plan, %lu sent, %lu tx errors, "
+            "%lu complete, %lu timeouts, %lu negative, "
+            "latency avg %.1lfms max %.1lfms\n",
+            ecumask, nreqs, nsent, ntxerr, ncomplete, ntimeout, nneg,
+            ncomplete ? latsum / ncomplete * 1e3 : 0.0, latmax * 1e3);
+    for (pid = 0; pid < 256; ++pid) {
+        memset(&sum, 0, sizeof (sum));
+        for (ecu = 0; ecu < OBD_NECU; ++ecu) {
+            st = &stats[ecu][pid];
+            if (!st->n)
+                continue;
+            if (!sum.n || st->first < sum.first)
+                sum.first = st->first;
+            if (st->last > sum.last)
+                sum.last = st->last;
+            sum.n += st->n;
+        }
+        if (!sum.n)
+            continue;
+        fprintf(fp, "obd %02x %s: %lu samples, %.1lf samples/s\n",
+                pid, pidinfos[pid].name, sum.n, rate(&sum));
+    }
+    pthread_mutex_unlock(&lock);
+}
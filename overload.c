@@ -0,0 +1,157 @@
+/*
+ * Copyright 2015 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdatomic.h>
+
+#include <pthread.h>
+
+#include "canqv.h"
+
+/*
+ * overload controller
+ *
+ * Every capture batch reports its size, new socket drops, latency
+ * (kernel timestamp until processing) and the time it took.
+ * Each REFRESH window is judged: socket drops, a latency beyond
+ * OVL_LATENCY, capture busy beyond OVL_BUSY of the time, or a decode
+ * lane filled beyond OVL_FILL is pressure.
+ * Pressure raises the level by 1, the level drops by 1 after OVL_CALM
+ * seconds without pressure. Each level adds to the previous one:
+ *	1	refresh the screen 4 times slower
+ *	2	pause the decode stages & the gateway matcher
+ *	3	write, export & stream only frames whose payload changed
+ *	4	update the period with 1 in OVL_SAMPLING frames
+ * Every frame is counted, keeps its ID alive and is judged on its
+ * payload, on any level.
+ */
+#define OVL_LATENCY	0.05
+#define OVL_BUSY	0.8
+#define OVL_FILL	0.5
+#define OVL_CALM	2.0
+
+int ovl;
+atomic_int ovl_level;
+
+static const char *const levelnames[OVL_LEVELS] = {
+    "normal", "slow refresh", "no decoders", "changes only", "sampling",
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int ncapture = 1;
+/* current window */
+static double winstart, winbusy, winlat;
+static unsigned long windrops;
+static double lastpressure, levelsince, t0;
+static double timein[OVL_LEVELS];
+static unsigned long nframes, ndrops, nraised;
+
+void ovl_setup(int n) {
+    if (!ovl)
+        return;
+    ncapture = (n > 0) ? n : 1;
+    t0 = winstart = lastpressure = levelsince = now();
+}
+
+static void set_level(int level, double t) {
+    int prev = atomic_load(&ovl_level);
+
+    timein[prev] += t - levelsince;
+    levelsince = t;
+    atomic_store(&ovl_level, level);
+    TRACE_COUNTER("overload level", level);
+    if (level > prev)
+        ++nraised;
+}
+
+/* judge the window */
+static void judge(double t) {
+    int level = atomic_load(&ovl_level);
+    int pressure;
+
+    pressure = windrops || winlat > OVL_LATENCY ||
+        winbusy > OVL_BUSY * ncapture * (t - winstart) ||
+        pool_fill() > OVL_FILL;
+    if (pressure) {
+        lastpressure = t;
+        if (level < OVL_LEVELS - 1)
+            set_level(level + 1, t);
+    } else if (level && t - lastpressure > OVL_CALM) {
+        /* start calm again at the next level */
+        lastpressure = t;
+        set_level(level - 1, t);
+    }
+    winstart = t;
+    winbusy = winlat = 0;
+    windrops = 0;
+}
+
+void ovl_account(int n, unsigned int drops, double latency, double busy) {
+    double t;
+
+    if (!ovl)
+        return;
+    t = now();
+    pthread_mutex_lock(&lock);
+    nframes += n;
+    ndrops += drops;
+    windrops += drops;
+    winbusy += busy;
+    if (latency > winlat)
+        winlat = latency;
+    if (t - winstart >= REFRESH)
+        judge(t);
+    pthread_mutex_unlock(&lock);
+}
+
+double ovl_refresh(void) {
+    return (atomic_load(&ovl_level) >= OVL_SLOW) ? 4 * REFRESH : REFRESH;
+}
+
+static void print_levels(FILE *fp) {
+    double t = now();
+    int level = atomic_load(&ovl_level);
+    int j;
+
+    for (j = 0; j < OVL_LEVELS; ++j)
+        fprintf(fp, " %.1lfs", timein[j] + ((j == level) ? t - levelsince : 0));
+    fputc('\n', fp);
+}
+
+void ovl_render(FILE *fp) {
+    int level;
+
+    if (!ovl)
+        return;
+    level = atomic_load(&ovl_level);
+    if (!level)
+        return;
+    pthread_mutex_lock(&lock);
+    fprintf(fp, "OVERLOAD level %i: %s, time per level", level,
+            levelnames[level]);
+    print_levels(fp);
+    pthread_mutex_unlock(&lock);
+}
+
+void ovl_report(FILE *fp) {
+    if (!ovl)
+        return;
+    pthread_mutex_lock(&lock);
+    fprintf(fp, "overload: level %i, raised %lu times, %lu frames, "
+            "%lu socket drops, time per level",
+            atomic_load(&ovl_level), nraised, nframes, ndrops);
+    print_levels(fp);
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,302 @@
+/*
+ * Copyright 2015 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <dlfcn.h>
+#include <error.h>
+#include <pthread.h>
+
+#include "canqv.h"
+
+/* frames per plugin before frames() is called */
+#define BATCH 64
+#define MAXPLUGINS 255
+
+struct plugin {
+    const struct canqv_plugin *def;
+    void *dl;
+    void *priv;
+    char *file;
+    /* capture workers and the renderer may run in different threads */
+    pthread_mutex_t lock;
+    /* pending batch */
+    struct canqv_frame batch[BATCH];
+    int nbatch;
+    /* statistics */
+    unsigned long nframes, ncalls;
+    double cputime;
+};
+
+static struct plugin *plugins[MAXPLUGINS];
+static int nplugins;
+
+/*
+ * ID -> plugin dispatch tables, rebuilt on each load.
+ * 11bit ID's map directly, 29bit ID's are kept as sorted,
+ * non-overlapping ranges.
+ */
+static unsigned char sfftab[CAN_SFF_MASK + 1];
+
+struct effrange {
+    canid_t lo, hi;
+    int plugin;
+};
+static struct effrange *efftab;
+static int nefftab;
+
+static double cputime(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmpcanid(const void *va, const void *vb) {
+    const canid_t *a = va, *b = vb;
+
+    return (*a > *b) - (*a < *b);
+}
+
+static int cmpeffrange(const void *vkey, const void *vrange) {
+    canid_t key = *(const canid_t *)vkey;
+    const struct effrange *r = vrange;
+
+    if (key < r->lo)
+        return -1;
+    return key > r->hi;
+}
+
+/* first loaded plugin that claims id wins */
+static int owner(int eff, canid_t id) {
+    int j, k;
+    const struct canqv_range *r;
+
+    for (j = 0; j < nplugins; ++j) {
+        for (k = 0; k < plugins[j]->def->nranges; ++k) {
+            r = &plugins[j]->def->ranges[k];
+            if (!(r->lo & CAN_EFF_FLAG) != !eff)
+                continue;
+            if (id >= (r->lo & CAN_EFF_MASK) && id <= (r->hi & CAN_EFF_MASK))
+                return j + 1;
+        }
+    }
+    return 0;
+}
+
+static void build_tables(void) {
+    int j, k, n, nbounds;
+    canid_t id, *bounds;
+    const struct canqv_range *r;
+
+    for (id = 0; id <= CAN_SFF_MASK; ++id)
+        sfftab[id] = owner(0, id);
+
+    /* cut the 29bit ID space at every range boundary */
+    for (n = j = 0; j < nplugins; ++j)
+        n += plugins[j]->def->nranges;
+    bounds = mem_alloc(MEM_DECODE, sizeof (*bounds) * (2 * n + 1));
+    if (!bounds)
+        error(1, errno, "malloc");
+    nbounds = 0;
+    for (j = 0; j < nplugins; ++j) {
+        for (k = 0; k < plugins[j]->def->nranges; ++k) {
+            r = &plugins[j]->def->ranges[k];
+            if (!(r->lo & CAN_EFF_FLAG))
+                continue;
+            bounds[nbounds++] = r->lo & CAN_EFF_MASK;
+            bounds[nbounds++] = (r->hi & CAN_EFF_MASK) + 1;
+        }
+    }
+    qsort(bounds, nbounds, sizeof (*bounds), cmpcanid);
+
+    mem_free(efftab);
+    efftab = mem_alloc(MEM_DECODE, sizeof (*efftab) * (nbounds + 1));
+    if (!efftab)
+        error(1, errno, "malloc");
+    nefftab = 0;
+    for (j = 0; j + 1 < nbounds; ++j) {
+        if (bounds[j] == bounds[j + 1])
+            continue;
+        k = owner(1, bounds[j]);
+        if (!k)
+            continue;
+        if (nefftab && efftab[nefftab - 1].plugin == k &&
+                efftab[nefftab - 1].hi + 1 == bounds[j]) {
+            /* merge adjacent */
+            efftab[nefftab - 1].hi = bounds[j + 1] - 1;
+            continue;
+        }
+        efftab[nefftab].lo = bounds[j];
+        efftab[nefftab].hi = bounds[j + 1] - 1;
+        efftab[nefftab].plugin = k;
+        ++nefftab;
+    }
+    mem_free(bounds);
+}
+
+/* decode stage, see pool.c */
+static void plugin_stage(const struct canqv_frame *frames, int nframes) {
+    int j, plugin;
+
+    for (j = 0; j < nframes; ++j) {
+        plugin = plugin_lookup(frames[j].cf.can_id);
+        if (plugin)
+            plugin_queue(plugin, frames[j].t, &frames[j].cf);
+    }
+}
+
+int plugin_load(const char *spec) {
+    struct plugin *p;
+    char *arg;
+    const struct canqv_plugin *def;
+
+    if (nplugins >= MAXPLUGINS)
+        error(1, 0, "too many plugins");
+    p = mem_alloc(MEM_DECODE, sizeof (*p));
+    if (!p)
+        error(1, errno, "calloc");
+    pthread_mutex_init(&p->lock, NULL);
+
+    p->file = mem_strdup(MEM_DECODE, spec);
+    if (!p->file)
+        error(1, errno, "strdup");
+    arg = strchr(p->file, ':');
+    if (arg)
+        *arg++ = 0;
+
+    p->dl = dlopen(p->file, RTLD_NOW | RTLD_LOCAL);
+    if (!p->dl)
+        error(1, 0, "plugin %s: %s", p->file, dlerror());
+    def = dlsym(p->dl, CANQV_PLUGIN_SYMBOL);
+    if (!def)
+        error(1, 0, "plugin %s: %s", p->file, dlerror());
+    if (def->abi != CANQV_PLUGIN_ABI)
+        error(1, 0, "plugin %s: ABI %i, expected %i", p->file, def->abi,
+                CANQV_PLUGIN_ABI);
+    p->def = def;
+    if (def->init) {
+        p->priv = def->init(arg ?: "");
+        if (!p->priv)
+            error(1, 0, "plugin %s: init failed", p->file);
+    }
+    if (!nplugins)
+        stage_register("plugins", plugin_stage);
+    plugins[nplugins++] = p;
+    build_tables();
+    return nplugins;
+}
+
+int plugin_lookup(canid_t can_id) {
+    canid_t id;
+    struct effrange *r;
+
+    if (!nplugins)
+        return 0;
+    if (!(can_id & CAN_EFF_FLAG))
+        return sfftab[can_id & CAN_SFF_MASK];
+    id = can_id & CAN_EFF_MASK;
+    r = bsearch(&id, efftab, nefftab, sizeof (*efftab), cmpeffrange);
+    return r ? r->plugin : 0;
+}
+
+static void flush_one(struct plugin *p) {
+    double t0;
+
+    if (!p->nbatch)
+        return;
+    if (p->def->frames) {
+        t0 = cputime();
+        p->def->frames(p->priv, p->batch, p->nbatch);
+        p->cputime += cputime() - t0;
+        ++p->ncalls;
+    }
+    p->nframes += p->nbatch;
+    p->nbatch = 0;
+}
+
+void plugin_queue(int plugin, double t, const struct can_frame *cf) {
+    struct plugin *p = plugins[plugin - 1];
+
+    pthread_mutex_lock(&p->lock);
+    p->batch[p->nbatch].t = t;
+    p->batch[p->nbatch].cf = *cf;
+    if (++p->nbatch >= BATCH)
+        flush_one(p);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void plugin_flush(void) {
+    int j;
+
+    for (j = 0; j < nplugins; ++j) {
+        pthread_mutex_lock(&plugins[j]->lock);
+        flush_one(plugins[j]);
+        pthread_mutex_unlock(&plugins[j]->lock);
+    }
+}
+
+int plugin_decode(int plugin, canid_t can_id, char *buf, size_t len) {
+    struct plugin *p = plugins[plugin - 1];
+    double t0;
+    int ret;
+
+    if (!p->def->decode || !len)
+        return 0;
+    pthread_mutex_lock(&p->lock);
+    t0 = cputime();
+    ret = p->def->decode(p->priv, can_id, buf, len);
+    p->cputime += cputime() - t0;
+    pthread_mutex_unlock(&p->lock);
+    if (ret < 0)
+        ret = 0;
+    if (ret >= len)
+        ret = len - 1;
+    buf[ret] = 0;
+    return ret;
+}
+
+void plugin_report(FILE *fp) {
+    int j;
+
+    for (j = 0; j < nplugins; ++j)
+        fprintf(fp, "plugin %s: %lu frames, %lu calls, cpu %.3lfs\n",
+                plugins[j]->def->name ?: plugins[j]->file,
+                plugins[j]->nframes, plugins[j]->ncalls, plugins[j]->cputime);
+}
+
+void plugin_unload(void) {
+    int j;
+
+    plugin_flush();
+    for (j = 0; j < nplugins; ++j) {
+        if (plugins[j]->def->fini)
+            plugins[j]->def->fini(plugins[j]->priv);
+        dlclose(plugins[j]->dl);
+        pthread_mutex_destroy(&plugins[j]->lock);
+        mem_free(plugins[j]->file);
+        mem_free(plugins[j]);
+        plugins[j] = NULL;
+    }
+    nplugins = 0;
+    mem_free(efftab);
+    efftab = NULL;
+    nefftab = 0;
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright 2015 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * sample canqv decoder plugin
+ *
+ * decodes the diagnostic command messages that VIDA sends on 000FFFFE
+ * (see the legend on the canqv screen), and counts them.
+ *
+ *	$ canqv -p plugins/sample.so can0
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "canqv-plugin.h"
+
+#define DIAG_ID	(CAN_EFF_FLAG | 0x000ffffe)
+
+struct priv {
+    struct can_frame last;
+    int valid;
+    unsigned long count;
+};
+
+static void *sample_init(const char *arg) {
+    return calloc(1, sizeof (struct priv));
+}
+
+static void sample_fini(void *vpriv) {
+    free(vpriv);
+}
+
+static void sample_frames(void *vpriv, const struct canqv_frame *frames,
+        int nframes) {
+    struct priv *priv = vpriv;
+    int j;
+
+    for (j = 0; j < nframes; ++j) {
+        if (frames[j].cf.can_dlc < 2 || (frames[j].cf.data[0] & 0xf0) != 0xc0)
+            /* not a command */
+            continue;
+        priv->last = frames[j].cf;
+        priv->valid = 1;
+        ++priv->count;
+    }
+}
+
+static int sample_decode(void *vpriv, canid_t can_id, char *buf, size_t len) {
+    struct priv *priv = vpriv;
+    const __u8 *dat = priv->last.data;
+
+    if (!priv->valid)
+        return 0;
+    if (priv->last.can_dlc >= 4 && dat[2] == 0xb9)
+        return snprintf(buf, len, "len=%u module=%02x read=%02x n=%lu",
+                dat[0] & 0x07, dat[1], dat[3], priv->count);
+    return snprintf(buf, len, "len=%u module=%02x cmd=%02x n=%lu",
+            dat[0] & 0x07, dat[1], dat[2], priv->count);
+}
+
+static const struct canqv_range sample_ranges[] = {
+    { DIAG_ID, DIAG_ID, },
+};
+
+const struct canqv_plugin canqv_plugin = {
+    .abi = CANQV_PLUGIN_ABI,
+    .name = "sample",
+    .ranges = sample_ranges,
+    .nranges = sizeof (sample_ranges) / sizeof (sample_ranges[0]),
+    .init = sample_init,
+    .fini = sample_fini,
+    .frames = sample_frames,
+    .decode = sample_decode,
+};
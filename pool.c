@@ -0,0 +1,332 @@
+/*
+ * Copyright 2015 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include <error.h>
+#include <pthread.h>
+
+#include "canqv.h"
+
+/*
+ * decode pool
+ *
+ * Decode stages run on every frame, in registration order.
+ * Without pool threads, they run inline in the capture thread.
+ * With pool threads, the capture thread only hashes the CAN ID
+ * onto a lane, and appends the frame to that lane's ring.
+ * A lane with pending frames is scheduled on its home thread's deque,
+ * idle threads steal lanes from the other deques.
+ * A lane is never run by 2 threads at once, so frames with the same
+ * CAN ID pass each stage in receive order.
+ */
+#define NLANES	64
+#define LANESIZE 1024 /* frames, power of 2 */
+#define BATCH	32
+#define MAXSTAGES 16
+
+struct stage {
+    const char *name;
+    void (*run)(const struct canqv_frame *frames, int nframes);
+    atomic_ulong nframes;
+    /* latency from capture until this stage completed, in usec */
+    atomic_ulong latsum, latmax;
+    /* time spent in this stage, in nsec */
+    atomic_ulong busy;
+};
+
+static struct stage stages[MAXSTAGES];
+int nstages;
+
+struct lane {
+    pthread_mutex_t lock;
+    struct canqv_frame ring[LANESIZE];
+    unsigned int head, tail;
+    int scheduled;
+};
+
+struct deque {
+    pthread_mutex_t lock;
+    /* each lane is scheduled at most once, so NLANES is enough */
+    int lanes[NLANES];
+    /* free running, NLANES divides 2^32, so the index survives wrapping */
+    unsigned int top, bottom;
+};
+
+struct thread {
+    pthread_t thr;
+    int idx;
+    struct deque dq;
+    atomic_ulong nsteals;
+};
+
+static struct lane *lanes;
+static struct thread *threads;
+static int nthreads;
+
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static atomic_int pending;
+static int stopping;
+
+static atomic_ulong nsubmitted, ndropped;
+
+/* frames with equal keys go to the same lane, default is the CAN ID */
+canid_t (*pool_lanekey)(canid_t can_id);
+
+int stage_register(const char *name,
+        void (*run)(const struct canqv_frame *frames, int nframes)) {
+    struct stage *s;
+
+    if (nstages >= MAXSTAGES)
+        error(1, 0, "too many decode stages");
+    s = stages + nstages;
+    s->name = name;
+    s->run = run;
+    atomic_init(&s->nframes, 0);
+    atomic_init(&s->latsum, 0);
+    atomic_init(&s->latmax, 0);
+    atomic_init(&s->busy, 0);
+    return nstages++;
+}
+
+static unsigned long nsecs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void run_stages(const struct canqv_frame *frames, int n) {
+    struct stage *s;
+    unsigned long lat, max, t0, t1;
+    double age;
+
+    t0 = nsecs();
+    for (s = stages; s < stages + nstages; ++s) {
+        TRACE_BEGIN(s->name);
+        s->run(frames, n);
+        TRACE_END(s->name);
+        t1 = nsecs();
+        atomic_fetch_add_explicit(&s->busy, t1 - t0, memory_order_relaxed);
+        t0 = t1;
+        /* the oldest frame has the worst latency */
+        age = now() - frames[0].t;
+        /* replayed traces may run ahead of the clock */
+        lat = (age > 0) ? age * 1e6 : 0;
+        atomic_fetch_add_explicit(&s->nframes, n, memory_order_relaxed);
+        atomic_fetch_add_explicit(&s->latsum, lat * n, memory_order_relaxed);
+        max = atomic_load_explicit(&s->latmax, memory_order_relaxed);
+        while (lat > max &&
+                !atomic_compare_exchange_weak(&s->latmax, &max, lat))
+            ;
+    }
+}
+
+/* deque: the owner pushes & pops at the bottom, thieves take the top */
+static void dq_push(struct deque *dq, int lane) {
+    pthread_mutex_lock(&dq->lock);
+    dq->lanes[dq->bottom++ % NLANES] = lane;
+    pthread_mutex_unlock(&dq->lock);
+}
+
+static int dq_pop(struct deque *dq) {
+    int lane = -1;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom != dq->top)
+        lane = dq->lanes[--dq->bottom % NLANES];
+    pthread_mutex_unlock(&dq->lock);
+    return lane;
+}
+
+static int dq_steal(struct deque *dq) {
+    int lane = -1;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom != dq->top)
+        lane = dq->lanes[dq->top++ % NLANES];
+    pthread_mutex_unlock(&dq->lock);
+    return lane;
+}
+
+static void run_lane(int idx) {
+    struct lane *l = lanes + idx;
+    struct canqv_frame batch[BATCH];
+    int n;
+
+    for (;;) {
+        pthread_mutex_lock(&l->lock);
+        for (n = 0; n < BATCH && l->tail != l->head; ++n, ++l->tail)
+            batch[n] = l->ring[l->tail % LANESIZE];
+        if (!n)
+            l->scheduled = 0;
+        pthread_mutex_unlock(&l->lock);
+        if (!n)
+            return;
+        run_stages(batch, n);
+    }
+}
+
+static void *pool_main(void *vp) {
+    struct thread *self = vp;
+    int j, lane;
+
+    trace_thread("decode");
+    for (;;) {
+        lane = dq_pop(&self->dq);
+        for (j = 1; lane < 0 && j < nthreads; ++j) {
+            lane = dq_steal(&threads[(self->idx + j) % nthreads].dq);
+            if (lane >= 0)
+                atomic_fetch_add_explicit(&self->nsteals, 1,
+                        memory_order_relaxed);
+        }
+        if (lane >= 0) {
+            atomic_fetch_sub(&pending, 1);
+            run_lane(lane);
+            continue;
+        }
+        pthread_mutex_lock(&idle_lock);
+        while (!atomic_load(&pending) && !stopping)
+            pthread_cond_wait(&idle_cond, &idle_lock);
+        if (stopping && !atomic_load(&pending)) {
+            pthread_mutex_unlock(&idle_lock);
+            break;
+        }
+        pthread_mutex_unlock(&idle_lock);
+    }
+    return NULL;
+}
+
+void pool_start(int n) {
+    int j, ret;
+
+    if (n <= 0 || !nstages)
+        return;
+    lanes = mem_alloc(MEM_DECODE, NLANES * sizeof (*lanes));
+    threads = mem_alloc(MEM_DECODE, n * sizeof (*threads));
+    if (!lanes || !threads)
+        error(1, errno, "calloc");
+    rt_prefault(lanes, NLANES * sizeof (*lanes));
+    for (j = 0; j < NLANES; ++j)
+        pthread_mutex_init(&lanes[j].lock, NULL);
+    for (j = 0; j < n; ++j) {
+        threads[j].idx = j;
+        pthread_mutex_init(&threads[j].dq.lock, NULL);
+    }
+    nthreads = n;
+    for (j = 0; j < n; ++j) {
+        ret = pthread_create(&threads[j].thr, NULL, pool_main, threads + j);
+        if (ret)
+            error(1, ret, "pthread_create");
+    }
+}
+
+void pool_submit(double t, const struct can_frame *cf) {
+    struct canqv_frame f = { .t = t, .cf = *cf, };
+    struct lane *l;
+    canid_t key;
+    int idx, schedule;
+
+    if (!nstages)
+        return;
+    if (!nthreads) {
+        atomic_fetch_add_explicit(&nsubmitted, 1, memory_order_relaxed);
+        run_stages(&f, 1);
+        return;
+    }
+
+    key = pool_lanekey ? pool_lanekey(cf->can_id) : cf->can_id;
+    idx = (key ^ (key >> 7) ^ (key >> 17)) % NLANES;
+    l = lanes + idx;
+    schedule = 0;
+    pthread_mutex_lock(&l->lock);
+    if (l->head - l->tail >= LANESIZE) {
+        /* never stall capture, drop instead */
+        atomic_fetch_add_explicit(&ndropped, 1, memory_order_relaxed);
+    } else {
+        l->ring[l->head++ % LANESIZE] = f;
+        atomic_fetch_add_explicit(&nsubmitted, 1, memory_order_relaxed);
+        if (!l->scheduled)
+            schedule = l->scheduled = 1;
+    }
+    pthread_mutex_unlock(&l->lock);
+    if (!schedule)
+        return;
+
+    atomic_fetch_add(&pending, 1);
+    dq_push(&threads[idx % nthreads].dq, idx);
+    pthread_mutex_lock(&idle_lock);
+    pthread_cond_signal(&idle_cond);
+    pthread_mutex_unlock(&idle_lock);
+}
+
+double pool_fill(void) {
+    unsigned int fill, max = 0;
+    int j;
+
+    for (j = 0; j < NLANES && nthreads; ++j) {
+        pthread_mutex_lock(&lanes[j].lock);
+        fill = lanes[j].head - lanes[j].tail;
+        pthread_mutex_unlock(&lanes[j].lock);
+        if (fill > max)
+            max = fill;
+    }
+    return (double)max / LANESIZE;
+}
+
+void pool_stop(void) {
+    int j;
+
+    if (!nthreads)
+        return;
+    pthread_mutex_lock(&idle_lock);
+    stopping = 1;
+    pthread_cond_broadcast(&idle_cond);
+    pthread_mutex_unlock(&idle_lock);
+    for (j = 0; j < nthreads; ++j)
+        pthread_join(threads[j].thr, NULL);
+}
+
+void pool_report(FILE *fp) {
+    struct stage *s;
+    unsigned long submitted, done;
+    int j;
+
+    if (!nstages)
+        return;
+    submitted = atomic_load(&nsubmitted);
+    for (s = stages; s < stages + nstages; ++s) {
+        done = atomic_load(&s->nframes);
+        fprintf(fp, "stage %s: %lu frames, queue %lu, busy %.3lfs, "
+                "latency avg %.3lfms max %.3lfms\n",
+                s->name, done, submitted - done,
+                atomic_load(&s->busy) / 1e9,
+                done ? atomic_load(&s->latsum) / 1e3 / done : 0.0,
+                atomic_load(&s->latmax) / 1e3);
+    }
+    if (!nthreads)
+        return;
+    fprintf(fp, "pool: %i threads, %lu dropped, steals", nthreads,
+            atomic_load(&ndropped));
+    for (j = 0; j < nthreads; ++j)
+        fprintf(fp, " %lu", atomic_load(&threads[j].nsteals));
+    fputc('\n', fp);
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright 2015 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _CANQV_PROBES_H
+#define _CANQV_PROBES_H
+
+/*
+ * USDT probes, provider canqv, built with -DUSDT (make USDT=1)
+ *
+ * A probe is a nop in the code and a note in the ELF file, until
+ * a tracer (bpftrace, perf, systemtap) attaches to it.
+ * The arguments are still computed, so keep them cheap.
+ * Without USDT, probes compile to nothing.
+ *
+ *	frame(iface, can_id, dlc, latency_us)	every received frame
+ *	cache_insert(iface, can_id, ncached)
+ *	cache_expire(iface, can_id, lastseen_us)
+ *	period_reset(iface, can_id, period_us)
+ *	render_start(nrows), render_end(nrows)
+ *	log_flush_start(seq, len), log_flush_end(seq, len)
+ */
+#ifdef USDT
+#include <sys/sdt.h>
+
+#define PROBE1(name, a)		DTRACE_PROBE1(canqv, name, a)
+#define PROBE2(name, a, b)	DTRACE_PROBE2(canqv, name, a, b)
+#define PROBE3(name, a, b, c)	DTRACE_PROBE3(canqv, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(canqv, name, a, b, c, d)
+#else
+#define PROBE1(name, a)		do {} while (0)
+#define PROBE2(name, a, b)	do {} while (0)
+#define PROBE3(name, a, b, c)	do {} while (0)
+#define PROBE4(name, a, b, c, d) do {} while (0)
+#endif
+
+/* seconds to integer microseconds, for the probe arguments */
+#define PROBE_USEC(t)	((long long)((t) * 1e6))
+
+#endif
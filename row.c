@@ -0,0 +1,126 @@
+/*
+ * Copyright 2015 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "canqv.h"
+
+/*
+ * screen rows, 1 per cached ID
+ *
+ * Volvo diagnostic commands show the module name on the 2nd byte.
+ */
+/* command frames are logged here, in checksummed blocks */
+#define CAPTURE_LOG "/tmp/canqv_captures.log"
+
+static int isCommand(int id) {
+    if (id >= 0xC0 && id < 0xD0) {
+        return 1;
+    }
+    return 1;
+}
+
+static char *unitName(int id) {
+    if (0x1b == id) return "MUM"; //dummy test unitname
+    if (0x40 == id) return "CEM"; //low speed can
+    if (0x51 == id) return "DIM";
+    if (0x48 == id) return "SWM";
+    if (0x29 == id) return "CCM";
+    if (0x43 == id) return "DDM";
+    if (0x45 == id) return "PDM";
+    if (0x2e == id) return "PSM";
+    if (0x46 == id) return "REM";
+    if (0x58 == id) return "SRS";
+    if (0x47 == id) return "UEM";
+    if (0x60 == id) return "AUM";
+    if (0x64 == id) return "PHM";
+    if (0x50 == id) return "CEH"; //high-speed can units with H-ending:
+    if (0x01 == id) return "BCH";
+    if (0x52 == id) return "AEM";
+    if (0x11 == id) return "ECH";
+    if (0x28 == id) return "SAH"; //SAS
+    if (0x6e == id) return "TCH";
+    if (0x62 == id) return "RTI";
+    return "";
+}
+
+static void appendLog(struct can_frame cf, const char *decoded, double t) {
+    static int opened;
+    unsigned char *row = cf.data;
+    char line[256];
+    int len;
+
+    if (!opened) {
+        logblk_open(CAPTURE_LOG);
+        opened = 1;
+    }
+    len = snprintf(line, sizeof (line), "%08x:  %02x  %3s  %02x  %02x  %02x  %02x  %02x  %02x ", cf.can_id & CAN_EFF_MASK, row[0],unitName(row[1]),row[2],row[3],row[4],row[5],row[6],row[7]);
+    if (decoded && *decoded)
+        len += snprintf(line + len, sizeof (line) - len, " %s", decoded);
+    if (len > sizeof (line) - 2)
+        len = sizeof (line) - 2;
+    line[len++] = '\n';
+    logblk_append(line, len, t);
+}
+
+void row_print(FILE *fp, const struct cache *c, int showiface, double t) {
+    char decoded[128], pgn[32];
+    int byte, command_flag = 0;
+
+    *decoded = 0;
+    if (c->plugin)
+        plugin_decode(c->plugin, c->cf.can_id,
+                decoded, sizeof (decoded));
+    if (showiface)
+        fprintf(fp, "%-8s ", iface_name(c->iface));
+    if (c->cf.can_id & CAN_ERR_FLAG)
+        fprintf(fp, "%08x:", c->cf.can_id & (CAN_ERR_FLAG | CAN_ERR_MASK));
+    else if ((c->cf.can_id & CAN_EFF_FLAG) && j1939) {
+        j1939_describe(c->cf.can_id, pgn, sizeof (pgn));
+        fprintf(fp, "%s:", pgn);
+    } else if (c->cf.can_id & CAN_EFF_FLAG)
+        fprintf(fp, "%08x:", c->cf.can_id & CAN_EFF_MASK);
+    else
+        fprintf(fp, "     %03x:", c->cf.can_id & CAN_SFF_MASK);
+    for (byte = 0; byte < c->cf.can_dlc; ++byte) {
+        if (byte == 0) {
+            if (isCommand(c->cf.data[byte]) == 1) command_flag = 1;
+        }
+        if (byte == 1) {
+            char unit[4];
+            strcpy(unit, unitName(c->cf.data[byte]));
+            if (strlen(unit) > 2 && command_flag == 1) {
+                fprintf(fp, " %3s ", unit);
+                appendLog(c->cf, decoded, t);
+            } else {
+                fprintf(fp, " %02x  ", c->cf.data[byte]);
+            }
+        } else {
+            //printf(" %3s ", "TST");
+            fprintf(fp, " %02x  ", c->cf.data[byte]);
+        }
+    }
+    for (; byte < 8; ++byte)
+        fprintf(fp, " --");
+    fprintf(fp, "\tlast=-%.3lfs", t - c->lastrx);
+    if (!isnan(c->period))
+        fprintf(fp, "\tperiod=%.3lfs", c->period);
+    if (*decoded)
+        fprintf(fp, "\t%s", decoded);
+    fprintf(fp, "\n");
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright 2015 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <malloc.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include <error.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "canqv.h"
+
+/*
+ * real-time capture profile
+ *
+ * Everything here fails soft: without the privileges, canqv
+ * still runs, it only tells why the profile is incomplete.
+ */
+int realtime;
+int rt_prio = 50;
+int rt_cpu = -1;
+/* cache entries to reserve before capture starts */
+size_t rt_cache = 4096;
+
+/* worst case, in usec */
+static atomic_ulong maxlatency, maxloop;
+
+/* touch each page, so capture does not take the first page fault */
+void rt_prefault(void *ptr, size_t len) {
+    volatile char *p = ptr;
+    size_t j, pagesize;
+
+    if (!realtime || !ptr)
+        return;
+    pagesize = sysconf(_SC_PAGESIZE);
+    for (j = 0; j < len; j += pagesize)
+        p[j] = p[j];
+}
+
+static void prefault_stack(void) {
+    char stack[256 * 1024];
+
+    memset(stack, 0, sizeof (stack));
+    __asm__ __volatile__("" : : "r" (stack) : "memory");
+}
+
+void rt_setup(void) {
+    if (!realtime)
+        return;
+    /* keep freed memory, instead of returning it and faulting it back in */
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+        error(0, errno, "realtime: mlockall failed, memory may be paged out"
+                " (needs CAP_IPC_LOCK, or a larger 'ulimit -l')");
+    prefault_stack();
+}
+
+void rt_thread(pthread_t thr, const char *who, int cpu) {
+    cpu_set_t cpus;
+    struct sched_param param = { .sched_priority = rt_prio, };
+    int ret;
+
+    if (cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        ret = pthread_setaffinity_np(thr, sizeof (cpus), &cpus);
+        if (ret)
+            error(0, ret, "pin %s to cpu %i", who, cpu);
+    }
+    if (!realtime)
+        return;
+    ret = pthread_setschedparam(thr, SCHED_FIFO, &param);
+    if (ret)
+        error(0, ret, "realtime: SCHED_FIFO %i for %s failed, running"
+                " with normal priority (needs CAP_SYS_NICE, or 'ulimit -r')",
+                rt_prio, who);
+}
+
+static void update_max(atomic_ulong *max, unsigned long val) {
+    unsigned long old;
+
+    old = atomic_load_explicit(max, memory_order_relaxed);
+    while (val > old && !atomic_compare_exchange_weak(max, &old, val))
+        ;
+}
+
+void rt_account(double latency, double loop) {
+    update_max(&maxlatency, latency * 1e6);
+    update_max(&maxloop, loop * 1e6);
+}
+
+void rt_report(FILE *fp) {
+    if (!realtime)
+        return;
+    fprintf(fp, "realtime: worst receive latency %.3lfms, worst loop %.3lfms\n",
+            atomic_load(&maxlatency) / 1e3, atomic_load(&maxloop) / 1e3);
+}
@@ -0,0 +1,127 @@
+/*
+ * Copyright 2015 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <error.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+#include "canqv.h"
+
+/* CAN socket receive path */
+
+struct can_filter *filters;
+size_t nfilters;
+
+int open_can(const char *device, int ifindex) {
+    int ret, sock;
+    static const int one = 1;
+    struct sockaddr_can addr = {.can_family = AF_CAN,};
+
+    sock = ret = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+    if (ret < 0)
+        error(1, errno, "socket PF_CAN");
+
+    if (nfilters) {
+        ret = setsockopt(sock, SOL_CAN_RAW, CAN_RAW_FILTER, filters,
+                nfilters * sizeof (*filters));
+        if (ret < 0)
+            error(1, errno, "setsockopt %li filters", nfilters);
+    }
+    /* kernel receive timestamps */
+    ret = setsockopt(sock, SOL_SOCKET, SO_TIMESTAMP, &one, sizeof (one));
+    if (ret < 0)
+        error(0, errno, "setsockopt SO_TIMESTAMP");
+    /* kernel drop counter */
+    ret = setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof (one));
+    if (ret < 0)
+        error(0, errno, "setsockopt SO_RXQ_OVFL");
+
+    addr.can_ifindex = ifindex;
+    ret = bind(sock, (struct sockaddr *) &addr, sizeof (addr));
+    if (ret < 0)
+        error(1, errno, "bind %s", device);
+    return sock;
+}
+
+/* the socket filters, for frames that do not come from a socket */
+int can_filtered(canid_t can_id) {
+    size_t j;
+
+    if (!nfilters)
+        return 0;
+    for (j = 0; j < nfilters; ++j) {
+        if (!((can_id ^ filters[j].can_id) & filters[j].can_mask))
+            return 0;
+    }
+    return 1;
+}
+
+void rxbatch_init(struct rxbatch *b) {
+    int j;
+
+    memset(b, 0, sizeof (*b));
+    for (j = 0; j < RXBATCH; ++j) {
+        b->iov[j].iov_base = &b->f[j].cf;
+        b->iov[j].iov_len = sizeof (b->f[j].cf);
+    }
+}
+
+int can_recv_batch(int sock, struct rxbatch *b, int flags) {
+    struct msghdr *msg;
+    struct cmsghdr *cmsg;
+    const struct timeval *tv;
+    int j, ret;
+
+    for (j = 0; j < RXBATCH; ++j) {
+        msg = &b->msgs[j].msg_hdr;
+        msg->msg_name = &b->addr[j];
+        msg->msg_namelen = sizeof (b->addr[j]);
+        msg->msg_iov = &b->iov[j];
+        msg->msg_iovlen = 1;
+        msg->msg_control = b->ctrl[j];
+        msg->msg_controllen = sizeof (b->ctrl[j]);
+        msg->msg_flags = 0;
+    }
+    b->n = 0;
+    ret = recvmmsg(sock, b->msgs, RXBATCH, flags, NULL);
+    if (ret <= 0)
+        return ret;
+
+    for (j = 0; j < ret; ++j) {
+        msg = &b->msgs[j].msg_hdr;
+        b->f[j].t = 0;
+        for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET)
+                continue;
+            if (cmsg->cmsg_type == SCM_TIMESTAMP) {
+                tv = (const void *) CMSG_DATA(cmsg);
+                b->f[j].t = tv->tv_sec + tv->tv_usec / 1e6;
+            } else if (cmsg->cmsg_type == SO_RXQ_OVFL)
+                memcpy(&b->drops, CMSG_DATA(cmsg), sizeof (uint32_t));
+        }
+        if (!b->f[j].t)
+            b->f[j].t = now();
+        b->ifindex[j] = b->addr[j].can_ifindex;
+    }
+    b->n = ret;
+    return ret;
+}
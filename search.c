@@ -0,0 +1,324 @@
+/*
+ * Copyright 2015 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <error.h>
+#include <pthread.h>
+
+#include "canqv.h"
+
+/*
+ * value search, for reverse engineering
+ *
+ * A search starts with all candidates (ID, byte offset, width,
+ * endianness) whose value equals X or lies in X..Y, and narrows with
+ * every next command.
+ * The IDs are copied at the start, so they keep their index. The
+ * candidates of 1 ID fit a 64bit word: bit (kind * 8 + offset).
+ * Commands come from stdin, 1 per line, and apply at the next refresh:
+ *	X, X..Y		start, or keep the candidates that equal X (lie in X..Y)
+ *	new X[..Y]	start over
+ *	c, changed	u, unchanged	+, increased	-, decreased
+ *	reset		stop searching
+ */
+#define SEARCH_SHOW	16 /* candidates listed */
+#define SEARCH_QUEUE	16 /* pending commands */
+
+int search;
+
+enum kind { U8, U16LE, U16BE, U32LE, U32BE, NKINDS, };
+static const char *const kindnames[NKINDS] = {
+    "u8", "u16le", "u16be", "u32le", "u32be",
+};
+static const int kindwidth[NKINDS] = { 1, 2, 2, 4, 4, };
+
+static struct entry {
+    int iface;
+    canid_t can_id;
+    uint8_t data[8];
+    int dlc;
+} *entries;
+static uint64_t *cands;
+static size_t nentries;
+static int active, nsteps;
+/* the command shows with at most 40 characters, and a remark */
+static char lastcmd[64];
+static unsigned long ncands;
+
+/* commands from stdin */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static char queue[SEARCH_QUEUE][64];
+static int nqueued;
+
+enum op { EQUAL, CHANGED, UNCHANGED, INCREASED, DECREASED, };
+
+static inline uint32_t value(const uint8_t *dat, int kind, int off) {
+    const uint8_t *p = dat + off;
+
+    switch (kind) {
+        case U8:
+            return p[0];
+        case U16LE:
+            return p[0] | p[1] << 8;
+        case U16BE:
+            return p[0] << 8 | p[1];
+        case U32LE:
+            return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+        default:
+            return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+    }
+}
+
+/* the candidates that fit in dlc bytes */
+static uint64_t fitting(int dlc) {
+    uint64_t bits = 0;
+    int kind, width;
+
+    for (kind = 0; kind < NKINDS; ++kind) {
+        width = kindwidth[kind];
+        if (dlc >= width)
+            bits |= ((1ULL << (dlc - width + 1)) - 1) << (kind * 8);
+    }
+    return bits;
+}
+
+static int match(int op, uint32_t prev, uint32_t val, uint32_t lo,
+        uint32_t hi) {
+    switch (op) {
+        case EQUAL:
+            return val >= lo && val <= hi;
+        case CHANGED:
+            return val != prev;
+        case UNCHANGED:
+            return val == prev;
+        case INCREASED:
+            return val > prev;
+        default:
+            return val < prev;
+    }
+}
+
+static void count(void) {
+    size_t j;
+
+    ncands = 0;
+    for (j = 0; j < nentries; ++j)
+        ncands += __builtin_popcountll(cands[j]);
+}
+
+static int start(const struct cachetab *tab) {
+    struct entry *e;
+    uint64_t *c;
+    size_t j;
+
+    e = mem_realloc(MEM_SEARCH, entries, sizeof (*entries) * (tab->n + 1));
+    if (e)
+        entries = e;
+    c = mem_realloc(MEM_SEARCH, cands, sizeof (*cands) * (tab->n + 1));
+    if (c)
+        cands = c;
+    if (!e || !c)
+        return -1;
+    nentries = 0;
+    for (j = 0; j < tab->n; ++j) {
+        if (tab->cache[j].cf.can_id & (CAN_RTR_FLAG | CAN_ERR_FLAG))
+            continue;
+        entries[nentries].iface = tab->cache[j].iface;
+        entries[nentries].can_id = tab->cache[j].cf.can_id;
+        entries[nentries].dlc = tab->cache[j].cf.can_dlc;
+        memcpy(entries[nentries].data, tab->cache[j].cf.data, 8);
+        cands[nentries] = fitting(tab->cache[j].cf.can_dlc);
+        ++nentries;
+    }
+    active = 1;
+    nsteps = 0;
+    return 0;
+}
+
+static void narrow(const struct cachetab *tab, int op, uint32_t lo,
+        uint32_t hi) {
+    struct entry *e;
+    const struct cache *c;
+    uint64_t bits, keep;
+    int bit, kind, off;
+    size_t j;
+
+    for (j = 0; j < nentries; ++j) {
+        e = entries + j;
+        c = cache_find(tab, e->iface, e->can_id);
+        if (c && c->cf.can_dlc != e->dlc) {
+            /* drop what no longer fits */
+            cands[j] &= fitting(c->cf.can_dlc);
+            e->dlc = c->cf.can_dlc;
+        }
+        keep = 0;
+        for (bits = cands[j]; bits; bits &= bits - 1) {
+            bit = __builtin_ctzll(bits);
+            kind = bit / 8;
+            off = bit % 8;
+            if (match(op, value(e->data, kind, off),
+                        value(c ? c->cf.data : e->data, kind, off), lo, hi))
+                keep |= 1ULL << bit;
+        }
+        cands[j] = keep;
+        if (c)
+            memcpy(e->data, c->cf.data, 8);
+    }
+    ++nsteps;
+}
+
+static int parse_range(const char *str, uint32_t *lo, uint32_t *hi) {
+    char *endp;
+
+    *lo = strtoul(str, &endp, 0);
+    if (endp == str)
+        return -1;
+    *hi = *lo;
+    if (!strncmp(endp, "..", 2)) {
+        str = endp + 2;
+        *hi = strtoul(str, &endp, 0);
+        if (endp == str)
+            return -1;
+    }
+    return (*endp && *endp != ' ') ? -1 : 0;
+}
+
+static void command(const struct cachetab *tab, const char *cmd) {
+    uint32_t lo = 0, hi = 0;
+    int op;
+
+    if (!strcmp(cmd, "reset")) {
+        active = 0;
+        nentries = 0;
+        snprintf(lastcmd, sizeof (lastcmd), "%.40s", cmd);
+        return;
+    }
+    if (!strcmp(cmd, "c") || !strcmp(cmd, "changed"))
+        op = CHANGED;
+    else if (!strcmp(cmd, "u") || !strcmp(cmd, "unchanged"))
+        op = UNCHANGED;
+    else if (!strcmp(cmd, "+") || !strcmp(cmd, "increased"))
+        op = INCREASED;
+    else if (!strcmp(cmd, "-") || !strcmp(cmd, "decreased"))
+        op = DECREASED;
+    else if (!strncmp(cmd, "new ", 4) && !parse_range(cmd + 4, &lo, &hi)) {
+        active = 0;
+        op = EQUAL;
+    } else if (!parse_range(cmd, &lo, &hi))
+        op = EQUAL;
+    else {
+        snprintf(lastcmd, sizeof (lastcmd), "? %.40s", cmd);
+        return;
+    }
+    snprintf(lastcmd, sizeof (lastcmd), "%.40s", cmd);
+    if (!active) {
+        if (op != EQUAL) {
+            snprintf(lastcmd, sizeof (lastcmd), "? %.40s, start with a value",
+                    cmd);
+            return;
+        }
+        if (start(tab) < 0) {
+            snprintf(lastcmd, sizeof (lastcmd), "? %.40s, out of memory", cmd);
+            return;
+        }
+    }
+    narrow(tab, op, lo, hi);
+    count();
+}
+
+static void *stdin_main(void *vp) {
+    char line[64], *str, *end;
+
+    while (fgets(line, sizeof (line), stdin)) {
+        for (str = line; *str == ' ' || *str == '\t' || *str == '='; ++str)
+            ;
+        for (end = str + strlen(str); end > str && strchr(" \t\r\n",
+                    end[-1]); --end)
+            ;
+        *end = 0;
+        if (!*str)
+            continue;
+        pthread_mutex_lock(&lock);
+        if (nqueued < SEARCH_QUEUE)
+            strcpy(queue[nqueued++], str);
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+void search_setup(void) {
+    pthread_t thr;
+    int ret;
+
+    if (!search)
+        return;
+    ret = pthread_create(&thr, NULL, stdin_main, NULL);
+    if (ret)
+        error(1, ret, "pthread_create");
+    pthread_detach(thr);
+}
+
+void search_step(const struct cachetab *tab) {
+    char cmds[SEARCH_QUEUE][64];
+    int j, n;
+
+    if (!search)
+        return;
+    pthread_mutex_lock(&lock);
+    n = nqueued;
+    memcpy(cmds, queue, sizeof (cmds[0]) * n);
+    nqueued = 0;
+    pthread_mutex_unlock(&lock);
+    for (j = 0; j < n; ++j)
+        command(tab, cmds[j]);
+}
+
+void search_render(FILE *fp) {
+    const struct entry *e;
+    uint64_t bits;
+    int bit, nshown = 0;
+    size_t j;
+
+    if (!search)
+        return;
+    if (!active) {
+        fprintf(fp, "search: type a value X or range X..Y%s%s\n",
+                *lastcmd ? ", last: " : "", lastcmd);
+        return;
+    }
+    fprintf(fp, "search: %lu candidates in %zu IDs, after %i steps, last: %s\n",
+            ncands, nentries, nsteps, lastcmd);
+    for (j = 0; j < nentries && nshown < SEARCH_SHOW; ++j) {
+        e = entries + j;
+        for (bits = cands[j]; bits && nshown < SEARCH_SHOW; bits &= bits - 1) {
+            bit = __builtin_ctzll(bits);
+            fprintf(fp, "  %-8s %*x byte %i %-5s = %u\n",
+                    iface_name(e->iface),
+                    (e->can_id & CAN_EFF_FLAG) ? 8 : 3,
+                    e->can_id & ((e->can_id & CAN_EFF_FLAG) ?
+                        CAN_EFF_MASK : CAN_SFF_MASK),
+                    bit % 8, kindnames[bit / 8],
+                    value(e->data, bit / 8, bit % 8));
+            ++nshown;
+        }
+    }
+    if (ncands > nshown)
+        fprintf(fp, "  ...\n");
+}
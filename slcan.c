@@ -0,0 +1,319 @@
+/*
+ * Copyright 2015 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <error.h>
+
+#include "canqv.h"
+
+/*
+ * serial LAWICEL (slcan) adapters, without the kernel slcan driver
+ *
+ * The tty is read in large non-blocking chunks into a fixed buffer,
+ * and parsed in place. Records are fixed width, given their type and dlc:
+ *	tiiil<dd * l>[ssss]\r		11bit data frame
+ *	Tiiiiiiiil<dd * l>[ssss]\r	29bit data frame
+ *	riiil[ssss]\r, Riiiiiiiil[ssss]\r	remote frames
+ * ssss is the adapter's msec timestamp (Z1), which wraps every minute.
+ * Anything else (command replies, BEL for errors) is skipped.
+ */
+#define SLCAN_BUFSIZE	(64 << 10)
+#define SLCAN_WRAP	60000 /* msec */
+
+static int fd = -1;
+static char buf[SLCAN_BUFSIZE];
+static size_t head, tail;
+/* host time of the last read */
+static double tread;
+/* adapter timestamps, relative to tanchor */
+static double tanchor;
+static unsigned int tslast;
+static unsigned long tsacc;
+static int tsvalid;
+static int hungup;
+
+static unsigned long nrecords, nframes, nbad, nbell, nfiltered, noverrun;
+static unsigned long long nbytes;
+
+/* parse n hex digits, returns -1 when there is a non-hex digit */
+static inline long hexn(const char *p, int n) {
+    long val = 0;
+    int d;
+
+    for (; n; --n, ++p) {
+        d = hextab[(uint8_t)*p];
+        if (!d)
+            return -1;
+        val = val << 4 | (d - 1);
+    }
+    return val;
+}
+
+static const struct {
+    int kbit;
+    char cmd;
+} bitrates[] = {
+    { 10, '0', }, { 20, '1', }, { 50, '2', }, { 100, '3', }, { 125, '4', },
+    { 250, '5', }, { 500, '6', }, { 800, '7', }, { 1000, '8', },
+};
+
+static const struct {
+    int baud;
+    speed_t speed;
+} bauds[] = {
+    { 9600, B9600, }, { 19200, B19200, }, { 38400, B38400, },
+    { 57600, B57600, }, { 115200, B115200, }, { 230400, B230400, },
+    { 460800, B460800, }, { 500000, B500000, }, { 921600, B921600, },
+    { 1000000, B1000000, }, { 2000000, B2000000, }, { 3000000, B3000000, },
+};
+
+static void command(const char *cmd) {
+    if (write(fd, cmd, strlen(cmd)) < 0)
+        error(1, errno, "write slcan");
+    tcdrain(fd);
+    /* cheap adapters need a moment between commands */
+    usleep(10000);
+}
+
+int slcan_open(const char *tty, const char *spec) {
+    struct termios tio;
+    char *endp, cmd[8];
+    int kbit, baud, j;
+    speed_t speed;
+
+    kbit = strtoul(spec, &endp, 0);
+    baud = (*endp == ',') ? strtoul(endp + 1, NULL, 0) : 115200;
+    for (j = 0; j < sizeof (bitrates) / sizeof (bitrates[0]); ++j) {
+        if (bitrates[j].kbit == kbit)
+            break;
+    }
+    if (j >= sizeof (bitrates) / sizeof (bitrates[0]))
+        error(1, 0, "slcan: bitrate %i kbit/s not supported", kbit);
+    sprintf(cmd, "S%c\r", bitrates[j].cmd);
+    for (j = 0; j < sizeof (bauds) / sizeof (bauds[0]); ++j) {
+        if (bauds[j].baud == baud)
+            break;
+    }
+    if (j >= sizeof (bauds) / sizeof (bauds[0]))
+        error(1, 0, "slcan: serial speed %i not supported", baud);
+    speed = bauds[j].speed;
+
+    fd = open(tty, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0)
+        error(1, errno, "open %s", tty);
+    if (tcgetattr(fd, &tio) < 0)
+        error(1, errno, "tcgetattr %s", tty);
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cflag &= ~CRTSCTS;
+    cfsetspeed(&tio, speed);
+    if (tcsetattr(fd, TCSANOW, &tio) < 0)
+        error(1, errno, "tcsetattr %s", tty);
+    tcflush(fd, TCIOFLUSH);
+
+    /* abort any half command, close, configure & open */
+    command("\r\r\r");
+    command("C\r");
+    command(cmd);
+    command("Z1\r");
+    command("O\r");
+    iface_register(strrchr(tty, '/') ? strrchr(tty, '/') + 1 : tty, -1);
+    return fd;
+}
+
+void slcan_close(void) {
+    if (fd < 0)
+        return;
+    if (!hungup && write(fd, "C\r", 2) < 0)
+        error(0, errno, "close slcan");
+    tcdrain(fd);
+    close(fd);
+    fd = -1;
+}
+
+static double timestamp(unsigned int ts) {
+    double t;
+
+    if (tsvalid) {
+        tsacc += (ts + SLCAN_WRAP - tslast) % SLCAN_WRAP;
+        tslast = ts;
+        t = tanchor + tsacc / 1e3;
+        /* keep up with the host clock, and missed wraps */
+        if (t <= tread && t > tread - 1)
+            return t;
+    }
+    tanchor = tread;
+    tslast = ts;
+    tsacc = 0;
+    tsvalid = 1;
+    return tread;
+}
+
+/* returns 1 when rec (without \r) holds a frame */
+static int parse(const char *rec, size_t len, struct canqv_frame *f) {
+    int idlen, rtr, j;
+    long id, dlc, ts, hi, lo;
+    const char *p;
+
+    switch (*rec) {
+        case 't': idlen = 3; rtr = 0; break;
+        case 'T': idlen = 8; rtr = 0; break;
+        case 'r': idlen = 3; rtr = 1; break;
+        case 'R': idlen = 8; rtr = 1; break;
+        default:
+            /* command reply */
+            return 0;
+    }
+    if (len < 2 + idlen)
+        goto bad;
+    id = hexn(rec + 1, idlen);
+    dlc = hextab[(uint8_t)rec[1 + idlen]] - 1;
+    if (id < 0 || dlc < 0 || dlc > CAN_MAX_DLEN)
+        goto bad;
+    p = rec + 2 + idlen;
+    j = rtr ? 0 : 2 * dlc;
+    if (len != 2 + idlen + j && len != 2 + idlen + j + 4)
+        goto bad;
+
+    f->cf.can_id = (idlen == 8) ? ((id & CAN_EFF_MASK) | CAN_EFF_FLAG) : id;
+    if (rtr)
+        f->cf.can_id |= CAN_RTR_FLAG;
+    f->cf.can_dlc = dlc;
+    memset(f->cf.data, 0, sizeof (f->cf.data));
+    for (j = 0; !rtr && j < dlc; ++j, p += 2) {
+        hi = hextab[(uint8_t)p[0]];
+        lo = hextab[(uint8_t)p[1]];
+        if (!hi || !lo)
+            goto bad;
+        f->cf.data[j] = (hi - 1) << 4 | (lo - 1);
+    }
+    if (p < rec + len) {
+        ts = hexn(p, 4);
+        if (ts < 0 || ts >= SLCAN_WRAP)
+            goto bad;
+        f->t = timestamp(ts);
+    } else
+        f->t = tread;
+    if (can_filtered(f->cf.can_id)) {
+        ++nfiltered;
+        return 0;
+    }
+    return 1;
+bad:
+    ++nbad;
+    return 0;
+}
+
+/* parse the complete records in the buffer, up to a full batch */
+static void parse_buf(struct rxbatch *b) {
+    char *p, *end, *cr;
+
+    p = buf + tail;
+    end = buf + head;
+    while (p < end && b->n < RXBATCH) {
+        if (*p == '\a') {
+            /* command error */
+            ++nbell;
+            ++p;
+            continue;
+        }
+        if (*p == '\r' || *p == '\n') {
+            ++p;
+            continue;
+        }
+        cr = memchr(p, '\r', end - p);
+        if (!cr)
+            break;
+        ++nrecords;
+        if (parse(p, cr - p, b->f + b->n)) {
+            b->ifindex[b->n] = -1;
+            ++b->n;
+        }
+        p = cr + 1;
+    }
+    tail = p - buf;
+}
+
+int slcan_read_batch(struct rxbatch *b) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN, };
+    ssize_t ret;
+
+    b->n = 0;
+    for (;;) {
+        parse_buf(b);
+        if (b->n) {
+            nframes += b->n;
+            return b->n;
+        }
+        if (tail) {
+            memmove(buf, buf + tail, head - tail);
+            head -= tail;
+            tail = 0;
+        }
+        if (head == sizeof (buf)) {
+            /* no record end in a full buffer, this is no slcan */
+            ++noverrun;
+            head = 0;
+        }
+        ret = read(fd, buf + head, sizeof (buf) - head);
+        if (ret > 0) {
+            tread = now();
+            head += ret;
+            nbytes += ret;
+            continue;
+        }
+        if (!ret || errno == EIO) {
+            /* unplugged */
+            hungup = 1;
+            return 0;
+        }
+        if (errno != EAGAIN)
+            return -1;
+        if (poll(&pfd, 1, -1) < 0)
+            return -1;
+    }
+}
+
+/* parse len bytes of records, as if read from the tty (benchmarks) */
+int slcan_parse(const char *dat, size_t len, struct rxbatch *b) {
+    if (len > sizeof (buf))
+        len = sizeof (buf);
+    memcpy(buf, dat, len);
+    head = len;
+    tail = 0;
+    tread = now();
+    nbytes += len;
+    b->n = 0;
+    parse_buf(b);
+    nframes += b->n;
+    return b->n;
+}
+
+void slcan_report(FILE *fp) {
+    if (!nbytes)
+        return;
+    fprintf(fp, "slcan: %llu bytes, %lu records, %lu frames, %lu bad, "
+            "%lu errors, %lu filtered, %lu overruns\n",
+            nbytes, nrecords, nframes, nbad, nbell, nfiltered, noverrun);
+}
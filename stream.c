@@ -0,0 +1,159 @@
+/*
+ * Copyright 2015 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <error.h>
+#include <pthread.h>
+
+#include "canqv.h"
+
+/*
+ * candump -L compatible stream
+ *
+ *	(1436509052.249713) can0 44C#44434D41505441
+ *
+ * Lines are formatted by hand into a large buffer, which is written
+ * when full, or when the receive batch was not full, i.e. when capture
+ * caught up with the bus. Under load, writes grow, when idle,
+ * every frame goes out at once.
+ */
+#define STREAM_BUFSIZE	(256 << 10)
+/* "(" 10 "." 6 ") " ifname " " 8 "#" 16 "\n", without ifname */
+#define STREAM_MAXLINE	48
+
+int stream;
+
+static char buf[STREAM_BUFSIZE];
+static size_t len;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long nframes, nwrites;
+static unsigned long long nbytes;
+
+static const char hexdigits[] = "0123456789ABCDEF";
+
+/* fixed width decimal */
+static inline char *putdec(char *p, unsigned long val, int width) {
+    int j;
+
+    for (j = width - 1; j >= 0; --j, val /= 10)
+        p[j] = '0' + val % 10;
+    return p + width;
+}
+
+static inline char *puthex(char *p, unsigned long val, int width) {
+    int j;
+
+    for (j = width - 1; j >= 0; --j, val >>= 4)
+        p[j] = hexdigits[val & 0xf];
+    return p + width;
+}
+
+static void flush(void) {
+    size_t done;
+    ssize_t ret;
+
+    TRACE_BEGIN("stream write");
+    for (done = 0; done < len; done += ret) {
+        ret = write(STDOUT_FILENO, buf + done, len - done);
+        if (ret < 0 && errno == EINTR)
+            ret = 0;
+        else if (ret < 0)
+            error(1, errno, "write stdout");
+    }
+    TRACE_END("stream write");
+    ++nwrites;
+    nbytes += len;
+    len = 0;
+}
+
+static char *format(char *p, const char *ifname, const struct canqv_frame *f) {
+    unsigned long sec, usec;
+    canid_t can_id = f->cf.can_id;
+    int j;
+
+    sec = f->t;
+    usec = (f->t - sec) * 1e6 + 0.5;
+    if (usec >= 1000000) {
+        ++sec;
+        usec -= 1000000;
+    }
+    *p++ = '(';
+    p = putdec(p, sec, 10);
+    *p++ = '.';
+    p = putdec(p, usec, 6);
+    *p++ = ')';
+    *p++ = ' ';
+    for (; *ifname; ++ifname)
+        *p++ = *ifname;
+    *p++ = ' ';
+    if (can_id & CAN_ERR_FLAG)
+        p = puthex(p, can_id & (CAN_ERR_MASK | CAN_ERR_FLAG), 8);
+    else if (can_id & CAN_EFF_FLAG)
+        p = puthex(p, can_id & CAN_EFF_MASK, 8);
+    else
+        p = puthex(p, can_id & CAN_SFF_MASK, 3);
+    *p++ = '#';
+    if (can_id & CAN_RTR_FLAG) {
+        *p++ = 'R';
+    } else {
+        for (j = 0; j < f->cf.can_dlc && j < CAN_MAX_DLEN; ++j) {
+            *p++ = hexdigits[f->cf.data[j] >> 4];
+            *p++ = hexdigits[f->cf.data[j] & 0xf];
+        }
+    }
+    *p++ = '\n';
+    return p;
+}
+
+void stream_batch(const struct rxbatch *rx, int iface) {
+    const char *ifname;
+    int j;
+
+    if (!stream)
+        return;
+    pthread_mutex_lock(&lock);
+    for (j = 0; j < rx->n; ++j) {
+        ifname = iface_name((iface >= 0) ? iface :
+                iface_from_ifindex(rx->ifindex[j]));
+        if (len + STREAM_MAXLINE + strlen(ifname) > sizeof (buf))
+            flush();
+        len = format(buf + len, ifname, rx->f + j) - buf;
+    }
+    nframes += rx->n;
+    if (rx->n < RXBATCH && len)
+        /* caught up */
+        flush();
+    pthread_mutex_unlock(&lock);
+}
+
+void stream_flush(void) {
+    pthread_mutex_lock(&lock);
+    if (len)
+        flush();
+    pthread_mutex_unlock(&lock);
+}
+
+void stream_report(FILE *fp) {
+    if (!nframes)
+        return;
+    fprintf(fp, "stream: %lu frames, %llu bytes in %lu writes "
+            "of %llu bytes avg\n",
+            nframes, nbytes, nwrites, nwrites ? nbytes / nwrites : 0ULL);
+}
@@ -0,0 +1,568 @@
+/*
+ * Copyright 2015 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <error.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+
+#include "canqv.h"
+
+/*
+ * component microbenchmarks
+ *
+ * Each benchmark times about BENCH_OPS operations of 1 component,
+ * with its setup left out, and returns ns per operation.
+ * It runs once to warm up caches & allocations, then REPS times,
+ * and min, median, mean & standard deviation are reported.
+ *	cache-insert N	insert N new IDs in an empty cache, in random order
+ *	cache-update N	update random IDs of a cache with N IDs
+ *	cache-find N	look up random IDs in a cache with N IDs
+ *	cache-expire P	sweep a cache of BENCH_EXPIRE IDs, P% of them dead,
+ *			ns per ID
+ *	grep-scan	test payloads for the pattern 'B9 XX F0', which none
+ *			holds, so the batch stays, ns per frame
+ *	stream-format	format candump -L lines, written to /dev/null
+ *	stream-printf	the same lines the way candump formats them, with
+ *			sprintf per byte and printf per line, the baseline
+ *	slcan-parse	parse slcan records with timestamps, ns per record
+ *	asc-write	format ASC lines, written to /dev/null
+ *	row-format N	format the screen rows of a cache with N IDs,
+ *			written to /dev/null, ns per row
+ *	logblk-append	append 64 byte records to a capture log on tmpfs,
+ *			with CRC & sync per block
+ *	trace-span	record a begin & end event
+ * With -H, large blocks are mapped in huge pages, as canqv -H does.
+ */
+#define BENCH_OPS	(1 << 20)
+#define BENCH_EXPIRE	2048
+#define BENCH_SEQ	4096 /* random indices, cycled */
+
+#ifndef CFLAGS
+#define CFLAGS ""
+#endif
+
+static const char help_msg[] =
+        "bench: canqv component microbenchmarks\n"
+        "usage:	bench [OPTIONS ...] [NAME ...]\n"
+        "\n"
+        "Options\n"
+        " -n, --reps=N		Repeat each benchmark N times (default 15)\n"
+        " -o, --csv=FILE		Append the results to FILE, as CSV\n"
+        " -H, --hugepages	Map large blocks in huge pages\n"
+        "\n"
+        "NAMEs select the benchmarks that start with NAME\n"
+        ;
+static struct option long_opts[] = {
+    { "help", no_argument, NULL, '?',},
+    { "reps", required_argument, NULL, 'n',},
+    { "csv", required_argument, NULL, 'o',},
+    { "hugepages", no_argument, NULL, 'H',},
+    {},
+};
+static const char optstring[] = "?n:o:H";
+
+/* what canqv.c provides to the modules */
+volatile sig_atomic_t sigterm;
+
+double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double nsec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint32_t rnd(void) {
+    static uint32_t x = 2463534242U;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+/* distinct, unordered 29bit IDs: an odd multiplier is a bijection */
+static canid_t bench_id(int j) {
+    return ((j * 0x9e3779b1U) & CAN_EFF_MASK) | CAN_EFF_FLAG;
+}
+
+static void bench_frame(struct can_frame *cf, int j) {
+    memset(cf, 0, sizeof (*cf));
+    cf->can_id = bench_id(j);
+    cf->can_dlc = 8;
+    memcpy(cf->data, &j, sizeof (j));
+}
+
+static int seq[BENCH_SEQ];
+
+static void bench_seq(int n) {
+    int j;
+
+    for (j = 0; j < BENCH_SEQ; ++j)
+        seq[j] = rnd() % n;
+}
+
+static struct cachetab tab, tmpl;
+
+static int cmpframe(const void *va, const void *vb) {
+    const struct can_frame *a = va, *b = vb;
+
+    return (a->can_id > b->can_id) - (a->can_id < b->can_id);
+}
+
+/* cache with n IDs, inserted in order, so it fills fast */
+static void fill(struct cachetab *t, int n) {
+    struct can_frame *cf;
+    int j;
+
+    cf = malloc(sizeof (*cf) * n);
+    if (!cf)
+        error(1, errno, "malloc");
+    for (j = 0; j < n; ++j)
+        bench_frame(cf + j, j);
+    qsort(cf, n, sizeof (*cf), cmpframe);
+    t->n = 0;
+    for (j = 0; j < n; ++j)
+        cache_update(t, 0, cf + j, 0);
+    free(cf);
+}
+
+static double cache_insert(int n) {
+    struct can_frame cf[BENCH_SEQ];
+    double t, sum = 0;
+    long done;
+    int j;
+
+    if (n > BENCH_SEQ)
+        n = BENCH_SEQ;
+    for (j = 0; j < n; ++j)
+        bench_frame(cf + j, j);
+    for (done = 0; done < BENCH_OPS / 16; done += n) {
+        cache_free(&tab);
+        t = nsec();
+        for (j = 0; j < n; ++j)
+            cache_update(&tab, 0, cf + j, 0);
+        sum += nsec() - t;
+    }
+    return sum / done;
+}
+
+static double cache_update_n(int n) {
+    struct can_frame cf;
+    double t;
+    long j;
+
+    fill(&tab, n);
+    bench_seq(n);
+    bench_frame(&cf, 0);
+    t = nsec();
+    for (j = 0; j < BENCH_OPS; ++j) {
+        cf.can_id = bench_id(seq[j % BENCH_SEQ]);
+        cf.data[7] = j;
+        cache_update(&tab, 0, &cf, j * 1e-4);
+    }
+    return (nsec() - t) / BENCH_OPS;
+}
+
+static double cache_find_n(int n) {
+    double t;
+    long j, nfound = 0;
+
+    fill(&tab, n);
+    bench_seq(n);
+    t = nsec();
+    for (j = 0; j < BENCH_OPS; ++j)
+        nfound += !!cache_find(&tab, 0, bench_id(seq[j % BENCH_SEQ]));
+    t = nsec() - t;
+    if (nfound != BENCH_OPS)
+        error(1, 0, "cache-find: %li of %i found", nfound, BENCH_OPS);
+    return t / BENCH_OPS;
+}
+
+static double cache_expire_p(int percent) {
+    double t, sum = 0;
+    long done;
+    size_t j;
+
+    fill(&tmpl, BENCH_EXPIRE);
+    for (j = 0; j < tmpl.n; ++j) {
+        tmpl.cache[j].lastrx = (rnd() % 100 < percent) ? 0 : deadtime;
+        tmpl.cache[j].period = 0.1;
+    }
+    for (done = 0; done < BENCH_OPS / 4; done += BENCH_EXPIRE) {
+        cache_copy(&tab, &tmpl);
+        t = nsec();
+        cache_expire(&tab, deadtime + 1);
+        sum += nsec() - t;
+    }
+    return sum / done;
+}
+
+/* a full receive batch */
+static void fill_batch(struct rxbatch *rx) {
+    int j;
+
+    for (j = 0; j < RXBATCH; ++j) {
+        bench_frame(&rx->f[j].cf, j);
+        if (j & 1)
+            rx->f[j].cf.can_id = j;
+        rx->f[j].cf.can_dlc = j % 9;
+        rx->f[j].t = 1436509052.249713 + j * 1e-3;
+        rx->ifindex[j] = 1;
+    }
+    rx->n = RXBATCH;
+}
+
+static double grep_scan(int unused) {
+    static struct rxbatch rx;
+    double t;
+    long j;
+
+    fill_batch(&rx);
+    grep_pattern = "B9 XX F0";
+    grep_setup();
+    t = nsec();
+    for (j = 0; j < BENCH_OPS; j += RXBATCH) {
+        grep_batch(&rx, 0);
+        /* nothing matched, nothing moved */
+        rx.n = RXBATCH;
+    }
+    t = nsec() - t;
+    grep_pattern = NULL;
+    return t / j;
+}
+
+static double stream_format(int unused) {
+    static struct rxbatch rx;
+    double t;
+    long j;
+    int out, devnull;
+
+    fill_batch(&rx);
+    /* stream writes stdout */
+    fflush(stdout);
+    out = dup(STDOUT_FILENO);
+    devnull = open("/dev/null", O_WRONLY);
+    if (out < 0 || devnull < 0)
+        error(1, errno, "/dev/null");
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+    stream = 1;
+    t = nsec();
+    for (j = 0; j < BENCH_OPS; j += RXBATCH)
+        stream_batch(&rx, 0);
+    stream_flush();
+    t = nsec() - t;
+    dup2(out, STDOUT_FILENO);
+    close(out);
+    return t / j;
+}
+
+/* candump's way: sprint_canframe(), then printf() through stdio */
+static void candump_line(FILE *fp, const char *ifname,
+        const struct canqv_frame *f) {
+    char frame[2 * CAN_MAX_DLEN + 16];
+    canid_t can_id = f->cf.can_id;
+    unsigned long sec, usec;
+    int len, j;
+
+    if (can_id & CAN_EFF_FLAG)
+        len = sprintf(frame, "%08X", can_id & CAN_EFF_MASK);
+    else
+        len = sprintf(frame, "%03X", can_id & CAN_SFF_MASK);
+    frame[len++] = '#';
+    if (can_id & CAN_RTR_FLAG)
+        frame[len++] = 'R';
+    else {
+        for (j = 0; j < f->cf.can_dlc; ++j)
+            len += sprintf(frame + len, "%02X", f->cf.data[j]);
+    }
+    frame[len] = 0;
+    sec = f->t;
+    usec = (f->t - sec) * 1e6;
+    fprintf(fp, "(%010lu.%06lu) %s %s\n", sec, usec, ifname, frame);
+}
+
+static double stream_printf(int unused) {
+    static struct rxbatch rx;
+    double t;
+    long j;
+    FILE *fp;
+
+    fill_batch(&rx);
+    fp = fopen("/dev/null", "w");
+    if (!fp)
+        error(1, errno, "/dev/null");
+    t = nsec();
+    for (j = 0; j < BENCH_OPS; ++j)
+        candump_line(fp, "can0", rx.f + j % RXBATCH);
+    fflush(fp);
+    t = nsec() - t;
+    fclose(fp);
+    return t / BENCH_OPS;
+}
+
+/* the 2nd data byte stays 0 below 256 IDs, so no row names a module */
+static double row_format(int n) {
+    double t;
+    long done;
+    FILE *fp;
+    int j;
+
+    fill(&tab, n);
+    fp = fopen("/dev/null", "w");
+    if (!fp)
+        error(1, errno, "/dev/null");
+    t = nsec();
+    for (done = 0; done < BENCH_OPS; done += n) {
+        for (j = 0; j < n; ++j)
+            row_print(fp, tab.cache + j, 0, 1);
+    }
+    fflush(fp);
+    t = nsec() - t;
+    fclose(fp);
+    return t / done;
+}
+
+static double slcan_parse_n(int unused) {
+    static char text[RXBATCH * 32];
+    static struct rxbatch rx;
+    struct can_frame cf;
+    size_t len = 0;
+    double t;
+    long j;
+    int k;
+
+    /* a batch of records, as a 2 Mbaud adapter sends them */
+    for (j = 0; j < RXBATCH; ++j) {
+        bench_frame(&cf, j);
+        if (j & 1)
+            len += sprintf(text + len, "t%03x", (unsigned int)j & CAN_SFF_MASK);
+        else
+            len += sprintf(text + len, "T%08x", cf.can_id & CAN_EFF_MASK);
+        len += sprintf(text + len, "%i", (int)(j % 9));
+        for (k = 0; k < j % 9; ++k)
+            len += sprintf(text + len, "%02X", cf.data[k]);
+        len += sprintf(text + len, "%04x\r", (unsigned int)(j * 7) % 60000);
+    }
+    t = nsec();
+    for (j = 0; j < BENCH_OPS; j += RXBATCH) {
+        if (slcan_parse(text, len, &rx) != RXBATCH)
+            error(1, 0, "slcan-parse: %i of %i frames", rx.n, RXBATCH);
+    }
+    return (nsec() - t) / j;
+}
+
+static double asc_write_n(int unused) {
+    static struct rxbatch rx;
+    static int created;
+    double t;
+    long j;
+
+    fill_batch(&rx);
+    if (!created) {
+        asc_create("/dev/null");
+        created = 1;
+    }
+    t = nsec();
+    for (j = 0; j < BENCH_OPS; ++j)
+        asc_write(rx.f + j % RXBATCH, 0);
+    return (nsec() - t) / BENCH_OPS;
+}
+
+static char logfile[64];
+
+static double logblk_append_n(int unused) {
+    char rec[64];
+    double t;
+    long j;
+
+    if (!*logfile) {
+        snprintf(logfile, sizeof (logfile), "%s/canqv-bench.%i",
+                access("/dev/shm", W_OK) ? "/tmp" : "/dev/shm", getpid());
+        unlink(logfile);
+        logblk_open(logfile);
+    }
+    memset(rec, 'x', sizeof (rec));
+    rec[sizeof (rec) - 1] = '\n';
+    t = nsec();
+    for (j = 0; j < BENCH_OPS / 16; ++j)
+        logblk_append(rec, sizeof (rec), j * 1e-3);
+    logblk_flush();
+    return (nsec() - t) / j;
+}
+
+static double trace_span(int unused) {
+    double t;
+    long j;
+
+    tracing = 1;
+    t = nsec();
+    for (j = 0; j < BENCH_OPS; ++j) {
+        TRACE_BEGIN("bench");
+        TRACE_END("bench");
+    }
+    t = nsec() - t;
+    tracing = 0;
+    return t / BENCH_OPS;
+}
+
+static const struct bench {
+    const char *name;
+    int param;
+    double (*run)(int param);
+} benches[] = {
+    { "cache-insert", 16, cache_insert, },
+    { "cache-insert", 256, cache_insert, },
+    { "cache-insert", 2048, cache_insert, },
+    { "cache-update", 16, cache_update_n, },
+    { "cache-update", 256, cache_update_n, },
+    { "cache-update", 2048, cache_update_n, },
+    { "cache-update", 16384, cache_update_n, },
+    { "cache-update", 65536, cache_update_n, },
+    { "cache-find", 16, cache_find_n, },
+    { "cache-find", 256, cache_find_n, },
+    { "cache-find", 2048, cache_find_n, },
+    { "cache-find", 16384, cache_find_n, },
+    { "cache-find", 65536, cache_find_n, },
+    { "cache-expire", 0, cache_expire_p, },
+    { "cache-expire", 1, cache_expire_p, },
+    { "cache-expire", 10, cache_expire_p, },
+    { "cache-expire", 50, cache_expire_p, },
+    { "grep-scan", 0, grep_scan, },
+    { "stream-format", 0, stream_format, },
+    { "stream-printf", 0, stream_printf, },
+    { "slcan-parse", 0, slcan_parse_n, },
+    { "asc-write", 0, asc_write_n, },
+    { "row-format", 16, row_format, },
+    { "row-format", 256, row_format, },
+    { "logblk-append", 0, logblk_append_n, },
+    { "trace-span", 0, trace_span, },
+    {},
+};
+
+static int cmpdouble(const void *va, const void *vb) {
+    const double *a = va, *b = vb;
+
+    return (*a > *b) - (*a < *b);
+}
+
+static int selected(const struct bench *b, char **names, int nnames) {
+    int j;
+
+    if (!nnames)
+        return 1;
+    for (j = 0; j < nnames; ++j) {
+        if (!strncmp(b->name, names[j], strlen(names[j])))
+            return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    const struct bench *b;
+    const char *csvfile = NULL;
+    FILE *csv = NULL;
+    struct utsname uts;
+    double *ns, mean, var;
+    time_t stamp;
+    int opt, reps = 15, j;
+
+    while ((opt = getopt_long(argc, argv, optstring, long_opts, NULL)) >= 0)
+        switch (opt) {
+            case 'n':
+                reps = strtoul(optarg, NULL, 0);
+                if (reps < 1)
+                    error(1, 0, "--reps %s: at least 1", optarg);
+                break;
+            case 'o':
+                csvfile = optarg;
+                break;
+            case 'H':
+                mem_hugepages = 1;
+                break;
+            default:
+                fprintf(stderr, "%s", help_msg);
+                exit(opt != '?');
+        }
+
+    ns = calloc(reps, sizeof (*ns));
+    if (!ns)
+        error(1, errno, "calloc");
+    uname(&uts);
+    time(&stamp);
+    if (csvfile) {
+        csv = fopen(csvfile, "a");
+        if (!csv)
+            error(1, errno, "open %s", csvfile);
+        if (!ftell(csv))
+            fprintf(csv, "time,version,machine,cflags,hugepages,bench,param,"
+                    "reps,min,median,mean,stddev\n");
+    }
+    iface_register("can0", 1);
+    mem_setup();
+
+    printf("%s on %s, %s%s, ns/op of %i runs\n", VERSION, uts.machine,
+            CFLAGS, mem_hugepages ? ", huge pages" : "", reps);
+    printf("%-14s %6s %10s %10s %10s %8s\n", "bench", "param", "min",
+            "median", "mean", "stddev");
+    for (b = benches; b->name; ++b) {
+        if (!selected(b, argv + optind, argc - optind))
+            continue;
+        /* warm up */
+        b->run(b->param);
+        for (mean = 0, j = 0; j < reps; ++j)
+            mean += ns[j] = b->run(b->param);
+        mean /= reps;
+        for (var = 0, j = 0; j < reps; ++j)
+            var += (ns[j] - mean) * (ns[j] - mean);
+        var = (reps > 1) ? var / (reps - 1) : 0;
+        qsort(ns, reps, sizeof (*ns), cmpdouble);
+
+        printf("%-14s %6i %10.2lf %10.2lf %10.2lf %8.2lf\n", b->name,
+                b->param, ns[0], ns[reps / 2], mean, sqrt(var));
+        fflush(stdout);
+        if (csv)
+            fprintf(csv, "%lu,%s,%s,\"%s\",%i,%s,%i,%i,%.3lf,%.3lf,%.3lf,"
+                    "%.3lf\n", (unsigned long)stamp, VERSION, uts.machine,
+                    CFLAGS, mem_hugepages, b->name, b->param, reps, ns[0],
+                    ns[reps / 2], mean, sqrt(var));
+    }
+    mem_report_hugepages(stdout);
+    if (csv)
+        fclose(csv);
+    logblk_close();
+    if (*logfile)
+        unlink(logfile);
+    asc_close_write();
+    return 0;
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright 2015 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <error.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+/*
+ * slcan adapter stand-in, on a pty
+ *
+ * ptyfeed FILE PROGRAM [ARGS ...] runs PROGRAM with each '@' argument
+ * replaced by the pty, at DIR/slcan0. Once PROGRAM opened the channel
+ * ("O\r"), the lines of FILE are sent as records (\n becomes \r).
+ * When PROGRAM read them all, the pty hangs up, as an unplugged adapter,
+ * and ptyfeed exits with the exit status of PROGRAM.
+ */
+#define FEED_TIMEOUT	5000 /* msec */
+#define FEED_QUIET	100 /* msec, the pty delivers asynchronously */
+
+static char dir[] = "/tmp/ptyfeed.XXXXXX";
+static char link_[sizeof (dir) + 8];
+
+static void cleanup(void) {
+    if (*link_)
+        unlink(link_);
+    rmdir(dir);
+}
+
+/* wait for the adapter open command */
+static void wait_open(int master) {
+    char buf[256], seen[3] = "";
+    struct pollfd pfd = { .fd = master, .events = POLLIN, };
+    int ret, j;
+
+    for (;;) {
+        ret = poll(&pfd, 1, FEED_TIMEOUT);
+        if (ret <= 0)
+            error(1, errno, "ptyfeed: no open command");
+        ret = read(master, buf, sizeof (buf));
+        if (ret <= 0)
+            error(1, errno, "ptyfeed: read");
+        for (j = 0; j < ret; ++j) {
+            seen[0] = seen[1];
+            seen[1] = buf[j];
+            if (!strcmp(seen, "O\r"))
+                return;
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    FILE *fp;
+    char *slave, buf[1024];
+    int master, tty, status, j, n, waited, quiet;
+    size_t len;
+    pid_t pid;
+
+    if (argc < 3) {
+        fprintf(stderr, "usage: ptyfeed FILE PROGRAM [ARGS ...]\n");
+        exit(1);
+    }
+    fp = fopen(argv[1], "r");
+    if (!fp)
+        error(1, errno, "open %s", argv[1]);
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0)
+        error(1, errno, "ptyfeed: pty");
+    slave = ptsname(master);
+    /* a fixed name, so the interface name is fixed */
+    if (!mkdtemp(dir))
+        error(1, errno, "mkdtemp");
+    atexit(cleanup);
+    sprintf(link_, "%s/slcan0", dir);
+    if (symlink(slave, link_) < 0)
+        error(1, errno, "symlink %s", link_);
+    for (j = 2; j < argc; ++j) {
+        if (!strcmp(argv[j], "@"))
+            argv[j] = link_;
+    }
+
+    pid = fork();
+    if (pid < 0)
+        error(1, errno, "fork");
+    if (!pid) {
+        close(master);
+        execvp(argv[2], argv + 2);
+        error(127, errno, "exec %s", argv[2]);
+    }
+
+    wait_open(master);
+    while ((len = fread(buf, 1, sizeof (buf), fp)) > 0) {
+        for (j = 0; j < len; ++j) {
+            if (buf[j] == '\n')
+                buf[j] = '\r';
+        }
+        if (write(master, buf, len) != len)
+            error(1, errno, "ptyfeed: write");
+    }
+    fclose(fp);
+
+    /* the slave's input queue drains as PROGRAM reads */
+    tty = open(slave, O_RDONLY | O_NOCTTY | O_NONBLOCK);
+    if (tty < 0)
+        error(1, errno, "open %s", slave);
+    for (waited = quiet = 0; waited < FEED_TIMEOUT && quiet < FEED_QUIET;
+            waited += 10) {
+        if (ioctl(tty, FIONREAD, &n) < 0)
+            break;
+        quiet = n ? 0 : quiet + 10;
+        usleep(10000);
+    }
+    close(tty);
+    close(master);
+
+    if (waitpid(pid, &status, 0) < 0)
+        error(1, errno, "waitpid");
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
@@ -0,0 +1,118 @@
+#!/bin/sh
+# replay regression tests
+#
+# Every tests/NAME.asc is replayed with 'canqv -d -r', on trace time,
+# with the options in tests/NAME.args. The cache trace & final dump
+# (or with -S, the stream and its write count) must equal tests/NAME.golden.
+# The replay throughput of each trace is appended to tests/timings.csv.
+#
+# Every tests/NAME.slcan is sent by tests/ptyfeed, an slcan adapter on
+# a pty, to 'canqv -d -s 500'. Those frames carry host time, so times
+# are left out of the comparison with tests/NAME.golden.
+#
+# Every tests/NAME.udp (an ASC trace) is replayed to 'canqv -e' and
+# imported by 'canqv -d -i' over localhost, by tests/udpfeed, which
+# drops 1 datagram and swaps 2. The sender's port and the times are
+# left out, the import counters are compared too.
+#
+#	UPDATE=1 sh tests/run.sh	regenerate the golden files
+
+dir=`dirname "$0"`
+canqv=${CANQV:-./canqv}
+csv=$dir/timings.csv
+tmp=${TMPDIR:-/tmp}/canqv-check.$$
+version=`$canqv -V 2>&1 | head -n 1 | sed "s/,.*//"`
+stamp=`date +%s`
+npass=0
+nfail=0
+
+trap 'rm -f "$tmp".out "$tmp".raw "$tmp".err' EXIT
+[ -f "$csv" ] || echo "time,version,test,frames,frames/s" > "$csv"
+
+for trace in "$dir"/*.asc; do
+	name=`basename "$trace" .asc`
+	args=
+	[ -f "$dir/$name.args" ] && args=`cat "$dir/$name.args"`
+	if ! $canqv -d -r "$trace" $args > "$tmp".out 2> "$tmp".err; then
+		echo "FAIL $name: exit $?"
+		cat "$tmp".err
+		nfail=$((nfail + 1))
+		continue
+	fi
+	# with -S, the stream writes are compared too
+	grep '^stream:' "$tmp".err >> "$tmp".out
+	# asc: L lines, F frames, X filtered, R frames/s
+	set -- `sed -n 's/^asc: [0-9]* lines, \([0-9]*\) frames, [0-9]* filtered, \([0-9]*\) frames\/s$/\1 \2/p' "$tmp".err`
+	frames=${1:-0}
+	rate=${2:-0}
+	if [ -n "$UPDATE" ]; then
+		cp "$tmp".out "$dir/$name.golden"
+		echo "UPDATE $name: $frames frames"
+		continue
+	fi
+	if ! diff -u "$dir/$name.golden" "$tmp".out; then
+		echo "FAIL $name"
+		nfail=$((nfail + 1))
+		continue
+	fi
+	echo "PASS $name: $frames frames, $rate frames/s"
+	echo "$stamp,$version,$name,$frames,$rate" >> "$csv"
+	npass=$((npass + 1))
+done
+
+for feed in "$dir"/*.slcan; do
+	name=`basename "$feed" .slcan`
+	if ! "$dir"/ptyfeed "$feed" $canqv -d -s 500 @ > "$tmp".raw 2> "$tmp".err; then
+		echo "FAIL $name: exit $?"
+		cat "$tmp".err
+		nfail=$((nfail + 1))
+		continue
+	fi
+	sed 's/[0-9][0-9]*\.[0-9]\{6\}/T/g' "$tmp".raw > "$tmp".out
+	# slcan: B bytes, R records, F frames, ...
+	frames=`sed -n 's/^slcan: [0-9]* bytes, [0-9]* records, \([0-9]*\) frames.*/\1/p' "$tmp".err`
+	if [ -n "$UPDATE" ]; then
+		cp "$tmp".out "$dir/$name.golden"
+		echo "UPDATE $name: $frames frames"
+		continue
+	fi
+	if ! diff -u "$dir/$name.golden" "$tmp".out; then
+		echo "FAIL $name"
+		nfail=$((nfail + 1))
+		continue
+	fi
+	echo "PASS $name: $frames frames over a pty"
+	npass=$((npass + 1))
+done
+
+for trace in "$dir"/*.udp; do
+	name=`basename "$trace" .udp`
+	if ! "$dir"/udpfeed "$trace" $canqv > "$tmp".raw 2> "$tmp".err; then
+		echo "FAIL $name: exit $?"
+		cat "$tmp".err
+		nfail=$((nfail + 1))
+		continue
+	fi
+	{
+		sed 's/[0-9][0-9]*\.[0-9]\{6\}/T/g; s/127\.0\.0\.1:[0-9]*/udp/g' "$tmp".raw
+		grep '^udp import:' "$tmp".err
+	} > "$tmp".out
+	# udp import: S senders, D datagrams, F frames, ...
+	frames=`sed -n 's/^udp import: [0-9]* senders, [0-9]* datagrams, \([0-9]*\) frames.*/\1/p' "$tmp".err`
+	if [ -n "$UPDATE" ]; then
+		cp "$tmp".out "$dir/$name.golden"
+		echo "UPDATE $name: $frames frames"
+		continue
+	fi
+	if ! diff -u "$dir/$name.golden" "$tmp".out; then
+		echo "FAIL $name"
+		nfail=$((nfail + 1))
+		continue
+	fi
+	echo "PASS $name: $frames frames over localhost"
+	npass=$((npass + 1))
+done
+
+[ -n "$UPDATE" ] && exit 0
+echo "$npass passed, $nfail failed"
+[ "$nfail" -eq 0 ]
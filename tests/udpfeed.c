@@ -0,0 +1,177 @@
+/*
+ * Copyright 2015 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <error.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+/*
+ * UDP export -> import over localhost, with a lossy relay in between
+ *
+ * udpfeed TRACE CANQV [ARGS ...] runs
+ *	CANQV -d -i 127.0.0.1:PORT [ARGS ...]		the importer, and
+ *	CANQV -d -r TRACE -e 127.0.0.1:RELAY,4,10000	the exporter,
+ * 4 frames per datagram and no timeouts, so the datagrams do not depend
+ * on timing. The relay forwards the exporter's datagrams to the importer,
+ * but drops datagram FEED_DROP and swaps FEED_SWAP with the next one.
+ * When the exporter is done, the importer is stopped, and udpfeed exits
+ * with its exit status. Only the importer's output is kept.
+ */
+#define FEED_DROP	2
+#define FEED_SWAP	4
+#define FEED_IDLE	200 /* msec without datagrams, after the exporter */
+#define FEED_TIMEOUT	5000 /* msec */
+
+static int udp_socket(struct sockaddr_in *addr) {
+    socklen_t len = sizeof (*addr);
+    int sock;
+
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0)
+        error(1, errno, "socket");
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(sock, (void *)addr, sizeof (*addr)) < 0)
+        error(1, errno, "bind");
+    if (getsockname(sock, (void *)addr, &len) < 0)
+        error(1, errno, "getsockname");
+    return sock;
+}
+
+static pid_t run(char *argv[], int quiet) {
+    pid_t pid;
+    int null;
+
+    pid = fork();
+    if (pid < 0)
+        error(1, errno, "fork");
+    if (pid)
+        return pid;
+    if (quiet) {
+        null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+    }
+    execvp(argv[0], argv);
+    error(127, errno, "exec %s", argv[0]);
+    return -1;
+}
+
+/* wait until the importer bound its port */
+static void wait_bound(struct sockaddr_in *addr, pid_t pid) {
+    int sock, waited;
+
+    for (waited = 0; waited < FEED_TIMEOUT; waited += 10) {
+        sock = socket(AF_INET, SOCK_DGRAM, 0);
+        if (sock < 0)
+            error(1, errno, "socket");
+        if (bind(sock, (void *)addr, sizeof (*addr)) < 0 &&
+                errno == EADDRINUSE) {
+            close(sock);
+            return;
+        }
+        close(sock);
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+            error(1, 0, "udpfeed: importer exited");
+        usleep(10000);
+    }
+    error(1, 0, "udpfeed: importer did not bind");
+}
+
+int main(int argc, char *argv[]) {
+    struct sockaddr_in imp = {}, relay = {};
+    struct pollfd pfd = { .events = POLLIN, };
+    static char dgram[65536], held[65536];
+    char impspec[32], expspec[48], **impargv;
+    char *expargv[] = { argv[2], "-d", "-r", argv[1], "-e", expspec, NULL, };
+    ssize_t len, heldlen = 0;
+    pid_t imppid, exppid;
+    int sock, rxsock, status, exporting, idle, n, j;
+
+    if (argc < 3) {
+        fprintf(stderr, "usage: udpfeed TRACE CANQV [ARGS ...]\n");
+        exit(1);
+    }
+    /* a free port for the importer */
+    sock = udp_socket(&imp);
+    close(sock);
+    rxsock = udp_socket(&relay);
+    snprintf(impspec, sizeof (impspec), "127.0.0.1:%i", ntohs(imp.sin_port));
+    snprintf(expspec, sizeof (expspec), "127.0.0.1:%i,4,10000",
+            ntohs(relay.sin_port));
+
+    impargv = calloc(argc + 3, sizeof (*impargv));
+    if (!impargv)
+        error(1, errno, "calloc");
+    impargv[0] = argv[2];
+    impargv[1] = "-d";
+    impargv[2] = "-i";
+    impargv[3] = impspec;
+    for (j = 3; j < argc; ++j)
+        impargv[j + 1] = argv[j];
+    imppid = run(impargv, 0);
+    wait_bound(&imp, imppid);
+    exppid = run(expargv, 1);
+
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0 || connect(sock, (void *)&imp, sizeof (imp)) < 0)
+        error(1, errno, "connect %s", impspec);
+    pfd.fd = rxsock;
+    for (n = idle = 0, exporting = 1; idle < FEED_TIMEOUT;) {
+        if (poll(&pfd, 1, FEED_IDLE) <= 0) {
+            if (exporting && waitpid(exppid, NULL, WNOHANG) == exppid)
+                exporting = 0;
+            if (!exporting)
+                break;
+            idle += FEED_IDLE;
+            continue;
+        }
+        idle = 0;
+        len = recv(rxsock, dgram, sizeof (dgram), 0);
+        if (len < 0)
+            error(1, errno, "recv");
+        j = n++;
+        if (j == FEED_DROP)
+            continue;
+        if (j == FEED_SWAP) {
+            memcpy(held, dgram, len);
+            heldlen = len;
+            continue;
+        }
+        send(sock, dgram, len, 0);
+        if (heldlen) {
+            send(sock, held, heldlen, 0);
+            heldlen = 0;
+        }
+    }
+    if (exporting)
+        error(1, 0, "udpfeed: the exporter went silent");
+
+    kill(imppid, SIGTERM);
+    if (waitpid(imppid, &status, 0) < 0)
+        error(1, errno, "waitpid");
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
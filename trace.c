@@ -0,0 +1,241 @@
+/*
+ * Copyright 2015 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include <error.h>
+#include <pthread.h>
+
+#include "canqv.h"
+
+/*
+ * event tracer
+ *
+ * Spans (begin, end) and counters go into a ring of TRACE_RING events
+ * per thread, stamped with the cycle counter (TSC on x86, the generic
+ * timer on arm64), so an event costs a few stores and no system call.
+ * Each thread writes only its own ring. A dump copies the rings and
+ * drops what got overwritten during the copy.
+ * SIGUSR1 requests a dump, done by the main loop at the next refresh.
+ * The dump is Chrome trace event JSON, for chrome://tracing or
+ * ui.perfetto.dev, and holds the last TRACE_RING events of every thread.
+ */
+#define TRACE_RING	(1 << 16) /* events per thread, power of 2 */
+
+const char *trace_file;
+int tracing;
+volatile sig_atomic_t trace_request;
+
+struct tevent {
+    uint64_t ts;
+    const char *name;
+    long long value;
+    int ph;
+};
+
+static struct tring {
+    struct tring *next;
+    char name[32];
+    int tid;
+    atomic_ulong head;
+    struct tevent ev[TRACE_RING];
+} *rings;
+static int nrings;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread struct tring *ring;
+static __thread char thrname[32];
+/* no ring, beyond the trace memory cap */
+static __thread int noring;
+
+/* cycles to usec: counter & clock at setup */
+static uint64_t tsc0;
+static double mono0;
+static unsigned long ndumps;
+
+static inline uint64_t cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t val;
+
+    __asm__ volatile ("mrs %0, cntvct_el0" : "=r" (val));
+    return val;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static double mono(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sigusr1(int sig) {
+    trace_request = 1;
+}
+
+void trace_setup(void) {
+    struct sigaction sa = { .sa_handler = sigusr1, };
+
+    if (!trace_file)
+        return;
+    sigfillset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+    tsc0 = cycles();
+    mono0 = mono();
+    tracing = 1;
+    trace_thread("main");
+}
+
+void trace_thread(const char *name) {
+    snprintf(thrname, sizeof (thrname), "%s", name);
+    if (ring)
+        strcpy(ring->name, thrname);
+}
+
+static struct tring *new_ring(void) {
+    struct tring *r;
+
+    r = mem_alloc(MEM_TRACE, sizeof (*r));
+    if (!r)
+        return NULL;
+    pthread_mutex_lock(&lock);
+    r->tid = ++nrings;
+    if (*thrname)
+        strcpy(r->name, thrname);
+    else
+        sprintf(r->name, "thread %i", r->tid);
+    r->next = rings;
+    rings = r;
+    pthread_mutex_unlock(&lock);
+    return r;
+}
+
+void trace_event(int ph, const char *name, long long value) {
+    struct tevent *e;
+    unsigned long h;
+
+    if (!ring) {
+        if (noring)
+            return;
+        ring = new_ring();
+        if (!ring) {
+            noring = 1;
+            return;
+        }
+    }
+    h = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    e = ring->ev + (h & (TRACE_RING - 1));
+    e->ts = cycles();
+    e->name = name;
+    e->value = value;
+    e->ph = ph;
+    atomic_store_explicit(&ring->head, h + 1, memory_order_release);
+}
+
+static void dump_ring(FILE *fp, struct tring *r, struct tevent *copy,
+        double tsc_per_us, int *first) {
+    unsigned long head, base, start, j;
+    struct tevent *e;
+    int depth = 0;
+
+    head = atomic_load_explicit(&r->head, memory_order_acquire);
+    base = start = (head > TRACE_RING) ? head - TRACE_RING : 0;
+    for (j = start; j < head; ++j)
+        copy[j - base] = r->ev[j & (TRACE_RING - 1)];
+    /* what the thread wrote meanwhile is lost, and the slot in progress */
+    j = atomic_load_explicit(&r->head, memory_order_acquire);
+    if (j + 1 > start + TRACE_RING)
+        start = j + 1 - TRACE_RING;
+
+    fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+            "\"tid\":%i,\"args\":{\"name\":\"%s\"}}", *first ? "" : ",",
+            r->tid, r->name);
+    *first = 0;
+    for (j = start; j < head; ++j) {
+        e = copy + (j - base);
+        if (e->ph == 'E' && !depth)
+            /* its begin was overwritten */
+            continue;
+        depth += (e->ph == 'B') - (e->ph == 'E');
+        fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3lf,"
+                "\"pid\":1,\"tid\":%i", e->name, e->ph,
+                (double)(int64_t)(e->ts - tsc0) / tsc_per_us, r->tid);
+        if (e->ph == 'C')
+            fprintf(fp, ",\"args\":{\"%s\":%lli}", e->name, e->value);
+        fputc('}', fp);
+    }
+}
+
+void trace_dump(void) {
+    struct tevent *copy;
+    struct tring *r;
+    double tsc_per_us;
+    FILE *fp;
+    int first = 1;
+
+    trace_request = 0;
+    if (!tracing)
+        return;
+    tsc_per_us = (int64_t)(cycles() - tsc0) / ((mono() - mono0) * 1e6);
+    if (!(tsc_per_us > 0))
+        tsc_per_us = 1;
+    copy = mem_alloc(MEM_TRACE, sizeof (*copy) * TRACE_RING);
+    if (!copy) {
+        error(0, errno, "trace dump");
+        return;
+    }
+    fp = fopen(trace_file, "w");
+    if (!fp) {
+        error(0, errno, "open %s", trace_file);
+        mem_free(copy);
+        return;
+    }
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    pthread_mutex_lock(&lock);
+    for (r = rings; r; r = r->next)
+        dump_ring(fp, r, copy, tsc_per_us, &first);
+    pthread_mutex_unlock(&lock);
+    fprintf(fp, "\n]}\n");
+    if (fclose(fp))
+        error(0, errno, "write %s", trace_file);
+    mem_free(copy);
+    ++ndumps;
+}
+
+void trace_report(FILE *fp) {
+    struct tring *r;
+    unsigned long nevents = 0;
+
+    if (!tracing)
+        return;
+    pthread_mutex_lock(&lock);
+    for (r = rings; r; r = r->next)
+        nevents += atomic_load(&r->head);
+    pthread_mutex_unlock(&lock);
+    fprintf(fp, "trace: %i threads, %lu events, %lu dumps to %s\n",
+            nrings, nevents, ndumps, trace_file);
+}
@@ -0,0 +1,378 @@
+/*
+ * Copyright 2015 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <error.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "canqv.h"
+
+/*
+ * CAN over UDP, in the cannelloni wire format
+ *
+ * A datagram is a 5 byte header: version 2, opcode 0 (data),
+ * an 8bit sequence number and a 16bit big endian frame count,
+ * followed by the frames: 32bit big endian can_id (with the socketcan
+ * flags), 8bit length, and the data bytes (none for remote frames).
+ *
+ * The exporter sends a datagram when it holds FRAMES frames, when the
+ * next frame would not fit in 1 ethernet MTU, or when its first frame
+ * waited MS msec. The importer shows every sender as an interface,
+ * and counts lost & reordered datagrams per sender.
+ */
+#define UDP_VERSION	2
+#define UDP_DATA	0
+#define UDP_HDRLEN	5
+#define UDP_MAXLEN	1472 /* 1500 byte MTU - IP - UDP header */
+#define UDP_FRAMELEN	(4 + 1 + CAN_MAX_DLEN)
+#define UDP_SENDERS	32
+
+/* exporter */
+static int txsock = -1;
+static int txmax = 32;
+static double txtimeout = 0.01;
+static uint8_t txbuf[UDP_MAXLEN];
+static size_t txlen;
+static int txcount;
+static uint8_t txseq;
+static double txfirst;
+static pthread_t txthr;
+static pthread_mutex_t txlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t txcond;
+static int txstop;
+static unsigned long ntxdgrams, ntxframes, ntxerrors, ntxtimeouts;
+
+/* importer */
+static int rxsock = -1;
+static uint8_t rxbuf[65536];
+static size_t rxpos, rxlen;
+static int rxleft;
+static double rxtime;
+static int rxsender;
+static struct sender {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int seq; /* next expected */
+} senders[UDP_SENDERS];
+static int nsenders;
+static unsigned long nrxdgrams, nrxframes, nrxlost, nrxreordered, nrxbad;
+static unsigned long nrxfiltered, nrxunknown;
+
+static double mono(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* split [HOST:]PORT, HOST may be [v6 address] */
+static struct addrinfo *resolve(const char *spec, int passive) {
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_DGRAM,
+        .ai_flags = passive ? AI_PASSIVE : 0,
+    };
+    struct addrinfo *ai;
+    char *host, *port;
+    int ret;
+
+    host = mem_strdup(MEM_MISC, spec);
+    if (!host)
+        error(1, errno, "strdup");
+    port = strrchr(host, ':');
+    if (port) {
+        *port++ = 0;
+        if (*host == '[' && host[strlen(host) - 1] == ']') {
+            host[strlen(host) - 1] = 0;
+            memmove(host, host + 1, strlen(host));
+        }
+    } else {
+        port = host;
+        host = NULL;
+    }
+    ret = getaddrinfo((host && *host) ? host : NULL, port, &hints, &ai);
+    if (ret)
+        error(1, 0, "%s: %s", spec, gai_strerror(ret));
+    mem_free(host ? host : port);
+    return ai;
+}
+
+/* with txlock held */
+static void send_batch(void) {
+    txbuf[0] = UDP_VERSION;
+    txbuf[1] = UDP_DATA;
+    txbuf[2] = txseq++;
+    txbuf[3] = txcount >> 8;
+    txbuf[4] = txcount;
+    if (send(txsock, txbuf, txlen, 0) < 0)
+        ++ntxerrors;
+    ++ntxdgrams;
+    ntxframes += txcount;
+    txlen = UDP_HDRLEN;
+    txcount = 0;
+}
+
+/* flush batches that wait too long, also without traffic */
+static void *tx_main(void *vp) {
+    struct timespec ts;
+    double deadline;
+
+    pthread_mutex_lock(&txlock);
+    while (!txstop) {
+        if (!txcount) {
+            pthread_cond_wait(&txcond, &txlock);
+            continue;
+        }
+        deadline = txfirst + txtimeout;
+        ts.tv_sec = deadline;
+        ts.tv_nsec = (deadline - ts.tv_sec) * 1e9;
+        pthread_cond_timedwait(&txcond, &txlock, &ts);
+        if (txcount && mono() >= txfirst + txtimeout) {
+            ++ntxtimeouts;
+            send_batch();
+        }
+    }
+    if (txcount)
+        send_batch();
+    pthread_mutex_unlock(&txlock);
+    return NULL;
+}
+
+int udp_export_open(const char *spec) {
+    struct addrinfo *ai;
+    pthread_condattr_t attr;
+    char *str, *tok;
+    int ret;
+
+    str = mem_strdup(MEM_MISC, spec);
+    if (!str)
+        error(1, errno, "strdup");
+    /* HOST:PORT[,FRAMES[,MS]] */
+    tok = strchr(str, ',');
+    if (tok) {
+        *tok++ = 0;
+        txmax = strtoul(tok, &tok, 0);
+        if (*tok == ',')
+            txtimeout = strtod(tok + 1, NULL) / 1e3;
+    }
+    if (txmax < 1)
+        txmax = 1;
+    ai = resolve(str, 0);
+    txsock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (txsock < 0)
+        error(1, errno, "socket");
+    if (connect(txsock, ai->ai_addr, ai->ai_addrlen) < 0)
+        error(1, errno, "connect %s", str);
+    freeaddrinfo(ai);
+    mem_free(str);
+
+    txlen = UDP_HDRLEN;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&txcond, &attr);
+    pthread_condattr_destroy(&attr);
+    ret = pthread_create(&txthr, NULL, tx_main, NULL);
+    if (ret)
+        error(1, ret, "pthread_create");
+    return txsock;
+}
+
+void udp_export(const struct canqv_frame *f) {
+    uint32_t id;
+    int dlc;
+
+    if (txsock < 0)
+        return;
+    dlc = (f->cf.can_id & CAN_RTR_FLAG) ? 0 : f->cf.can_dlc;
+    pthread_mutex_lock(&txlock);
+    if (txlen + 4 + 1 + dlc > sizeof (txbuf))
+        send_batch();
+    if (!txcount) {
+        txfirst = mono();
+        pthread_cond_signal(&txcond);
+    }
+    id = htonl(f->cf.can_id);
+    memcpy(txbuf + txlen, &id, 4);
+    txbuf[txlen + 4] = f->cf.can_dlc;
+    memcpy(txbuf + txlen + 5, f->cf.data, dlc);
+    txlen += 5 + dlc;
+    if (++txcount >= txmax)
+        send_batch();
+    pthread_mutex_unlock(&txlock);
+}
+
+void udp_export_close(void) {
+    if (txsock < 0)
+        return;
+    pthread_mutex_lock(&txlock);
+    txstop = 1;
+    pthread_cond_signal(&txcond);
+    pthread_mutex_unlock(&txlock);
+    pthread_join(txthr, NULL);
+    close(txsock);
+    txsock = -1;
+}
+
+int udp_import_open(const char *spec) {
+    struct addrinfo *ai;
+    static const int one = 1;
+
+    ai = resolve(spec, 1);
+    rxsock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (rxsock < 0)
+        error(1, errno, "socket");
+    setsockopt(rxsock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+    if (bind(rxsock, ai->ai_addr, ai->ai_addrlen) < 0)
+        error(1, errno, "bind %s", spec);
+    freeaddrinfo(ai);
+    return rxsock;
+}
+
+/* find or add the sender, returns its index or -1 */
+static int sender(const struct sockaddr_storage *addr, socklen_t addrlen) {
+    char host[NI_MAXHOST], serv[NI_MAXSERV], name[NI_MAXHOST + NI_MAXSERV];
+    struct sender *s;
+    int j;
+
+    for (j = 0; j < nsenders; ++j) {
+        s = senders + j;
+        if (s->addrlen == addrlen && !memcmp(&s->addr, addr, addrlen))
+            return j;
+    }
+    if (nsenders >= UDP_SENDERS)
+        return -1;
+    s = senders + nsenders;
+    memcpy(&s->addr, addr, addrlen);
+    s->addrlen = addrlen;
+    s->seq = -1;
+    if (getnameinfo((const void *)addr, addrlen, host, sizeof (host),
+                serv, sizeof (serv), NI_NUMERICHOST | NI_NUMERICSERV))
+        strcpy(host, "?");
+    snprintf(name, sizeof (name), "%s:%s", host, serv);
+    iface_register(name, -1 - nsenders);
+    return nsenders++;
+}
+
+/* receive & check a datagram, returns 1 when rxbuf holds frames */
+static int recv_dgram(void) {
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof (addr);
+    struct sender *s;
+    ssize_t ret;
+    int seq;
+
+    ret = recvfrom(rxsock, rxbuf, sizeof (rxbuf), 0, (void *)&addr, &addrlen);
+    if (ret < 0)
+        return -1;
+    rxtime = now();
+    ++nrxdgrams;
+    if (ret < UDP_HDRLEN || rxbuf[0] != UDP_VERSION || rxbuf[1] != UDP_DATA) {
+        ++nrxbad;
+        return 0;
+    }
+    rxsender = sender(&addr, addrlen);
+    if (rxsender < 0) {
+        ++nrxunknown;
+        return 0;
+    }
+    s = senders + rxsender;
+    seq = rxbuf[2];
+    if (s->seq >= 0 && seq != s->seq) {
+        if (((seq - s->seq) & 0xff) < 0x80)
+            nrxlost += (seq - s->seq) & 0xff;
+        else {
+            /* it was counted lost when it was skipped */
+            ++nrxreordered;
+            if (nrxlost)
+                --nrxlost;
+        }
+    }
+    if (s->seq < 0 || ((seq - s->seq) & 0xff) < 0x80)
+        s->seq = (seq + 1) & 0xff;
+    rxleft = rxbuf[3] << 8 | rxbuf[4];
+    rxpos = UDP_HDRLEN;
+    rxlen = ret;
+    return 1;
+}
+
+int udp_read_batch(struct rxbatch *b) {
+    struct canqv_frame *f;
+    uint32_t id;
+    int dlc, ret;
+
+    b->n = 0;
+    for (;;) {
+        while (rxleft && b->n < RXBATCH) {
+            if (rxpos + 5 > rxlen)
+                goto bad;
+            memcpy(&id, rxbuf + rxpos, 4);
+            dlc = rxbuf[rxpos + 4];
+            if (dlc > CAN_MAX_DLEN)
+                goto bad;
+            f = b->f + b->n;
+            f->cf.can_id = ntohl(id);
+            f->cf.can_dlc = dlc;
+            if (f->cf.can_id & CAN_RTR_FLAG)
+                dlc = 0;
+            if (rxpos + 5 + dlc > rxlen)
+                goto bad;
+            memset(f->cf.data, 0, sizeof (f->cf.data));
+            memcpy(f->cf.data, rxbuf + rxpos + 5, dlc);
+            rxpos += 5 + dlc;
+            --rxleft;
+            if (can_filtered(f->cf.can_id)) {
+                ++nrxfiltered;
+                continue;
+            }
+            f->t = rxtime;
+            b->ifindex[b->n++] = -1 - rxsender;
+            continue;
+bad:
+            /* truncated datagram, drop the rest */
+            ++nrxbad;
+            rxleft = 0;
+        }
+        if (b->n) {
+            nrxframes += b->n;
+            return b->n;
+        }
+        ret = recv_dgram();
+        if (ret < 0)
+            return ret;
+    }
+}
+
+void udp_report(FILE *fp) {
+    if (ntxdgrams)
+        fprintf(fp, "udp export: %lu datagrams, %lu frames (%.1lf/datagram), "
+                "%lu on timeout, %lu send errors\n",
+                ntxdgrams, ntxframes, (double)ntxframes / ntxdgrams,
+                ntxtimeouts, ntxerrors);
+    if (nrxdgrams)
+        fprintf(fp, "udp import: %i senders, %lu datagrams, %lu frames, "
+                "%lu lost, %lu reordered, %lu bad, %lu filtered, "
+                "%lu from unknown senders\n",
+                nsenders, nrxdgrams, nrxframes, nrxlost, nrxreordered,
+                nrxbad, nrxfiltered, nrxunknown);
+}
@@ -0,0 +1,549 @@
+/*
+ * Copyright 2015 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <error.h>
+#include <pthread.h>
+
+#include "canqv.h"
+
+/*
+ * UDS (ISO 14229) on top of ISO-TP: name services & negative response
+ * codes, pair requests with responses, track session & security per ECU.
+ */
+int uds;
+
+#define MAXECU		64
+#define NRC_PENDING	0x78
+#define S3_TIMEOUT	5.0 /* non-default session falls back without requests */
+#define P2_TIMEOUT	5.0 /* give up on a response, also after 0x78 */
+
+/* 11bit functional request, and 29bit functional (18DB33F1) */
+#define FUNC_SFF	0x7df
+#define FUNC_EFF	(CAN_EFF_FLAG | 0x18db33f1)
+
+struct ecu {
+    canid_t req, resp;
+    uint8_t session;
+    uint8_t security; /* unlocked level, 0 when locked */
+    uint8_t seedlevel; /* level of the seed asked for, 0 without */
+    /* outstanding request */
+    int pending;
+    uint8_t sid, sub;
+    int n78;
+    double treq, lastreq;
+    /* last completed exchange */
+    uint8_t lastsid;
+    int lastnrc; /* -1 for positive */
+    double lastlat;
+};
+
+static struct ecu ecus[MAXECU];
+static int necus;
+/* 18daxxyy pairs that found no free ECU, by their low 16 bits */
+static uint8_t dropped[65536 / 8];
+static unsigned long ndropped;
+
+/* outstanding functional request */
+static struct {
+    int valid;
+    uint8_t sid;
+    double t;
+} func;
+
+struct svcstat {
+    unsigned long n, nneg, npending, nlost;
+    double sum, min, max;
+};
+static struct svcstat svcstats[256];
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void rsp_session(struct ecu *e, const uint8_t *dat, int len);
+static void rsp_reset(struct ecu *e, const uint8_t *dat, int len);
+static void req_security(struct ecu *e, const uint8_t *dat, int len);
+static void rsp_security(struct ecu *e, const uint8_t *dat, int len);
+
+/* dispatch table, on request SID */
+static const struct service {
+    const char *name;
+    /* service has a subfunction, with suppressPosRspMsgIndicationBit */
+    int subfn;
+    void (*req)(struct ecu *e, const uint8_t *dat, int len);
+    void (*rsp)(struct ecu *e, const uint8_t *dat, int len);
+} services[256] = {
+    [0x01] = { "OBD.CurrentData", },
+    [0x02] = { "OBD.FreezeFrame", },
+    [0x03] = { "OBD.StoredDTCs", },
+    [0x04] = { "OBD.ClearDTCs", },
+    [0x07] = { "OBD.PendingDTCs", },
+    [0x09] = { "OBD.VehicleInfo", },
+    [0x0a] = { "OBD.PermanentDTCs", },
+    [0x10] = { "DiagnosticSessionControl", 1, NULL, rsp_session, },
+    [0x11] = { "ECUReset", 1, NULL, rsp_reset, },
+    [0x14] = { "ClearDiagnosticInformation", },
+    [0x19] = { "ReadDTCInformation", 1, },
+    [0x22] = { "ReadDataByIdentifier", },
+    [0x23] = { "ReadMemoryByAddress", },
+    [0x24] = { "ReadScalingDataByIdentifier", },
+    [0x27] = { "SecurityAccess", 1, req_security, rsp_security, },
+    [0x28] = { "CommunicationControl", 1, },
+    [0x29] = { "Authentication", 1, },
+    [0x2a] = { "ReadDataByPeriodicIdentifier", },
+    [0x2c] = { "DynamicallyDefineDataIdentifier", 1, },
+    [0x2e] = { "WriteDataByIdentifier", },
+    [0x2f] = { "InputOutputControlByIdentifier", },
+    [0x31] = { "RoutineControl", 1, },
+    [0x34] = { "RequestDownload", },
+    [0x35] = { "RequestUpload", },
+    [0x36] = { "TransferData", },
+    [0x37] = { "RequestTransferExit", },
+    [0x38] = { "RequestFileTransfer", },
+    [0x3d] = { "WriteMemoryByAddress", },
+    [0x3e] = { "TesterPresent", 1, },
+    [0x83] = { "AccessTimingParameter", 1, },
+    [0x84] = { "SecuredDataTransmission", },
+    [0x85] = { "ControlDTCSetting", 1, },
+    [0x86] = { "ResponseOnEvent", 1, },
+    [0x87] = { "LinkControl", 1, },
+};
+
+static const char *const nrcnames[256] = {
+    [0x10] = "generalReject",
+    [0x11] = "serviceNotSupported",
+    [0x12] = "subFunctionNotSupported",
+    [0x13] = "incorrectMessageLengthOrInvalidFormat",
+    [0x14] = "responseTooLong",
+    [0x21] = "busyRepeatRequest",
+    [0x22] = "conditionsNotCorrect",
+    [0x24] = "requestSequenceError",
+    [0x25] = "noResponseFromSubnetComponent",
+    [0x26] = "failurePreventsExecutionOfRequestedAction",
+    [0x31] = "requestOutOfRange",
+    [0x33] = "securityAccessDenied",
+    [0x35] = "invalidKey",
+    [0x36] = "exceedNumberOfAttempts",
+    [0x37] = "requiredTimeDelayNotExpired",
+    [0x70] = "uploadDownloadNotAccepted",
+    [0x71] = "transferDataSuspended",
+    [0x72] = "generalProgrammingFailure",
+    [0x73] = "wrongBlockSequenceCounter",
+    [0x78] = "responsePending",
+    [0x7e] = "subFunctionNotSupportedInActiveSession",
+    [0x7f] = "serviceNotSupportedInActiveSession",
+    [0x81] = "rpmTooHigh",
+    [0x82] = "rpmTooLow",
+    [0x83] = "engineIsRunning",
+    [0x84] = "engineIsNotRunning",
+    [0x85] = "engineRunTimeTooLow",
+    [0x86] = "temperatureTooHigh",
+    [0x87] = "temperatureTooLow",
+    [0x88] = "vehicleSpeedTooHigh",
+    [0x89] = "vehicleSpeedTooLow",
+    [0x8a] = "throttlePedalTooHigh",
+    [0x8b] = "throttlePedalTooLow",
+    [0x8c] = "transmissionRangeNotInNeutral",
+    [0x8d] = "transmissionRangeNotInGear",
+    [0x8f] = "brakeSwitchesNotClosed",
+    [0x90] = "shifterLeverNotInPark",
+    [0x91] = "torqueConverterClutchLocked",
+    [0x92] = "voltageTooHigh",
+    [0x93] = "voltageTooLow",
+};
+
+static const char *const sessionnames[] = {
+    [1] = "default",
+    [2] = "programming",
+    [3] = "extended",
+    [4] = "safety",
+};
+
+static const char *svcname(int sid) {
+    return services[sid].name ?: "?";
+}
+
+static const char *nrcname(int nrc) {
+    return nrcnames[nrc] ?: "?";
+}
+
+static const char *sessionname(int session) {
+    if (session < sizeof (sessionnames) / sizeof (sessionnames[0]) &&
+            sessionnames[session])
+        return sessionnames[session];
+    return "oem";
+}
+
+/* state handlers */
+static void rsp_session(struct ecu *e, const uint8_t *dat, int len) {
+    if (len < 2)
+        return;
+    e->session = dat[1] & 0x7f;
+    /* a session change locks the ECU */
+    e->security = 0;
+    e->seedlevel = 0;
+}
+
+static void rsp_reset(struct ecu *e, const uint8_t *dat, int len) {
+    e->session = 1;
+    e->security = 0;
+    e->seedlevel = 0;
+}
+
+static void req_security(struct ecu *e, const uint8_t *dat, int len) {
+    if (len < 2)
+        return;
+    if (dat[1] & 1)
+        /* requestSeed */
+        e->seedlevel = (dat[1] + 1) / 2;
+}
+
+static void rsp_security(struct ecu *e, const uint8_t *dat, int len) {
+    int j;
+
+    if (len < 2)
+        return;
+    if (!(dat[1] & 1)) {
+        /* sendKey accepted */
+        e->security = dat[1] / 2;
+        e->seedlevel = 0;
+        return;
+    }
+    /* an all-zero seed means: already unlocked */
+    for (j = 2; j < len; ++j) {
+        if (dat[j])
+            return;
+    }
+    if (len > 2) {
+        e->security = (dat[1] + 1) / 2;
+        e->seedlevel = 0;
+    }
+}
+
+/* ECU's */
+static struct ecu *ecu_add(canid_t req, canid_t resp) {
+    struct ecu *e;
+
+    if (necus >= MAXECU)
+        return NULL;
+    e = ecus + necus++;
+    memset(e, 0, sizeof (*e));
+    e->req = req;
+    e->resp = resp;
+    e->session = 1;
+    return e;
+}
+
+/* returns the ECU, and whether can_id is its request or response */
+static struct ecu *ecu_find(canid_t can_id, int *isreq) {
+    int j;
+
+    for (j = 0; j < necus; ++j) {
+        if (ecus[j].req == can_id) {
+            *isreq = 1;
+            return ecus + j;
+        }
+        if (ecus[j].resp == can_id) {
+            *isreq = 0;
+            return ecus + j;
+        }
+    }
+    return NULL;
+}
+
+static void account(struct ecu *e, int sid, int nrc, double t) {
+    struct svcstat *s = svcstats + sid;
+    double lat = t - e->treq;
+
+    ++s->n;
+    if (nrc >= 0)
+        ++s->nneg;
+    s->sum += lat;
+    if (s->n == 1 || lat < s->min)
+        s->min = lat;
+    if (lat > s->max)
+        s->max = lat;
+    e->lastsid = sid;
+    e->lastnrc = nrc;
+    e->lastlat = lat;
+}
+
+static void on_request(struct ecu *e, const uint8_t *dat, int len, double t) {
+    const struct service *svc = services + dat[0];
+
+    if (e->pending)
+        ++svcstats[e->sid].nlost;
+    e->pending = 0;
+    e->lastreq = t;
+    if (svc->req)
+        svc->req(e, dat, len);
+    if (svc->subfn && len > 1 && (dat[1] & 0x80))
+        /* suppressPosRspMsgIndicationBit */
+        return;
+    e->pending = 1;
+    e->sid = dat[0];
+    e->sub = (len > 1) ? dat[1] : 0;
+    e->n78 = 0;
+    e->treq = t;
+}
+
+static void on_response(struct ecu *e, const uint8_t *dat, int len, double t) {
+    const struct service *svc;
+    int sid, nrc;
+
+    if (dat[0] == 0x7f) {
+        if (len < 3)
+            return;
+        sid = dat[1];
+        nrc = dat[2];
+    } else {
+        sid = dat[0] - 0x40;
+        nrc = -1;
+    }
+    if (!e->pending || e->sid != sid) {
+        if (!func.valid || func.sid != sid)
+            /* no matching request seen */
+            return;
+        /* answer to a functional request */
+        e->treq = func.t;
+        e->pending = 1;
+        e->sid = sid;
+    }
+    if (nrc == NRC_PENDING) {
+        ++e->n78;
+        ++svcstats[sid].npending;
+        return;
+    }
+    account(e, sid, nrc, t);
+    e->pending = 0;
+    svc = services + sid;
+    if (nrc < 0 && svc->rsp)
+        svc->rsp(e, dat, len);
+}
+
+static void uds_pdu(canid_t can_id, double t, const uint8_t *dat, int len) {
+    struct ecu *e;
+    int isreq;
+
+    if (!len)
+        return;
+    pthread_mutex_lock(&lock);
+    if (can_id == FUNC_SFF || can_id == FUNC_EFF) {
+        func.valid = 1;
+        func.sid = dat[0];
+        func.t = t;
+    } else if ((e = ecu_find(can_id, &isreq)) != NULL) {
+        if (isreq)
+            on_request(e, dat, len, t);
+        else
+            on_response(e, dat, len, t);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/* 29bit normal fixed addressing, 18DA<target><source> */
+static void claim_fixed(canid_t can_id) {
+    int ta = (can_id >> 8) & 0xff, sa = can_id & 0xff, isreq;
+    canid_t other = CAN_EFF_FLAG | 0x18da0000 | sa << 8 | ta;
+    struct ecu *e = NULL;
+
+    /*
+     * the channels first: the isotp stage calls uds_pdu() with its lock
+     * held, so its lock is never taken under ours.
+     * A claim that raced with another capture thread is a no-op.
+     * The isotp stage runs after this one, and sees this frame too.
+     */
+    if (isotp_claim_pair(can_id, other, uds_pdu) < 0)
+        goto drop;
+    pthread_mutex_lock(&lock);
+    if (dropped[(can_id & 0xffff) / 8] & (1 << (can_id % 8)) ||
+            ecu_find(can_id, &isreq)) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    /* testers use 0xf0..0xfd */
+    if (sa >= 0xf0 && sa <= 0xfd)
+        e = ecu_add(can_id, other);
+    else
+        e = ecu_add(other, can_id);
+    pthread_mutex_unlock(&lock);
+    if (e)
+        return;
+drop:
+    /* all ECU's or channels taken: do not try this pair again */
+    pthread_mutex_lock(&lock);
+    if (!(dropped[(can_id & 0xffff) / 8] & (1 << (can_id % 8))))
+        ++ndropped;
+    dropped[(can_id & 0xffff) / 8] |= 1 << (can_id % 8);
+    dropped[(other & 0xffff) / 8] |= 1 << (other % 8);
+    pthread_mutex_unlock(&lock);
+}
+
+/* decode stage, see pool.c: pick up new 29bit ECU's */
+static void uds_stage(const struct canqv_frame *frames, int nframes) {
+    int j;
+    canid_t can_id;
+
+    for (j = 0; j < nframes; ++j) {
+        can_id = frames[j].cf.can_id & (CAN_EFF_FLAG | CAN_EFF_MASK);
+        if ((can_id & (CAN_EFF_FLAG | 0x1fff0000)) ==
+                (CAN_EFF_FLAG | 0x18da0000) &&
+                !(dropped[(can_id & 0xffff) / 8] & (1 << (can_id % 8))) &&
+                !isotp_channel(can_id))
+            claim_fixed(can_id);
+    }
+}
+
+/* all diagnostic traffic on 1 lane, so requests precede their responses */
+static canid_t (*next_lanekey)(canid_t can_id);
+
+static canid_t uds_lanekey(canid_t can_id) {
+    if (isotp_channel(can_id & (CAN_EFF_FLAG | CAN_EFF_MASK)) ||
+            (can_id & (CAN_EFF_FLAG | 0x1ffe0000)) ==
+            (CAN_EFF_FLAG | 0x18da0000))
+        return FUNC_SFF;
+    return next_lanekey ? next_lanekey(can_id) : can_id;
+}
+
+int uds_parse(const char *spec) {
+    char *endp;
+    canid_t req, resp;
+    struct ecu *e;
+
+    uds = 1;
+    while (spec && *spec) {
+        req = strtoul(spec, &endp, 16);
+        if ((endp - spec) > 3)
+            req |= CAN_EFF_FLAG;
+        if (*endp != ':')
+            error(1, 0, "uds '%s': expected REQ:RESP", spec);
+        spec = endp + 1;
+        resp = strtoul(spec, &endp, 16);
+        if ((endp - spec) > 3)
+            resp |= CAN_EFF_FLAG;
+        e = ecu_add(req, resp);
+        if (!e)
+            error(1, 0, "too many ECU's");
+        spec = (*endp == ',') ? endp + 1 : endp;
+    }
+    return 0;
+}
+
+void uds_setup(void) {
+    int j;
+
+    if (!uds)
+        return;
+    if (!necus) {
+        /* ISO 15765-4 11bit ID's */
+        for (j = 0; j < 8; ++j)
+            ecu_add(0x7e0 + j, 0x7e8 + j);
+    }
+    /* before the isotp stage */
+    stage_register("uds", uds_stage);
+    for (j = 0; j < necus; ++j) {
+        if (isotp_claim_pair(ecus[j].req, ecus[j].resp, uds_pdu) < 0)
+            error(1, 0, "too many ISO-TP channels");
+    }
+    if (isotp_claim_pair(FUNC_SFF, FUNC_EFF, uds_pdu) < 0)
+        error(1, 0, "too many ISO-TP channels");
+    next_lanekey = pool_lanekey;
+    pool_lanekey = uds_lanekey;
+}
+
+void uds_expire(double t) {
+    struct ecu *e;
+
+    if (!uds)
+        return;
+    pthread_mutex_lock(&lock);
+    for (e = ecus; e < ecus + necus; ++e) {
+        if (e->pending && t - e->treq > P2_TIMEOUT) {
+            ++svcstats[e->sid].nlost;
+            e->pending = 0;
+        }
+        if (e->session != 1 && t - e->lastreq > S3_TIMEOUT) {
+            e->session = 1;
+            e->security = 0;
+            e->seedlevel = 0;
+        }
+    }
+    if (func.valid && t - func.t > P2_TIMEOUT)
+        func.valid = 0;
+    pthread_mutex_unlock(&lock);
+}
+
+static void fmtid(char *buf, canid_t can_id) {
+    if (can_id & CAN_EFF_FLAG)
+        sprintf(buf, "%08x", can_id & CAN_EFF_MASK);
+    else
+        sprintf(buf, "%03x", can_id & CAN_SFF_MASK);
+}
+
+void uds_render(FILE *fp) {
+    struct ecu *e;
+    char req[12], resp[12];
+
+    if (!uds)
+        return;
+    pthread_mutex_lock(&lock);
+    for (e = ecus; e < ecus + necus; ++e) {
+        if (!e->lastreq && !e->lastsid)
+            /* never seen */
+            continue;
+        fmtid(req, e->req);
+        fmtid(resp, e->resp);
+        fprintf(fp, "uds %s>%s: session %s(%02x), security %s%.0u",
+                req, resp, sessionname(e->session), e->session,
+                e->security ? "L" : "locked", e->security);
+        if (e->seedlevel && e->seedlevel != e->security)
+            fprintf(fp, ", seed L%u", e->seedlevel);
+        if (e->pending)
+            fprintf(fp, ", waiting %s%s", svcname(e->sid),
+                    e->n78 ? " (pending)" : "");
+        if (e->lastsid && e->lastnrc < 0)
+            fprintf(fp, ", last %s %.1lfms", svcname(e->lastsid),
+                    e->lastlat * 1e3);
+        else if (e->lastsid)
+            fprintf(fp, ", last %s: %s %.1lfms", svcname(e->lastsid),
+                    nrcname(e->lastnrc), e->lastlat * 1e3);
+        fputc('\n', fp);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void uds_report(FILE *fp) {
+    int sid;
+    const struct svcstat *s;
+
+    if (!uds)
+        return;
+    isotp_report(fp);
+    if (ndropped)
+        fprintf(fp, "uds: %lu ECU's not followed, for lack of ECU's (%i) "
+                "or ISO-TP channels\n", ndropped, MAXECU);
+    for (sid = 0; sid < 256; ++sid) {
+        s = svcstats + sid;
+        if (!s->n && !s->nlost)
+            continue;
+        fprintf(fp, "uds %02x %s: %lu responses, %lu negative, %lu pending, "
+                "%lu lost, latency %.1lf/%.1lf/%.1lfms\n",
+                sid, svcname(sid), s->n, s->nneg, s->npending, s->nlost,
+                s->min * 1e3, s->n ? s->sum / s->n * 1e3 : 0.0, s->max * 1e3);
+    }
+}
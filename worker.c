@@ -0,0 +1,224 @@
+/*
+ * Copyright 2015 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include <error.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "canqv.h"
+#include "probes.h"
+
+/*
+ * threaded mode: one capture + cache worker per interface.
+ * Each worker owns its cache shard. At refresh time, it publishes
+ * a copy through a triple buffer, so neither the worker nor
+ * the renderer ever waits on the other.
+ * The single threaded capture loop runs its batches through
+ * worker_batch() as well.
+ */
+#define FRESH	0x4
+
+struct worker {
+    pthread_t thr;
+    int sock;
+    int iface;
+    int cpu;
+    struct cachetab tab;
+    /* triple buffer */
+    struct cachetab snap[3];
+    int back; /* owned by the worker */
+    atomic_int middle; /* exchanged, FRESH when not yet consumed */
+    int front; /* owned by the renderer */
+    /* statistics */
+    atomic_ulong nframes;
+};
+
+static struct worker *workers;
+static int nworkers;
+
+int worker_add(int sock, int iface) {
+    struct worker *w;
+
+    workers = mem_realloc(MEM_CAPTURE, workers,
+            sizeof (*workers) * (nworkers + 1));
+    if (!workers)
+        error(1, errno, "realloc");
+    w = workers + nworkers;
+    memset(w, 0, sizeof (*w));
+    w->sock = sock;
+    w->iface = iface;
+    w->back = 0;
+    atomic_init(&w->middle, 1);
+    w->front = 2;
+    atomic_init(&w->nframes, 0);
+    return nworkers++;
+}
+
+static void publish(struct worker *w) {
+    if (cache_copy(&w->snap[w->back], &w->tab) < 0)
+        /* the renderer keeps the previous snapshot */
+        return;
+    w->back = atomic_exchange(&w->middle, w->back | FRESH) & ~FRESH;
+}
+
+void worker_batch(struct cachetab *tab, struct rxbatch *rx, int iface,
+        double t) {
+    struct cache *c;
+    int j, n, fiface, level;
+
+    level = atomic_load_explicit(&ovl_level, memory_order_relaxed);
+    grep_batch(rx, iface);
+    heat_batch(rx, iface);
+    for (j = n = 0; j < rx->n; ++j) {
+        fiface = (iface >= 0) ? iface : iface_from_ifindex(rx->ifindex[j]);
+        PROBE4(frame, fiface, rx->f[j].cf.can_id, rx->f[j].cf.can_dlc,
+                PROBE_USEC(t - rx->f[j].t));
+        /*
+         * every frame keeps its ID alive and is judged on its payload,
+         * sampling leaves out the period
+         */
+        if (level >= OVL_SAMPLE && j % OVL_SAMPLING)
+            c = cache_touch(tab, fiface, &rx->f[j].cf, rx->f[j].t);
+        else
+            c = cache_update(tab, fiface, &rx->f[j].cf, rx->f[j].t);
+        if (level < OVL_NODECODE) {
+            pool_submit(rx->f[j].t, &rx->f[j].cf);
+            gw_frame(fiface, rx->f + j);
+        }
+        if (level >= OVL_CHANGES && c && !(c->flags & F_CHANGED))
+            continue;
+        udp_export(rx->f + j);
+        asc_write(rx->f + j, fiface);
+        /* what is left goes to the stream */
+        if (n != j) {
+            rx->f[n] = rx->f[j];
+            rx->ifindex[n] = rx->ifindex[j];
+        }
+        ++n;
+    }
+    rx->n = n;
+    stream_batch(rx, iface);
+}
+
+static void *worker_main(void *vp) {
+    struct worker *w = vp;
+    struct rxbatch *rx;
+    double t, latency, last_update = 0;
+    unsigned int lastdrops = 0;
+    int n, ret;
+
+    rx = mem_alloc(MEM_CAPTURE, sizeof (*rx));
+    if (!rx)
+        error(1, errno, "malloc");
+    rxbatch_init(rx);
+    trace_thread(iface_name(w->iface));
+    while (!sigterm) {
+        ret = can_recv_batch(w->sock, rx, MSG_WAITFORONE);
+        TRACE_BEGIN("batch");
+        t = now();
+        if (ret < 0 && errno != EAGAIN && errno != EINTR)
+            error(1, errno, "recv %s", iface_name(w->iface));
+        n = rx->n;
+        latency = n ? t - rx->f[0].t : 0;
+        worker_batch(&w->tab, rx, w->iface, t);
+        atomic_fetch_add_explicit(&w->nframes, n, memory_order_relaxed);
+        if ((t - last_update) >= REFRESH) {
+            TRACE_BEGIN("expire");
+            cache_expire(&w->tab, t);
+            publish(w);
+            TRACE_END("expire");
+            last_update = t;
+        }
+        TRACE_END("batch");
+        if (n) {
+            rt_account(latency, now() - t);
+            ovl_account(n, rx->drops - lastdrops, latency, now() - t);
+            lastdrops = rx->drops;
+        }
+    }
+    mem_free(rx);
+    return NULL;
+}
+
+void workers_start(void) {
+    int j, k, ret, ncpu;
+    struct timeval tv = { .tv_usec = 100000, };
+
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    for (j = 0; j < nworkers; ++j) {
+        /* wake up regularly, to publish when the bus is idle */
+        setsockopt(workers[j].sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+        if (realtime) {
+            cache_reserve(&workers[j].tab, rt_cache);
+            for (k = 0; k < 3; ++k)
+                cache_reserve(&workers[j].snap[k], rt_cache);
+        }
+        ret = pthread_create(&workers[j].thr, NULL, worker_main, workers + j);
+        if (ret)
+            error(1, ret, "pthread_create");
+        if (rt_cpu >= 0)
+            workers[j].cpu = (rt_cpu + j) % ncpu;
+        else if (ncpu > 1)
+            /* leave the first cpu for the renderer, when possible */
+            workers[j].cpu = (j + 1) % ncpu;
+        else
+            workers[j].cpu = -1;
+        rt_thread(workers[j].thr, iface_name(workers[j].iface),
+                workers[j].cpu);
+    }
+}
+
+void workers_collect(struct cachetab *dst) {
+    const struct cachetab *shards[nworkers ?: 1];
+    struct worker *w;
+    int j;
+
+    for (j = 0; j < nworkers; ++j) {
+        w = workers + j;
+        if (atomic_load(&w->middle) & FRESH)
+            w->front = atomic_exchange(&w->middle, w->front) & ~FRESH;
+        shards[j] = &w->snap[w->front];
+    }
+    cache_merge(dst, shards, nworkers);
+}
+
+void workers_stop(void) {
+    int j, k;
+
+    for (j = 0; j < nworkers; ++j) {
+        pthread_join(workers[j].thr, NULL);
+        close(workers[j].sock);
+        cache_free(&workers[j].tab);
+        for (k = 0; k < 3; ++k)
+            cache_free(&workers[j].snap[k]);
+    }
+}
+
+void workers_report(FILE *fp) {
+    int j;
+
+    for (j = 0; j < nworkers; ++j)
+        fprintf(fp, "worker %s: cpu %i, %lu frames\n",
+                iface_name(workers[j].iface), workers[j].cpu,
+                atomic_load(&workers[j].nframes));
+}